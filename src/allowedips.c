@@ -169,18 +169,339 @@ static struct allowedips_node *find_node(struct allowedips_node *trie, u8 bits,
 	return found;
 }
 
+/* The trie above is the source of truth, but walking it costs a dependent
+ * load for every bit that tells two prefixes apart, which for large tables is
+ * most of what a packet pays for its lookup. So after each batch of changes it
+ * is compiled into a poptrie, each node of which takes 6 bits of the key at a
+ * time. A node holds a bitmap of which of its 64 slots lead to child nodes,
+ * and another of where runs of identical leaves begin among the rest, so that
+ * the child or the leaf for a slot is found by a popcount into the contiguous
+ * run of children or leaves that belong to that node. Leaves hold the longest
+ * match for their entire slot, so the walk ends at the first slot without a
+ * child. A node may also first skip over bits that every prefix below it
+ * shares, in place of the trie's own path compression, without which a v6
+ * table of /128s under one /64 would need eleven nodes to get past the /64.
+ */
+enum { POPTRIE_STRIDE = 6, POPTRIE_MAX_SKIP = 60 };
+
+struct poptrie_node {
+	u64 vector, leafvec, skip_key;
+	u32 base0, base1, skip_leaf;
+	u8 skip_len;
+};
+
+struct allowedips_poptrie {
+	struct poptrie_node *nodes;
+	struct wg_peer **leaves;
+	struct rcu_head rcu;
+};
+
+struct poptrie_build {
+	struct poptrie_node *nodes;
+	struct wg_peer **leaves;
+	u32 nodes_len, nodes_size, leaves_len, leaves_size;
+	struct poptrie_level {
+		struct allowedips_node *child[1U << POPTRIE_STRIDE];
+		struct wg_peer *leaf[1U << POPTRIE_STRIDE];
+		struct allowedips_node *stack[2 * POPTRIE_STRIDE + 2];
+		unsigned int pos, next;
+		u32 base1;
+	} *levels;
+	struct mutex *lock;
+};
+
+/* Keys are kept as two host endian halves, with v4 addresses in the top bits
+ * of the first, so that the bits at any position can be had with a shift.
+ */
+static void poptrie_key(const struct allowedips_node *node, u64 key[2])
+{
+	if (node->bitlen == 32) {
+		key[0] = (u64)*(const u32 *)node->bits << 32;
+		key[1] = 0;
+	} else {
+		key[0] = *(const u64 *)&node->bits[0];
+		key[1] = *(const u64 *)&node->bits[8];
+	}
+}
+
+static __always_inline u64 key_bits(u64 hi, u64 lo, unsigned int pos,
+				    unsigned int len)
+{
+	u64 v;
+
+	if (pos >= 64)
+		v = lo << (pos - 64);
+	else if (pos)
+		v = (hi << pos) | (lo >> (64 - pos));
+	else
+		v = hi;
+	return v >> (64 - len);
+}
+
+static struct wg_peer *poptrie_lookup(const struct allowedips_poptrie *pt,
+				      u64 hi, u64 lo)
+{
+	const struct poptrie_node *node = pt->nodes;
+	unsigned int pos = 0;
+	u64 i;
+
+	for (;;) {
+		if (node->skip_len) {
+			if (key_bits(hi, lo, pos, node->skip_len) !=
+			    node->skip_key)
+				return pt->leaves[node->skip_leaf];
+			pos += node->skip_len;
+		}
+		i = key_bits(hi, lo, pos, POPTRIE_STRIDE);
+		if (!(node->vector & (1ULL << i)))
+			return pt->leaves[node->base0 - 1 +
+				hweight64(node->leafvec & (~0ULL >> (63 - i)))];
+		node = &pt->nodes[node->base1 +
+				  hweight64(node->vector & ((1ULL << i) - 1))];
+		pos += POPTRIE_STRIDE;
+	}
+}
+
+static bool poptrie_grow(void **array, u32 *size, u32 len, size_t elem)
+{
+	u32 new_size = max(*size * 2, 64U);
+	void *new;
+
+	if (len <= *size)
+		return true;
+	while (new_size < len)
+		new_size *= 2;
+	new = kvmalloc(new_size * elem, GFP_KERNEL);
+	if (!new)
+		return false;
+	if (*array)
+		memcpy(new, *array, *size * elem);
+	kvfree(*array);
+	*array = new;
+	*size = new_size;
+	return true;
+}
+
+static bool poptrie_add_leaf(struct poptrie_build *b, struct wg_peer *peer)
+{
+	if (!poptrie_grow((void **)&b->leaves, &b->leaves_size,
+			  b->leaves_len + 1, sizeof(*b->leaves)))
+		return false;
+	b->leaves[b->leaves_len++] = peer;
+	return true;
+}
+
+/* Fills in the node at index for the region of the key space that begins at
+ * bit pos, in which root is the shortest prefix, and def is the longest match
+ * among the prefixes that cover all of it. Its children are left for the
+ * caller to fill in from what is left in level.
+ */
+static bool poptrie_build_node(struct poptrie_build *b,
+			       struct poptrie_level *level, u32 index,
+			       struct allowedips_node *root,
+			       struct wg_peer *def, unsigned int pos)
+{
+	struct allowedips_node **stack = level->stack, *node;
+	unsigned int i, len, count, first, children = 0;
+	struct poptrie_node new = { 0 };
+	struct wg_peer *peer, *prev = NULL;
+	u64 key[2];
+
+	if (root->cidr >= pos + POPTRIE_STRIDE) {
+		new.skip_len = min_t(unsigned int, POPTRIE_MAX_SKIP,
+				     (root->cidr - pos) / POPTRIE_STRIDE *
+				     POPTRIE_STRIDE);
+		poptrie_key(root, key);
+		new.skip_key = key_bits(key[0], key[1], pos, new.skip_len);
+		new.skip_leaf = b->leaves_len;
+		if (!poptrie_add_leaf(b, def))
+			return false;
+		pos += new.skip_len;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(level->leaf); ++i) {
+		level->child[i] = NULL;
+		level->leaf[i] = def;
+	}
+
+	/* Prefixes that end within this node are painted over the slots that
+	 * they cover, parents before children, so that longer ones win. Those
+	 * that go on past it become the roots of child nodes.
+	 */
+	for (stack[0] = root, len = 1; len > 0;) {
+		node = stack[--len];
+		poptrie_key(node, key);
+		i = key_bits(key[0], key[1], pos, POPTRIE_STRIDE);
+		if (node->cidr <= pos + POPTRIE_STRIDE) {
+			peer = rcu_dereference_protected(node->peer,
+						lockdep_is_held(b->lock));
+			count = 1U << (pos + POPTRIE_STRIDE - node->cidr);
+			first = i & ~(count - 1);
+			while (peer && count--)
+				level->leaf[first + count] = peer;
+		}
+		if (node->cidr < pos + POPTRIE_STRIDE) {
+			WARN_ON(IS_ENABLED(DEBUG) &&
+				len + 2 > ARRAY_SIZE(level->stack));
+			if (rcu_access_pointer(node->bit[0]))
+				stack[len++] = rcu_dereference_protected(
+					node->bit[0], lockdep_is_held(b->lock));
+			if (rcu_access_pointer(node->bit[1]))
+				stack[len++] = rcu_dereference_protected(
+					node->bit[1], lockdep_is_held(b->lock));
+		} else if (node->cidr > pos + POPTRIE_STRIDE ||
+			   rcu_access_pointer(node->bit[0]) ||
+			   rcu_access_pointer(node->bit[1])) {
+			level->child[i] = node;
+		}
+	}
+
+	new.base0 = b->leaves_len;
+	for (i = 0; i < ARRAY_SIZE(level->leaf); ++i) {
+		if (level->child[i]) {
+			new.vector |= 1ULL << i;
+			++children;
+		} else if (!new.leafvec || level->leaf[i] != prev) {
+			new.leafvec |= 1ULL << i;
+			prev = level->leaf[i];
+			if (!poptrie_add_leaf(b, prev))
+				return false;
+		}
+	}
+
+	new.base1 = b->nodes_len;
+	if (!poptrie_grow((void **)&b->nodes, &b->nodes_size,
+			  b->nodes_len + children, sizeof(*b->nodes)))
+		return false;
+	b->nodes_len += children;
+	b->nodes[index] = new;
+
+	level->pos = pos;
+	level->next = 0;
+	level->base1 = new.base1;
+	return true;
+}
+
+/* Builds depth first, so that only one level per depth is needed. Every node
+ * below the root takes at least POPTRIE_STRIDE more bits of the key, so v6
+ * can go no deeper than 128 / POPTRIE_STRIDE + 1 levels.
+ */
+static bool poptrie_build(struct poptrie_build *b,
+			  struct allowedips_node *root)
+{
+	struct poptrie_level *level;
+	unsigned int depth = 0, i;
+
+	if (!poptrie_grow((void **)&b->nodes, &b->nodes_size, 1,
+			  sizeof(*b->nodes)))
+		return false;
+	b->nodes_len = 1;
+	if (!poptrie_build_node(b, &b->levels[0], 0, root, NULL, 0))
+		return false;
+	for (;;) {
+		level = &b->levels[depth];
+		for (i = level->next; i < ARRAY_SIZE(level->child); ++i) {
+			if (level->child[i])
+				break;
+		}
+		if (i == ARRAY_SIZE(level->child)) {
+			if (!depth--)
+				return true;
+			continue;
+		}
+		level->next = i + 1;
+		if (!poptrie_build_node(b, &b->levels[depth + 1],
+					level->base1++, level->child[i],
+					level->leaf[i],
+					level->pos + POPTRIE_STRIDE))
+			return false;
+		++depth;
+	}
+}
+
+static void poptrie_free_rcu(struct rcu_head *rcu)
+{
+	struct allowedips_poptrie *pt =
+		container_of(rcu, struct allowedips_poptrie, rcu);
+
+	kvfree(pt->nodes);
+	kvfree(pt->leaves);
+	kfree(pt);
+}
+
+static void poptrie_invalidate(struct allowedips_poptrie __rcu **poptrie,
+			       struct mutex *lock)
+{
+	struct allowedips_poptrie *pt = rcu_dereference_protected(*poptrie,
+						lockdep_is_held(lock));
+
+	if (!pt)
+		return;
+	RCU_INIT_POINTER(*poptrie, NULL);
+	call_rcu(&pt->rcu, poptrie_free_rcu);
+}
+
+/* This is an optimization only, so when it cannot allocate, lookups simply
+ * keep using the trie.
+ */
+static void poptrie_compile(struct allowedips_poptrie __rcu **poptrie,
+			    struct allowedips_node __rcu *trie,
+			    struct mutex *lock)
+{
+	struct allowedips_node *root = rcu_dereference_protected(trie,
+						lockdep_is_held(lock));
+	struct poptrie_build b = { .lock = lock };
+	struct allowedips_poptrie *pt;
+
+	if (!root || rcu_access_pointer(*poptrie))
+		return;
+
+	b.levels = kvmalloc(sizeof(*b.levels) * (128 / POPTRIE_STRIDE + 1),
+			    GFP_KERNEL);
+	pt = kzalloc(sizeof(*pt), GFP_KERNEL);
+	if (!b.levels || !pt || !poptrie_build(&b, root))
+		goto err;
+
+	kvfree(b.levels);
+	pt->nodes = b.nodes;
+	pt->leaves = b.leaves;
+	rcu_assign_pointer(*poptrie, pt);
+	return;
+
+err:
+	kvfree(b.levels);
+	kvfree(b.nodes);
+	kvfree(b.leaves);
+	kfree(pt);
+}
+
 /* Returns a strong reference to a peer */
-static struct wg_peer *lookup(struct allowedips_node __rcu *root, u8 bits,
-			      const void *be_ip)
+static struct wg_peer *lookup(struct allowedips_node __rcu *root,
+			      struct allowedips_poptrie __rcu *poptrie,
+			      u8 bits, const void *be_ip)
 {
 	/* Aligned so it can be passed to fls/fls64 */
 	u8 ip[16] __aligned(__alignof(u64));
+	struct allowedips_poptrie *pt;
 	struct allowedips_node *node;
 	struct wg_peer *peer = NULL;
 
 	swap_endian(ip, be_ip, bits);
 
 	rcu_read_lock_bh();
+	pt = rcu_dereference_bh(poptrie);
+	if (likely(pt)) {
+		if (bits == 32)
+			peer = poptrie_lookup(pt, (u64)*(u32 *)ip << 32, 0);
+		else
+			peer = poptrie_lookup(pt, ((u64 *)ip)[0],
+					      ((u64 *)ip)[1]);
+		/* A dying peer is about to be removed, which drops the
+		 * poptrie, so wait for that in the trie, as below.
+		 */
+		if (!peer || (peer = wg_peer_get_maybe_zero(peer)))
+			goto out;
+	}
 retry:
 	node = find_node(rcu_dereference_bh(root), bits, ip);
 	if (node) {
@@ -188,6 +509,7 @@ retry:
 		if (!peer)
 			goto retry;
 	}
+out:
 	rcu_read_unlock_bh();
 	return peer;
 }
@@ -288,6 +610,7 @@ static int add(struct allowedips_node __rcu **trie, u8 bits, const u8 *key,
 void wg_allowedips_init(struct allowedips *table)
 {
 	table->root4 = table->root6 = NULL;
+	table->poptrie4 = table->poptrie6 = NULL;
 	table->seq = 1;
 }
 
@@ -296,6 +619,8 @@ void wg_allowedips_free(struct allowedips *table, struct mutex *lock)
 	struct allowedips_node __rcu *old4 = table->root4, *old6 = table->root6;
 
 	++table->seq;
+	poptrie_invalidate(&table->poptrie4, lock);
+	poptrie_invalidate(&table->poptrie6, lock);
 	RCU_INIT_POINTER(table->root4, NULL);
 	RCU_INIT_POINTER(table->root6, NULL);
 	if (rcu_access_pointer(old4)) {
@@ -321,6 +646,7 @@ int wg_allowedips_insert_v4(struct allowedips *table, const struct in_addr *ip,
 	u8 key[4] __aligned(__alignof(u32));
 
 	++table->seq;
+	poptrie_invalidate(&table->poptrie4, lock);
 	swap_endian(key, (const u8 *)ip, 32);
 	return add(&table->root4, 32, key, cidr, peer, lock);
 }
@@ -332,6 +658,7 @@ int wg_allowedips_insert_v6(struct allowedips *table, const struct in6_addr *ip,
 	u8 key[16] __aligned(__alignof(u64));
 
 	++table->seq;
+	poptrie_invalidate(&table->poptrie6, lock);
 	swap_endian(key, (const u8 *)ip, 128);
 	return add(&table->root6, 128, key, cidr, peer, lock);
 }
@@ -340,10 +667,18 @@ void wg_allowedips_remove_by_peer(struct allowedips *table,
 				  struct wg_peer *peer, struct mutex *lock)
 {
 	++table->seq;
+	poptrie_invalidate(&table->poptrie4, lock);
+	poptrie_invalidate(&table->poptrie6, lock);
 	walk_remove_by_peer(&table->root4, peer, lock);
 	walk_remove_by_peer(&table->root6, peer, lock);
 }
 
+void wg_allowedips_compile(struct allowedips *table, struct mutex *lock)
+{
+	poptrie_compile(&table->poptrie4, table->root4, lock);
+	poptrie_compile(&table->poptrie6, table->root6, lock);
+}
+
 int wg_allowedips_read_node(struct allowedips_node *node, u8 ip[16], u8 *cidr)
 {
 	const unsigned int cidr_bytes = DIV_ROUND_UP(node->cidr, 8U);
@@ -361,9 +696,11 @@ struct wg_peer *wg_allowedips_lookup_dst(struct allowedips *table,
 					 struct sk_buff *skb)
 {
 	if (skb->protocol == htons(ETH_P_IP))
-		return lookup(table->root4, 32, &ip_hdr(skb)->daddr);
+		return lookup(table->root4, table->poptrie4, 32,
+			      &ip_hdr(skb)->daddr);
 	else if (skb->protocol == htons(ETH_P_IPV6))
-		return lookup(table->root6, 128, &ipv6_hdr(skb)->daddr);
+		return lookup(table->root6, table->poptrie6, 128,
+			      &ipv6_hdr(skb)->daddr);
 	return NULL;
 }
 
@@ -372,9 +709,11 @@ struct wg_peer *wg_allowedips_lookup_src(struct allowedips *table,
 					 struct sk_buff *skb)
 {
 	if (skb->protocol == htons(ETH_P_IP))
-		return lookup(table->root4, 32, &ip_hdr(skb)->saddr);
+		return lookup(table->root4, table->poptrie4, 32,
+			      &ip_hdr(skb)->saddr);
 	else if (skb->protocol == htons(ETH_P_IPV6))
-		return lookup(table->root6, 128, &ipv6_hdr(skb)->saddr);
+		return lookup(table->root6, table->poptrie6, 128,
+			      &ipv6_hdr(skb)->saddr);
 	return NULL;
 }
 
@@ -11,6 +11,7 @@
 #include <linux/ipv6.h>
 
 struct wg_peer;
+struct allowedips_poptrie;
 
 struct allowedips_node {
 	struct wg_peer __rcu *peer;
@@ -32,6 +33,8 @@ struct allowedips_node {
 struct allowedips {
 	struct allowedips_node __rcu *root4;
 	struct allowedips_node __rcu *root6;
+	struct allowedips_poptrie __rcu *poptrie4;
+	struct allowedips_poptrie __rcu *poptrie6;
 	u64 seq;
 };
 
@@ -43,6 +46,7 @@ int wg_allowedips_insert_v6(struct allowedips *table, const struct in6_addr *ip,
 			    u8 cidr, struct wg_peer *peer, struct mutex *lock);
 void wg_allowedips_remove_by_peer(struct allowedips *table,
 				  struct wg_peer *peer, struct mutex *lock);
+void wg_allowedips_compile(struct allowedips *table, struct mutex *lock);
 /* The ip input pointer should be __aligned(__alignof(u64))) */
 int wg_allowedips_read_node(struct allowedips_node *node, u8 ip[16], u8 *cidr);
 
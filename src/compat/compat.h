@@ -687,6 +687,33 @@ static inline void *skb_put_data(struct sk_buff *skb, const void *data, unsigned
 #define NAPI_STATE_NO_BUSY_POLL NAPI_STATE_SCHED
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0) || !defined(CONFIG_NET_RX_BUSY_POLL)
+#define COMPAT_CANNOT_USE_NAPI_BUSY_POLL
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+#define COMPAT_CANNOT_USE_THREADED_NAPI
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0) || !defined(CONFIG_RPS)
+#define COMPAT_CANNOT_USE_RPS_SOCK_FLOW_TABLE
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
+#include <linux/smp.h>
+typedef struct call_single_data call_single_data_t;
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 14, 0)
+#define COMPAT_CANNOT_USE_PAGE_POOL
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0) && !defined(ISRHEL7)
+#include <linux/u64_stats_sync.h>
+#define u64_stats_fetch_begin_irq u64_stats_fetch_begin_bh
+#define u64_stats_fetch_retry_irq u64_stats_fetch_retry_bh
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
 #include <linux/atomic.h>
 #ifndef atomic_read_acquire
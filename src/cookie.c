@@ -7,6 +7,7 @@
 #include "peer.h"
 #include "device.h"
 #include "messages.h"
+#include "queueing.h"
 #include "ratelimiter.h"
 #include "timers.h"
 
@@ -16,15 +17,6 @@
 #include <net/ipv6.h>
 #include <crypto/algapi.h>
 
-void wg_cookie_checker_init(struct cookie_checker *checker,
-			    struct wg_device *wg)
-{
-	init_rwsem(&checker->secret_lock);
-	checker->secret_birthdate = ktime_get_coarse_boottime_ns();
-	get_random_bytes(checker->secret, NOISE_HASH_LEN);
-	checker->device = wg;
-}
-
 enum { COOKIE_KEY_LABEL_LEN = 8 };
 static const u8 mac1_key_label[COOKIE_KEY_LABEL_LEN] = "mac1----";
 static const u8 cookie_key_label[COOKIE_KEY_LABEL_LEN] = "cookie--";
@@ -41,21 +33,91 @@ static void precompute_key(u8 key[NOISE_SYMMETRIC_KEY_LEN],
 	blake2s_final(&blake, key);
 }
 
-/* Must hold peer->handshake.static_identity->lock */
-void wg_cookie_checker_precompute_device_keys(struct cookie_checker *checker)
+static void generate_secret(struct cookie_secret *secret)
 {
-	if (likely(checker->device->static_identity.has_identity)) {
-		precompute_key(checker->cookie_encryption_key,
-			       checker->device->static_identity.static_public,
+	u8 key[NOISE_HASH_LEN];
+
+	get_random_bytes(key, NOISE_HASH_LEN);
+	blake2s_init_key(&secret->state, COOKIE_LEN, key, NOISE_HASH_LEN);
+	memzero_explicit(key, NOISE_HASH_LEN);
+	secret->birthdate = ktime_get_coarse_boottime_ns();
+}
+
+/* With a NULL pubkey, this computes keys for the all-zeros key, which is what
+ * a device without an identity uses.
+ */
+static void generate_device_keys(struct cookie_checker_keys *keys,
+				 const u8 pubkey[NOISE_PUBLIC_KEY_LEN])
+{
+	u8 mac1_key[NOISE_SYMMETRIC_KEY_LEN] = { 0 };
+
+	if (likely(pubkey)) {
+		precompute_key(keys->cookie_encryption_key, pubkey,
 			       cookie_key_label);
-		precompute_key(checker->message_mac1_key,
-			       checker->device->static_identity.static_public,
-			       mac1_key_label);
+		precompute_key(mac1_key, pubkey, mac1_key_label);
 	} else {
-		memset(checker->cookie_encryption_key, 0,
+		memset(keys->cookie_encryption_key, 0,
 		       NOISE_SYMMETRIC_KEY_LEN);
-		memset(checker->message_mac1_key, 0, NOISE_SYMMETRIC_KEY_LEN);
 	}
+	blake2s_init_key(&keys->message_mac1_state, COOKIE_LEN, mac1_key,
+			 NOISE_SYMMETRIC_KEY_LEN);
+	memzero_explicit(mac1_key, NOISE_SYMMETRIC_KEY_LEN);
+}
+
+static void secret_rotation_worker(struct work_struct *work)
+{
+	struct cookie_checker *checker = container_of(work,
+		struct cookie_checker, secret_rotation_work);
+	struct cookie_secret *next = &checker->secrets[
+		rcu_access_pointer(checker->secret) == &checker->secrets[0]];
+
+	/* Readers that saw the old secret expire while a previous run was
+	 * rotating it will have queued us again, but by now there is nothing
+	 * left to do. Only this worker writes the secrets, so the published
+	 * one can be read here without rcu_read_lock().
+	 */
+	if (!wg_birthdate_has_expired(
+		    rcu_dereference_protected(checker->secret, true)->birthdate,
+		    COOKIE_SECRET_MAX_AGE))
+		return;
+
+	/* The other slot was last published one rotation ago, and may still
+	 * be in the middle of being copied by a reader from back then.
+	 */
+	synchronize_rcu();
+	generate_secret(next);
+	rcu_assign_pointer(checker->secret, next);
+}
+
+void wg_cookie_checker_init(struct cookie_checker *checker,
+			    struct wg_device *wg)
+{
+	INIT_WORK(&checker->secret_rotation_work, secret_rotation_worker);
+	generate_secret(&checker->secrets[0]);
+	RCU_INIT_POINTER(checker->secret, &checker->secrets[0]);
+	generate_device_keys(&checker->key_slots[0], NULL);
+	RCU_INIT_POINTER(checker->keys, &checker->key_slots[0]);
+	checker->device = wg;
+}
+
+void wg_cookie_checker_uninit(struct cookie_checker *checker)
+{
+	cancel_work_sync(&checker->secret_rotation_work);
+	memzero_explicit(checker->secrets, sizeof(checker->secrets));
+	memzero_explicit(checker->key_slots, sizeof(checker->key_slots));
+}
+
+/* Must hold peer->handshake.static_identity->lock */
+void wg_cookie_checker_precompute_device_keys(struct cookie_checker *checker)
+{
+	struct cookie_checker_keys *next = &checker->key_slots[
+		rcu_access_pointer(checker->keys) == &checker->key_slots[0]];
+
+	synchronize_rcu();
+	generate_device_keys(next,
+		likely(checker->device->static_identity.has_identity) ?
+		checker->device->static_identity.static_public : NULL);
+	rcu_assign_pointer(checker->keys, next);
 }
 
 void wg_cookie_checker_precompute_peer_keys(struct wg_peer *peer)
@@ -72,12 +134,23 @@ void wg_cookie_init(struct cookie *cookie)
 	init_rwsem(&cookie->lock);
 }
 
-static void compute_mac1(u8 mac1[COOKIE_LEN], const void *message, size_t len,
-			 const u8 key[NOISE_SYMMETRIC_KEY_LEN])
+/* The state is consumed, so it must be a copy of any precomputed one. */
+static void compute_mac1_keyed(u8 mac1[COOKIE_LEN], const void *message,
+			       size_t len, struct blake2s_state *state)
 {
 	len = len - sizeof(struct message_macs) +
 	      offsetof(struct message_macs, mac1);
-	blake2s(mac1, message, key, COOKIE_LEN, len, NOISE_SYMMETRIC_KEY_LEN);
+	blake2s_update(state, message, len);
+	blake2s_final(state, mac1);
+}
+
+static void compute_mac1(u8 mac1[COOKIE_LEN], const void *message, size_t len,
+			 const u8 key[NOISE_SYMMETRIC_KEY_LEN])
+{
+	struct blake2s_state state;
+
+	blake2s_init_key(&state, COOKIE_LEN, key, NOISE_SYMMETRIC_KEY_LEN);
+	compute_mac1_keyed(mac1, message, len, &state);
 }
 
 static void compute_mac2(u8 mac2[COOKIE_LEN], const void *message, size_t len,
@@ -91,19 +164,21 @@ static void compute_mac2(u8 mac2[COOKIE_LEN], const void *message, size_t len,
 static void make_cookie(u8 cookie[COOKIE_LEN], struct sk_buff *skb,
 			struct cookie_checker *checker)
 {
+	struct cookie_secret *secret;
 	struct blake2s_state state;
 
-	if (wg_birthdate_has_expired(checker->secret_birthdate,
-				     COOKIE_SECRET_MAX_AGE)) {
-		down_write(&checker->secret_lock);
-		checker->secret_birthdate = ktime_get_coarse_boottime_ns();
-		get_random_bytes(checker->secret, NOISE_HASH_LEN);
-		up_write(&checker->secret_lock);
-	}
-
-	down_read(&checker->secret_lock);
+	rcu_read_lock_bh();
+	secret = rcu_dereference_bh(checker->secret);
+	/* Until the worker has published a new secret, which takes a grace
+	 * period, the expired one keeps being used, rather than stalling.
+	 */
+	if (unlikely(wg_birthdate_has_expired(secret->birthdate,
+					      COOKIE_SECRET_MAX_AGE)))
+		queue_work(system_power_efficient_wq,
+			   &checker->secret_rotation_work);
+	state = secret->state;
+	rcu_read_unlock_bh();
 
-	blake2s_init_key(&state, COOKIE_LEN, checker->secret, NOISE_HASH_LEN);
 	if (skb->protocol == htons(ETH_P_IP))
 		blake2s_update(&state, (u8 *)&ip_hdr(skb)->saddr,
 			       sizeof(struct in_addr));
@@ -112,45 +187,133 @@ static void make_cookie(u8 cookie[COOKIE_LEN], struct sk_buff *skb,
 			       sizeof(struct in6_addr));
 	blake2s_update(&state, (u8 *)&udp_hdr(skb)->source, sizeof(__be16));
 	blake2s_final(&state, cookie);
-
-	up_read(&checker->secret_lock);
 }
 
-enum cookie_mac_state wg_cookie_validate_packet(struct cookie_checker *checker,
-						struct sk_buff *skb,
-						bool check_cookie)
+bool wg_cookie_validate_mac1(struct cookie_checker *checker,
+			     struct sk_buff *skb)
 {
 	struct message_macs *macs = (struct message_macs *)
 		(skb->data + skb->len - sizeof(*macs));
-	enum cookie_mac_state ret;
 	u8 computed_mac[COOKIE_LEN];
-	u8 cookie[COOKIE_LEN];
-
-	ret = INVALID_MAC;
-	compute_mac1(computed_mac, skb->data, skb->len,
-		     checker->message_mac1_key);
-	if (crypto_memneq(computed_mac, macs->mac1, COOKIE_LEN))
-		goto out;
-
-	ret = VALID_MAC_BUT_NO_COOKIE;
+	struct blake2s_state state;
 
-	if (!check_cookie)
-		goto out;
+	rcu_read_lock_bh();
+	state = rcu_dereference_bh(checker->keys)->message_mac1_state;
+	rcu_read_unlock_bh();
 
-	make_cookie(cookie, skb, checker);
+	compute_mac1_keyed(computed_mac, skb->data, skb->len, &state);
+	return !crypto_memneq(computed_mac, macs->mac1, COOKIE_LEN);
+}
 
-	compute_mac2(computed_mac, skb->data, skb->len, cookie);
-	if (crypto_memneq(computed_mac, macs->mac2, COOKIE_LEN))
-		goto out;
+/* Computes the MACs at mac_offset of packets that all have the same length,
+ * side by side, each continuing from its lane of states.
+ */
+static void compute_macs(u8 (*out)[COOKIE_LEN], struct sk_buff *const skbs[],
+			 struct blake2s_state *states, unsigned int count,
+			 size_t mac_offset)
+{
+	const size_t len = skbs[0]->len - sizeof(struct message_macs) +
+			   mac_offset;
+	const u8 *ins[COOKIE_BATCH_MAX];
+	u8 *outs[COOKIE_BATCH_MAX];
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		ins[i] = skbs[i]->data;
+		outs[i] = out[i];
+	}
+	blake2s_final_lanes(states, ins, len, outs, count);
+}
 
-	ret = VALID_MAC_WITH_COOKIE_BUT_RATELIMITED;
-	if (!wg_ratelimiter_allow(skb, dev_net(checker->device->dev)))
-		goto out;
+static struct message_macs *packet_macs(struct sk_buff *skb)
+{
+	return (struct message_macs *)(skb->data + skb->len -
+				       sizeof(struct message_macs));
+}
 
-	ret = VALID_MAC_WITH_COOKIE;
+void wg_cookie_validate_packets(struct cookie_checker *checker,
+				struct sk_buff *const skbs[],
+				const bool check_cookie[],
+				enum cookie_mac_state states[],
+				unsigned int count)
+{
+	static const __le32 types[] = {
+		cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION),
+		cpu_to_le32(MESSAGE_HANDSHAKE_RESPONSE)
+	};
+	struct blake2s_state lanes[COOKIE_BATCH_MAX], mac1_state;
+	u8 computed_macs[COOKIE_BATCH_MAX][COOKIE_LEN];
+	struct sk_buff *group[COOKIE_BATCH_MAX];
+	unsigned int index[COOKIE_BATCH_MAX];
+	unsigned int i, t, n;
+	u8 cookie[COOKIE_LEN];
 
-out:
-	return ret;
+	if (WARN_ON(count > COOKIE_BATCH_MAX))
+		count = COOKIE_BATCH_MAX;
+
+	rcu_read_lock_bh();
+	mac1_state = rcu_dereference_bh(checker->keys)->message_mac1_state;
+	rcu_read_unlock_bh();
+
+	for (i = 0; i < count; ++i)
+		states[i] = INVALID_MAC;
+
+	/* Packets of one type all have the same length, which is what lets
+	 * their MACs be computed together.
+	 */
+	for (t = 0; t < ARRAY_SIZE(types); ++t) {
+		for (i = 0, n = 0; i < count; ++i) {
+			if (((struct message_header *)skbs[i]->data)->type !=
+			    types[t])
+				continue;
+			if (PACKET_CB(skbs[i])->mac1_validated) {
+				states[i] = VALID_MAC_BUT_NO_COOKIE;
+				continue;
+			}
+			lanes[n] = mac1_state;
+			group[n] = skbs[i];
+			index[n++] = i;
+		}
+		if (n) {
+			compute_macs(computed_macs, group, lanes, n,
+				     offsetof(struct message_macs, mac1));
+			for (i = 0; i < n; ++i) {
+				if (!crypto_memneq(computed_macs[i],
+						   packet_macs(group[i])->mac1,
+						   COOKIE_LEN))
+					states[index[i]] =
+						VALID_MAC_BUT_NO_COOKIE;
+			}
+		}
+
+		for (i = 0, n = 0; i < count; ++i) {
+			if (((struct message_header *)skbs[i]->data)->type !=
+			    types[t] || !check_cookie[i] ||
+			    states[i] != VALID_MAC_BUT_NO_COOKIE)
+				continue;
+			make_cookie(cookie, skbs[i], checker);
+			blake2s_init_key(&lanes[n], COOKIE_LEN, cookie,
+					 COOKIE_LEN);
+			group[n] = skbs[i];
+			index[n++] = i;
+		}
+		if (!n)
+			continue;
+		compute_macs(computed_macs, group, lanes, n,
+			     offsetof(struct message_macs, mac2));
+		for (i = 0; i < n; ++i) {
+			if (crypto_memneq(computed_macs[i],
+					  packet_macs(group[i])->mac2,
+					  COOKIE_LEN))
+				continue;
+			states[index[i]] =
+				wg_ratelimiter_allow(group[i],
+					dev_net(checker->device->dev)) ?
+				VALID_MAC_WITH_COOKIE :
+				VALID_MAC_WITH_COOKIE_BUT_RATELIMITED;
+		}
+	}
+	memzero_explicit(cookie, COOKIE_LEN);
 }
 
 void wg_cookie_add_mac_to_packet(void *message, size_t len,
@@ -183,6 +346,7 @@ void wg_cookie_message_create(struct message_handshake_cookie *dst,
 {
 	struct message_macs *macs = (struct message_macs *)
 		((u8 *)skb->data + skb->len - sizeof(*macs));
+	struct cookie_checker_keys *keys;
 	u8 cookie[COOKIE_LEN];
 
 	dst->header.type = cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE);
@@ -190,9 +354,12 @@ void wg_cookie_message_create(struct message_handshake_cookie *dst,
 	get_random_bytes_wait(dst->nonce, COOKIE_NONCE_LEN);
 
 	make_cookie(cookie, skb, checker);
+	rcu_read_lock_bh();
+	keys = rcu_dereference_bh(checker->keys);
 	xchacha20poly1305_encrypt(dst->encrypted_cookie, cookie, COOKIE_LEN,
 				  macs->mac1, COOKIE_LEN, dst->nonce,
-				  checker->cookie_encryption_key);
+				  keys->cookie_encryption_key);
+	rcu_read_unlock_bh();
 }
 
 void wg_cookie_message_consume(struct message_handshake_cookie *src,
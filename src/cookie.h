@@ -7,16 +7,34 @@
 #define _WG_COOKIE_H
 
 #include "messages.h"
+#include <zinc/blake2s.h>
 #include <linux/rwsem.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 
 struct wg_peer;
 
-struct cookie_checker {
-	u8 secret[NOISE_HASH_LEN];
+struct cookie_secret {
+	struct blake2s_state state; /* Keyed with the random secret. */
+	u64 birthdate;
+};
+
+struct cookie_checker_keys {
+	struct blake2s_state message_mac1_state;
 	u8 cookie_encryption_key[NOISE_SYMMETRIC_KEY_LEN];
-	u8 message_mac1_key[NOISE_SYMMETRIC_KEY_LEN];
-	u64 secret_birthdate;
-	struct rw_semaphore secret_lock;
+};
+
+/* The secret and the device keys are each double buffered. A writer waits for
+ * a grace period, so that nobody is still reading the slot that is not
+ * published, fills that slot in, and then publishes it, so that readers never
+ * block, even across a secret rotation.
+ */
+struct cookie_checker {
+	struct cookie_secret __rcu *secret;
+	struct cookie_checker_keys __rcu *keys;
+	struct cookie_secret secrets[2];
+	struct cookie_checker_keys key_slots[2];
+	struct work_struct secret_rotation_work;
 	struct wg_device *device;
 };
 
@@ -40,13 +58,22 @@ enum cookie_mac_state {
 
 void wg_cookie_checker_init(struct cookie_checker *checker,
 			    struct wg_device *wg);
+void wg_cookie_checker_uninit(struct cookie_checker *checker);
 void wg_cookie_checker_precompute_device_keys(struct cookie_checker *checker);
 void wg_cookie_checker_precompute_peer_keys(struct wg_peer *peer);
 void wg_cookie_init(struct cookie *cookie);
 
-enum cookie_mac_state wg_cookie_validate_packet(struct cookie_checker *checker,
-						struct sk_buff *skb,
-						bool check_cookie);
+bool wg_cookie_validate_mac1(struct cookie_checker *checker,
+			     struct sk_buff *skb);
+/* Validates up to COOKIE_BATCH_MAX handshake initiations and responses at
+ * once. Any other messages are left as INVALID_MAC.
+ */
+enum { COOKIE_BATCH_MAX = BLAKE2S_LANES };
+void wg_cookie_validate_packets(struct cookie_checker *checker,
+				struct sk_buff *const skbs[],
+				const bool check_cookie[],
+				enum cookie_mac_state states[],
+				unsigned int count);
 void wg_cookie_add_mac_to_packet(void *message, size_t len,
 				 struct wg_peer *peer);
 
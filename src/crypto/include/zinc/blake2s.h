@@ -13,7 +13,8 @@
 enum blake2s_lengths {
 	BLAKE2S_BLOCK_SIZE = 64,
 	BLAKE2S_HASH_SIZE = 32,
-	BLAKE2S_KEY_SIZE = 32
+	BLAKE2S_KEY_SIZE = 32,
+	BLAKE2S_LANES = 8
 };
 
 struct blake2s_state {
@@ -31,6 +32,16 @@ void blake2s_init_key(struct blake2s_state *state, const size_t outlen,
 void blake2s_update(struct blake2s_state *state, const u8 *in, size_t inlen);
 void blake2s_final(struct blake2s_state *state, u8 *out);
 
+/* Equivalent to blake2s_update() followed by blake2s_final() on each of the
+ * states, with a message of the same length for each, but faster where the
+ * hashes can be computed side by side, BLAKE2S_LANES at a time. That needs the
+ * states to have buffered the same amount of input, as they do after being
+ * keyed with keys of the same length.
+ */
+void blake2s_final_lanes(struct blake2s_state *state, const u8 *const in[],
+			 const size_t inlen, u8 *const out[],
+			 const unsigned int lanes);
+
 static inline void blake2s(u8 *out, const u8 *in, const u8 *key,
 			   const size_t outlen, const size_t inlen,
 			   const size_t keylen)
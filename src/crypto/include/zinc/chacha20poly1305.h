@@ -22,21 +22,67 @@ void chacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
 			      const u64 nonce,
 			      const u8 key[CHACHA20POLY1305_KEY_SIZE]);
 
+/* Like the above, but for callers that already hold a SIMD context, such as
+ * those processing a batch of packets. dst may be the same as src.
+ */
+void chacha20poly1305_encrypt_simd(u8 *dst, const u8 *src,
+				   const size_t src_len, const u8 *ad,
+				   const size_t ad_len, const u64 nonce,
+				   const u8 key[CHACHA20POLY1305_KEY_SIZE],
+				   simd_context_t *simd_context);
+
 bool __must_check chacha20poly1305_encrypt_sg_inplace(
 	struct scatterlist *src, const size_t src_len, const u8 *ad,
 	const size_t ad_len, const u64 nonce,
 	const u8 key[CHACHA20POLY1305_KEY_SIZE], simd_context_t *simd_context);
 
+/* Unlike the above, this leaves src untouched and writes the ciphertext and
+ * authentication tag to dst, which must be virtually contiguous and at least
+ * src_len plus CHACHA20POLY1305_AUTHTAG_SIZE bytes long. It fails if src holds
+ * fewer than src_len bytes.
+ */
+bool __must_check chacha20poly1305_encrypt_sg(
+	u8 *dst, struct scatterlist *src, const size_t src_len, const u8 *ad,
+	const size_t ad_len, const u64 nonce,
+	const u8 key[CHACHA20POLY1305_KEY_SIZE], simd_context_t *simd_context);
+
+/* Like the above, but for network stacks that leave the internet checksum of
+ * the plaintext for the device to complete: the ones' complement sum of src
+ * from csum_start onwards, with the 16-bit field at csum_start + csum_offset
+ * holding its seed, is computed as the plaintext goes through the cipher, and
+ * then the folded sum is what that field holds when encrypted. dst may be the
+ * very buffer that src describes. It fails if the field lies beyond src_len.
+ */
+bool __must_check chacha20poly1305_encrypt_csum_sg(
+	u8 *dst, struct scatterlist *src, const size_t src_len, const u8 *ad,
+	const size_t ad_len, const size_t csum_start, const size_t csum_offset,
+	const u64 nonce, const u8 key[CHACHA20POLY1305_KEY_SIZE],
+	simd_context_t *simd_context);
+
 bool __must_check
 chacha20poly1305_decrypt(u8 *dst, const u8 *src, const size_t src_len,
 			 const u8 *ad, const size_t ad_len, const u64 nonce,
 			 const u8 key[CHACHA20POLY1305_KEY_SIZE]);
 
+bool __must_check chacha20poly1305_decrypt_simd(
+	u8 *dst, const u8 *src, const size_t src_len, const u8 *ad,
+	const size_t ad_len, const u64 nonce,
+	const u8 key[CHACHA20POLY1305_KEY_SIZE], simd_context_t *simd_context);
+
 bool __must_check chacha20poly1305_decrypt_sg_inplace(
 	struct scatterlist *src, size_t src_len, const u8 *ad,
 	const size_t ad_len, const u64 nonce,
 	const u8 key[CHACHA20POLY1305_KEY_SIZE], simd_context_t *simd_context);
 
+/* Unlike the above, this leaves src untouched and writes the plaintext to dst,
+ * which must be virtually contiguous and at least src_len minus
+ * CHACHA20POLY1305_AUTHTAG_SIZE bytes long.
+ */
+bool __must_check chacha20poly1305_decrypt_sg(
+	u8 *dst, struct scatterlist *src, size_t src_len, const u8 *ad,
+	const size_t ad_len, const u64 nonce,
+	const u8 key[CHACHA20POLY1305_KEY_SIZE], simd_context_t *simd_context);
+
 void xchacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
 			       const u8 *ad, const size_t ad_len,
 			       const u8 nonce[XCHACHA20POLY1305_NONCE_SIZE],
@@ -9,12 +9,20 @@
 #include <linux/types.h>
 
 enum curve25519_lengths {
-	CURVE25519_KEY_SIZE = 32
+	CURVE25519_KEY_SIZE = 32,
+	CURVE25519_BATCH_MAX = 8
 };
 
 bool __must_check curve25519(u8 mypublic[CURVE25519_KEY_SIZE],
 			     const u8 secret[CURVE25519_KEY_SIZE],
 			     const u8 basepoint[CURVE25519_KEY_SIZE]);
+/* Computes count independent curve25519() operations, with valid[i] set to
+ * what the i-th one would have returned. Up to CURVE25519_BATCH_MAX of them
+ * share a single ladder where the CPU allows it.
+ */
+void curve25519_batch(u8 *const mypublic[], const u8 *const secret[],
+		      const u8 *const basepoint[], bool valid[],
+		      unsigned int count);
 void curve25519_generate_secret(u8 secret[CURVE25519_KEY_SIZE]);
 bool __must_check curve25519_generate_public(
 	u8 pub[CURVE25519_KEY_SIZE], const u8 secret[CURVE25519_KEY_SIZE]);
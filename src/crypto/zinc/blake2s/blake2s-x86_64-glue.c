@@ -14,15 +14,25 @@ asmlinkage void blake2s_compress_ssse3(struct blake2s_state *state,
 asmlinkage void blake2s_compress_avx512(struct blake2s_state *state,
 					const u8 *block, const size_t nblocks,
 					const u32 inc);
+asmlinkage void blake2s_compress_avx2_x8(u32 h[8][BLAKE2S_LANES],
+					 const u32 m[16][BLAKE2S_LANES],
+					 const u32 t0, const u32 t1,
+					 const u32 f0);
 
 static bool blake2s_use_ssse3 __ro_after_init;
+static bool blake2s_use_avx2 __ro_after_init;
 static bool blake2s_use_avx512 __ro_after_init;
 static bool *const blake2s_nobs[] __initconst = { &blake2s_use_ssse3,
+						  &blake2s_use_avx2,
 						  &blake2s_use_avx512 };
 
 static void __init blake2s_fpu_init(void)
 {
 	blake2s_use_ssse3 = boot_cpu_has(X86_FEATURE_SSSE3);
+	blake2s_use_avx2 =
+		boot_cpu_has(X86_FEATURE_AVX) &&
+		boot_cpu_has(X86_FEATURE_AVX2) &&
+		cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
 #ifndef COMPAT_CANNOT_USE_AVX512
 	blake2s_use_avx512 =
 		boot_cpu_has(X86_FEATURE_AVX) &&
@@ -70,3 +80,90 @@ out:
 	simd_put(&simd_context);
 	return used_arch;
 }
+
+/* Copies the len bytes at offset of the concatenation of what state has
+ * buffered and in, zero padded to a full block.
+ */
+static void blake2s_lane_block(u8 block[BLAKE2S_BLOCK_SIZE],
+			       const struct blake2s_state *state, const u8 *in,
+			       const size_t offset, const size_t len)
+{
+	size_t from_buf = 0;
+
+	memset(block, 0, BLAKE2S_BLOCK_SIZE);
+	if (offset < state->buflen) {
+		from_buf = min(len, state->buflen - offset);
+		memcpy(block, state->buf + offset, from_buf);
+	}
+	if (len > from_buf)
+		memcpy(block + from_buf, in + offset + from_buf - state->buflen,
+		       len - from_buf);
+}
+
+static inline bool blake2s_final_lanes_arch(struct blake2s_state *state,
+					    const u8 *const in[],
+					    const size_t inlen,
+					    u8 *const out[],
+					    const unsigned int lanes)
+{
+	u32 h[8][BLAKE2S_LANES] __aligned(32) = { { 0 } };
+	u32 m[16][BLAKE2S_LANES] __aligned(32) = { { 0 } };
+	u8 block[BLAKE2S_BLOCK_SIZE] __aligned(__alignof__(u32));
+	size_t total = state->buflen + inlen, offset, len;
+	simd_context_t simd_context;
+	unsigned int lane, i;
+	u64 t;
+
+	if (!IS_ENABLED(CONFIG_AS_AVX2) || !blake2s_use_avx2 || lanes < 2)
+		return false;
+	for (lane = 1; lane < lanes; ++lane) {
+		if (state[lane].buflen != state->buflen ||
+		    state[lane].t[0] != state->t[0] ||
+		    state[lane].t[1] != state->t[1] ||
+		    state[lane].outlen != state->outlen)
+			return false;
+	}
+
+	simd_get(&simd_context);
+	if (!simd_use(&simd_context)) {
+		simd_put(&simd_context);
+		return false;
+	}
+
+	for (lane = 0; lane < lanes; ++lane) {
+		for (i = 0; i < 8; ++i)
+			h[i][lane] = state[lane].h[i];
+	}
+	t = state->t[0] | (u64)state->t[1] << 32;
+	for (offset = 0;; offset += BLAKE2S_BLOCK_SIZE) {
+		/* As in blake2s_update(), the last block is kept back for
+		 * blake2s_final(), even when it is a full one.
+		 */
+		len = min_t(size_t, total - offset, BLAKE2S_BLOCK_SIZE);
+		for (lane = 0; lane < lanes; ++lane) {
+			blake2s_lane_block(block, &state[lane], in[lane],
+					   offset, len);
+			for (i = 0; i < 16; ++i)
+				m[i][lane] = get_unaligned_le32(block + i * 4);
+		}
+		t += len;
+		if (offset + len == total) {
+			blake2s_compress_avx2_x8(h, m, t, t >> 32, -1);
+			break;
+		}
+		blake2s_compress_avx2_x8(h, m, t, t >> 32, 0);
+	}
+
+	simd_put(&simd_context);
+
+	for (lane = 0; lane < lanes; ++lane) {
+		for (i = 0; i < 8; ++i)
+			state[lane].h[i] = cpu_to_le32(h[i][lane]);
+		memcpy(out[lane], state[lane].h, state[lane].outlen);
+		memzero_explicit(&state[lane], sizeof(state[lane]));
+	}
+	memzero_explicit(h, sizeof(h));
+	memzero_explicit(m, sizeof(m));
+	memzero_explicit(block, sizeof(block));
+	return true;
+}
@@ -96,6 +96,14 @@ static inline bool blake2s_compress_arch(struct blake2s_state *state,
 {
 	return false;
 }
+static inline bool blake2s_final_lanes_arch(struct blake2s_state *state,
+					    const u8 *const in[],
+					    const size_t inlen,
+					    u8 *const out[],
+					    const unsigned int lanes)
+{
+	return false;
+}
 #endif
 
 static inline void blake2s_compress(struct blake2s_state *state,
@@ -207,6 +215,24 @@ void blake2s_final(struct blake2s_state *state, u8 *out)
 }
 EXPORT_SYMBOL(blake2s_final);
 
+void blake2s_final_lanes(struct blake2s_state *state, const u8 *const in[],
+			 const size_t inlen, u8 *const out[],
+			 const unsigned int lanes)
+{
+	unsigned int i, n;
+
+	for (; lanes; lanes -= n, state += n, in += n, out += n) {
+		n = min_t(unsigned int, lanes, BLAKE2S_LANES);
+		if (blake2s_final_lanes_arch(state, in, inlen, out, n))
+			continue;
+		for (i = 0; i < n; ++i) {
+			blake2s_update(&state[i], in[i], inlen);
+			blake2s_final(&state[i], out[i]);
+		}
+	}
+}
+EXPORT_SYMBOL(blake2s_final_lanes);
+
 void blake2s_hmac(u8 *out, const u8 *in, const u8 *key, const size_t outlen,
 		  const size_t inlen, const size_t keylen)
 {
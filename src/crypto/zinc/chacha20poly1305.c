@@ -17,6 +17,7 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <crypto/scatterwalk.h> // For blkcipher_walk.
+#include <net/checksum.h>
 
 static const u8 pad0[CHACHA20_BLOCK_SIZE] = { 0 };
 
@@ -73,6 +74,17 @@ void chacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
 }
 EXPORT_SYMBOL(chacha20poly1305_encrypt);
 
+void chacha20poly1305_encrypt_simd(u8 *dst, const u8 *src,
+				   const size_t src_len, const u8 *ad,
+				   const size_t ad_len, const u64 nonce,
+				   const u8 key[CHACHA20POLY1305_KEY_SIZE],
+				   simd_context_t *simd_context)
+{
+	__chacha20poly1305_encrypt(dst, src, src_len, ad, ad_len, nonce, key,
+				   simd_context);
+}
+EXPORT_SYMBOL(chacha20poly1305_encrypt_simd);
+
 bool chacha20poly1305_encrypt_sg_inplace(struct scatterlist *src,
 					 const size_t src_len,
 					 const u8 *ad, const size_t ad_len,
@@ -165,6 +177,233 @@ bool chacha20poly1305_encrypt_sg_inplace(struct scatterlist *src,
 }
 EXPORT_SYMBOL(chacha20poly1305_encrypt_sg_inplace);
 
+bool chacha20poly1305_encrypt_sg(u8 *dst, struct scatterlist *src,
+				 const size_t src_len, const u8 *ad,
+				 const size_t ad_len, const u64 nonce,
+				 const u8 key[CHACHA20POLY1305_KEY_SIZE],
+				 simd_context_t *simd_context)
+{
+	struct poly1305_ctx poly1305_state;
+	struct chacha20_ctx chacha20_state;
+	struct sg_mapping_iter miter;
+	size_t partial = 0;
+	ssize_t sl;
+	union {
+		u8 chacha20_stream[CHACHA20_BLOCK_SIZE];
+		u8 block0[POLY1305_KEY_SIZE];
+		__le64 lens[2];
+	} b __aligned(16) = { { 0 } };
+	u8 *const dst_start = dst;
+
+	chacha20_init(&chacha20_state, key, nonce);
+	chacha20(&chacha20_state, b.block0, b.block0, sizeof(b.block0),
+		 simd_context);
+	poly1305_init(&poly1305_state, b.block0);
+
+	poly1305_update(&poly1305_state, ad, ad_len, simd_context);
+	poly1305_update(&poly1305_state, pad0, (0x10 - ad_len) & 0xf,
+			simd_context);
+
+	sg_miter_start(&miter, src, sg_nents(src), SG_MITER_FROM_SG | SG_MITER_ATOMIC);
+	for (sl = src_len; sl > 0 && sg_miter_next(&miter); sl -= miter.length) {
+		u8 *addr = miter.addr, *chunk = dst;
+		size_t length = min_t(size_t, sl, miter.length);
+
+		if (unlikely(partial)) {
+			size_t l = min(length, CHACHA20_BLOCK_SIZE - partial);
+
+			crypto_xor_cpy(dst, addr, b.chacha20_stream + partial, l);
+			partial = (partial + l) & (CHACHA20_BLOCK_SIZE - 1);
+
+			dst += l;
+			addr += l;
+			length -= l;
+		}
+
+		if (likely(length >= CHACHA20_BLOCK_SIZE || length == sl)) {
+			size_t l = length;
+
+			if (unlikely(length < sl))
+				l &= ~(CHACHA20_BLOCK_SIZE - 1);
+			chacha20(&chacha20_state, dst, addr, l, simd_context);
+			dst += l;
+			addr += l;
+			length -= l;
+		}
+
+		if (unlikely(length > 0)) {
+			chacha20(&chacha20_state, b.chacha20_stream, pad0,
+				 CHACHA20_BLOCK_SIZE, simd_context);
+			crypto_xor_cpy(dst, addr, b.chacha20_stream, length);
+			partial = length;
+			dst += length;
+		}
+
+		poly1305_update(&poly1305_state, chunk, dst - chunk,
+				simd_context);
+
+		simd_relax(simd_context);
+	}
+
+	sg_miter_stop(&miter);
+
+	if (unlikely(sl > 0)) {
+		memzero_explicit(&chacha20_state, sizeof(chacha20_state));
+		memzero_explicit(&b, sizeof(b));
+		return false;
+	}
+
+	poly1305_update(&poly1305_state, pad0, (0x10 - src_len) & 0xf,
+			simd_context);
+
+	b.lens[0] = cpu_to_le64(ad_len);
+	b.lens[1] = cpu_to_le64(src_len);
+	poly1305_update(&poly1305_state, (u8 *)b.lens, sizeof(b.lens),
+			simd_context);
+
+	poly1305_final(&poly1305_state, dst_start + src_len, simd_context);
+
+	memzero_explicit(&chacha20_state, sizeof(chacha20_state));
+	memzero_explicit(&b, sizeof(b));
+	return true;
+}
+EXPORT_SYMBOL(chacha20poly1305_encrypt_sg);
+
+/* The plaintext is summed and then encrypted this many bytes at a time, so
+ * that the cipher reads it while it is still in the L1 cache from summing.
+ */
+enum { CSUM_CHUNK_SIZE = 16 * CHACHA20_BLOCK_SIZE };
+
+bool chacha20poly1305_encrypt_csum_sg(u8 *dst, struct scatterlist *src,
+				      const size_t src_len, const u8 *ad,
+				      const size_t ad_len,
+				      const size_t csum_start,
+				      const size_t csum_offset,
+				      const u64 nonce,
+				      const u8 key[CHACHA20POLY1305_KEY_SIZE],
+				      simd_context_t *simd_context)
+{
+	const size_t csum_field = csum_start + csum_offset;
+	struct poly1305_ctx poly1305_state;
+	struct chacha20_ctx chacha20_state;
+	struct sg_mapping_iter miter;
+	size_t partial = 0, pos = 0;
+	__wsum csum = 0;
+	__sum16 check;
+	__le16 seed;
+	union {
+		u8 chacha20_stream[CHACHA20_BLOCK_SIZE];
+		u8 block0[POLY1305_KEY_SIZE];
+		__le64 lens[2];
+	} b __aligned(16) = { { 0 } };
+
+	if (unlikely(csum_start > csum_field ||
+		     csum_field + sizeof(check) > src_len))
+		return false;
+
+	/* The field holds the seed of the sum, such as a pseudo-header sum,
+	 * which dst may overwrite before we're done.
+	 */
+	scatterwalk_map_and_copy(&seed, src, csum_field, sizeof(seed), 0);
+
+	chacha20_init(&chacha20_state, key, nonce);
+	chacha20(&chacha20_state, b.block0, b.block0, sizeof(b.block0),
+		 simd_context);
+	poly1305_init(&poly1305_state, b.block0);
+
+	poly1305_update(&poly1305_state, ad, ad_len, simd_context);
+	poly1305_update(&poly1305_state, pad0, (0x10 - ad_len) & 0xf,
+			simd_context);
+
+	sg_miter_start(&miter, src, sg_nents(src),
+		       SG_MITER_FROM_SG | SG_MITER_ATOMIC);
+	while (pos < src_len && sg_miter_next(&miter)) {
+		size_t length = min_t(size_t, src_len - pos, miter.length);
+		const u8 *addr = miter.addr;
+
+		while (length) {
+			size_t chunk = min_t(size_t, length, CSUM_CHUNK_SIZE);
+			size_t l, skip;
+
+			if (pos + chunk > csum_start) {
+				skip = pos < csum_start ? csum_start - pos : 0;
+				csum = csum_block_add(csum,
+					csum_partial(addr + skip, chunk - skip, 0),
+					pos + skip - csum_start);
+			}
+			length -= chunk;
+
+			if (unlikely(partial)) {
+				l = min(chunk, CHACHA20_BLOCK_SIZE - partial);
+				crypto_xor_cpy(dst + pos, addr,
+					       b.chacha20_stream + partial, l);
+				partial = (partial + l) &
+					  (CHACHA20_BLOCK_SIZE - 1);
+				pos += l;
+				addr += l;
+				chunk -= l;
+			}
+
+			if (likely(chunk >= CHACHA20_BLOCK_SIZE ||
+				   chunk == src_len - pos)) {
+				l = chunk;
+				if (unlikely(chunk < src_len - pos))
+					l &= ~(CHACHA20_BLOCK_SIZE - 1);
+				chacha20(&chacha20_state, dst + pos, addr, l,
+					 simd_context);
+				pos += l;
+				addr += l;
+				chunk -= l;
+			}
+
+			if (unlikely(chunk)) {
+				chacha20(&chacha20_state, b.chacha20_stream,
+					 pad0, CHACHA20_BLOCK_SIZE,
+					 simd_context);
+				crypto_xor_cpy(dst + pos, addr,
+					       b.chacha20_stream, chunk);
+				partial = chunk;
+				pos += chunk;
+				addr += chunk;
+			}
+		}
+
+		simd_relax(simd_context);
+	}
+	sg_miter_stop(&miter);
+
+	if (unlikely(pos < src_len)) {
+		memzero_explicit(&chacha20_state, sizeof(chacha20_state));
+		memzero_explicit(&b, sizeof(b));
+		return false;
+	}
+
+	/* The field was encrypted holding the seed, and as the cipher is just
+	 * a xor with the keystream, swapping the seed for the final checksum
+	 * can be done in the ciphertext directly. Poly1305, though, has to see
+	 * that final ciphertext from the start, so it can only run now.
+	 */
+	check = csum_fold(csum) ?: CSUM_MANGLED_0;
+	put_unaligned(get_unaligned((__le16 *)(dst + csum_field)) ^ seed ^
+		      (__force __le16)check, (__le16 *)(dst + csum_field));
+
+	poly1305_update(&poly1305_state, dst, src_len, simd_context);
+	poly1305_update(&poly1305_state, pad0, (0x10 - src_len) & 0xf,
+			simd_context);
+
+	b.lens[0] = cpu_to_le64(ad_len);
+	b.lens[1] = cpu_to_le64(src_len);
+	poly1305_update(&poly1305_state, (u8 *)b.lens, sizeof(b.lens),
+			simd_context);
+
+	poly1305_final(&poly1305_state, dst + src_len, simd_context);
+
+	memzero_explicit(&chacha20_state, sizeof(chacha20_state));
+	memzero_explicit(&b, sizeof(b));
+	return true;
+}
+EXPORT_SYMBOL(chacha20poly1305_encrypt_csum_sg);
+
 static inline bool
 __chacha20poly1305_decrypt(u8 *dst, const u8 *src, const size_t src_len,
 			   const u8 *ad, const size_t ad_len, const u64 nonce,
@@ -230,6 +469,17 @@ bool chacha20poly1305_decrypt(u8 *dst, const u8 *src, const size_t src_len,
 }
 EXPORT_SYMBOL(chacha20poly1305_decrypt);
 
+bool chacha20poly1305_decrypt_simd(u8 *dst, const u8 *src,
+				   const size_t src_len, const u8 *ad,
+				   const size_t ad_len, const u64 nonce,
+				   const u8 key[CHACHA20POLY1305_KEY_SIZE],
+				   simd_context_t *simd_context)
+{
+	return __chacha20poly1305_decrypt(dst, src, src_len, ad, ad_len, nonce,
+					  key, simd_context);
+}
+EXPORT_SYMBOL(chacha20poly1305_decrypt_simd);
+
 bool chacha20poly1305_decrypt_sg_inplace(struct scatterlist *src,
 					 size_t src_len,
 					 const u8 *ad, const size_t ad_len,
@@ -335,6 +585,113 @@ bool chacha20poly1305_decrypt_sg_inplace(struct scatterlist *src,
 }
 EXPORT_SYMBOL(chacha20poly1305_decrypt_sg_inplace);
 
+bool chacha20poly1305_decrypt_sg(u8 *dst, struct scatterlist *src,
+				 size_t src_len, const u8 *ad,
+				 const size_t ad_len, const u64 nonce,
+				 const u8 key[CHACHA20POLY1305_KEY_SIZE],
+				 simd_context_t *simd_context)
+{
+	struct poly1305_ctx poly1305_state;
+	struct chacha20_ctx chacha20_state;
+	struct sg_mapping_iter miter;
+	size_t partial = 0;
+	ssize_t sl;
+	union {
+		u8 chacha20_stream[CHACHA20_BLOCK_SIZE];
+		u8 block0[POLY1305_KEY_SIZE];
+		struct {
+			u8 read_mac[POLY1305_MAC_SIZE];
+			u8 computed_mac[POLY1305_MAC_SIZE];
+		};
+		__le64 lens[2];
+	} b __aligned(16) = { { 0 } };
+	bool ret = false;
+
+	if (unlikely(src_len < POLY1305_MAC_SIZE))
+		return ret;
+	src_len -= POLY1305_MAC_SIZE;
+
+	chacha20_init(&chacha20_state, key, nonce);
+	chacha20(&chacha20_state, b.block0, b.block0, sizeof(b.block0),
+		 simd_context);
+	poly1305_init(&poly1305_state, b.block0);
+
+	poly1305_update(&poly1305_state, ad, ad_len, simd_context);
+	poly1305_update(&poly1305_state, pad0, (0x10 - ad_len) & 0xf,
+			simd_context);
+
+	sg_miter_start(&miter, src, sg_nents(src), SG_MITER_FROM_SG | SG_MITER_ATOMIC);
+	for (sl = src_len; sl > 0 && sg_miter_next(&miter); sl -= miter.length) {
+		u8 *addr = miter.addr;
+		size_t length = min_t(size_t, sl, miter.length);
+
+		poly1305_update(&poly1305_state, addr, length, simd_context);
+
+		if (unlikely(partial)) {
+			size_t l = min(length, CHACHA20_BLOCK_SIZE - partial);
+
+			crypto_xor_cpy(dst, addr, b.chacha20_stream + partial, l);
+			partial = (partial + l) & (CHACHA20_BLOCK_SIZE - 1);
+
+			dst += l;
+			addr += l;
+			length -= l;
+		}
+
+		if (likely(length >= CHACHA20_BLOCK_SIZE || length == sl)) {
+			size_t l = length;
+
+			if (unlikely(length < sl))
+				l &= ~(CHACHA20_BLOCK_SIZE - 1);
+			chacha20(&chacha20_state, dst, addr, l, simd_context);
+			dst += l;
+			addr += l;
+			length -= l;
+		}
+
+		if (unlikely(length > 0)) {
+			chacha20(&chacha20_state, b.chacha20_stream, pad0,
+				 CHACHA20_BLOCK_SIZE, simd_context);
+			crypto_xor_cpy(dst, addr, b.chacha20_stream, length);
+			partial = length;
+			dst += length;
+		}
+
+		simd_relax(simd_context);
+	}
+
+	poly1305_update(&poly1305_state, pad0, (0x10 - src_len) & 0xf,
+			simd_context);
+
+	b.lens[0] = cpu_to_le64(ad_len);
+	b.lens[1] = cpu_to_le64(src_len);
+	poly1305_update(&poly1305_state, (u8 *)b.lens, sizeof(b.lens),
+			simd_context);
+
+	if (likely(sl <= -POLY1305_MAC_SIZE)) {
+		poly1305_final(&poly1305_state, b.computed_mac, simd_context);
+		ret = !crypto_memneq(b.computed_mac,
+				     miter.addr + miter.length + sl,
+				     POLY1305_MAC_SIZE);
+	}
+
+	sg_miter_stop(&miter);
+
+	if (unlikely(sl > -POLY1305_MAC_SIZE)) {
+		poly1305_final(&poly1305_state, b.computed_mac, simd_context);
+		scatterwalk_map_and_copy(b.read_mac, src, src_len,
+					 sizeof(b.read_mac), 0);
+		ret = !crypto_memneq(b.read_mac, b.computed_mac,
+				     POLY1305_MAC_SIZE);
+
+	}
+
+	memzero_explicit(&chacha20_state, sizeof(chacha20_state));
+	memzero_explicit(&b, sizeof(b));
+	return ret;
+}
+EXPORT_SYMBOL(chacha20poly1305_decrypt_sg);
+
 void xchacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
 			       const u8 *ad, const size_t ad_len,
 			       const u8 nonce[XCHACHA20POLY1305_NONCE_SIZE],
@@ -41,3 +41,11 @@ static inline bool curve25519_base_arch(u8 pub[CURVE25519_KEY_SIZE],
 {
 	return false;
 }
+
+static inline unsigned int curve25519_batch_arch(u8 *const mypublic[],
+						 const u8 *const secret[],
+						 const u8 *const basepoint[],
+						 unsigned int count)
+{
+	return 0;
+}
@@ -3,15 +3,45 @@
  * Copyright (C) 2015-2019 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
  */
 
+#include <linux/simd.h>
+#include <linux/percpu.h>
 #include <asm/cpufeature.h>
 #include <asm/processor.h>
+#include <asm/fpu/api.h>
 
 #include "curve25519-x86_64.c"
 
+/* Eight field elements side by side, in radix 2^51, with limb i of lane j at
+ * limb[i][j]. Every routine below leaves each limb at most 2^51, which keeps
+ * them inside the 52 bits that vpmadd52{l,h}uq read of their operands.
+ */
+struct curve25519_fe8 {
+	u64 limb[5][CURVE25519_BATCH_MAX];
+};
+
+asmlinkage void curve25519_ifma_mul(struct curve25519_fe8 *out,
+				    const struct curve25519_fe8 *a,
+				    const struct curve25519_fe8 *b);
+asmlinkage void curve25519_ifma_sqr(struct curve25519_fe8 *out,
+				    const struct curve25519_fe8 *a);
+asmlinkage void curve25519_ifma_add(struct curve25519_fe8 *out,
+				    const struct curve25519_fe8 *a,
+				    const struct curve25519_fe8 *b);
+asmlinkage void curve25519_ifma_sub(struct curve25519_fe8 *out,
+				    const struct curve25519_fe8 *a,
+				    const struct curve25519_fe8 *b);
+asmlinkage void curve25519_ifma_mul121665(struct curve25519_fe8 *out,
+					  const struct curve25519_fe8 *a);
+asmlinkage void curve25519_ifma_cswap(struct curve25519_fe8 *a,
+				      struct curve25519_fe8 *b,
+				      const u64 mask[CURVE25519_BATCH_MAX]);
+
 static bool curve25519_use_bmi2 __ro_after_init;
 static bool curve25519_use_adx __ro_after_init;
+static bool curve25519_use_avx512ifma __ro_after_init;
 static bool *const curve25519_nobs[] __initconst = {
-	&curve25519_use_bmi2, &curve25519_use_adx };
+	&curve25519_use_bmi2, &curve25519_use_adx,
+	&curve25519_use_avx512ifma };
 
 static void __init curve25519_fpu_init(void)
 {
@@ -20,6 +50,14 @@ static void __init curve25519_fpu_init(void)
 	curve25519_use_adx = IS_ENABLED(CONFIG_AS_ADX) &&
 			     boot_cpu_has(X86_FEATURE_BMI2) &&
 			     boot_cpu_has(X86_FEATURE_ADX);
+#if !defined(COMPAT_CANNOT_USE_AVX512) && defined(X86_FEATURE_AVX512IFMA)
+	curve25519_use_avx512ifma =
+		IS_ENABLED(CONFIG_AS_AVX512IFMA) &&
+		boot_cpu_has(X86_FEATURE_AVX512F) &&
+		boot_cpu_has(X86_FEATURE_AVX512IFMA) &&
+		cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM |
+				  XFEATURE_MASK_AVX512, NULL);
+#endif
 }
 
 static inline bool curve25519_arch(u8 mypublic[CURVE25519_KEY_SIZE],
@@ -48,3 +86,213 @@ static inline bool curve25519_base_arch(u8 pub[CURVE25519_KEY_SIZE],
 	}
 	return false;
 }
+
+/* This is too large for the stack, so it lives per-cpu, and is only touched
+ * between simd_use() and simd_put(), with preemption disabled.
+ */
+struct curve25519_ifma_ladder {
+	struct curve25519_fe8 x1, x2, z2, x3, z3, t[4];
+	u64 swap[CURVE25519_BATCH_MAX];
+	u8 scalar[CURVE25519_BATCH_MAX][CURVE25519_KEY_SIZE];
+};
+static DEFINE_PER_CPU_ALIGNED(struct curve25519_ifma_ladder,
+			      curve25519_ifma_ladder);
+
+static void curve25519_ifma_sqr_times(struct curve25519_fe8 *out,
+				      const struct curve25519_fe8 *a,
+				      unsigned int n)
+{
+	curve25519_ifma_sqr(out, a);
+	while (--n)
+		curve25519_ifma_sqr(out, out);
+}
+
+/* out = z^(p - 2), which uses the same chain for every lane, and leaves
+ * z = 0 in a lane as 0, exactly as the scalar implementations do.
+ */
+static void curve25519_ifma_invert(struct curve25519_fe8 *out,
+				   const struct curve25519_fe8 *z,
+				   struct curve25519_fe8 t[4])
+{
+	struct curve25519_fe8 *z9 = &t[0], *z11 = &t[1], *a = &t[2];
+	struct curve25519_fe8 *b = &t[3];
+
+	curve25519_ifma_sqr(a, z);				/* 2 */
+	curve25519_ifma_sqr_times(b, a, 2);			/* 8 */
+	curve25519_ifma_mul(z9, b, z);				/* 9 */
+	curve25519_ifma_mul(z11, z9, a);			/* 11 */
+	curve25519_ifma_sqr(b, z11);				/* 22 */
+	curve25519_ifma_mul(a, b, z9);				/* 2^5 - 1 */
+	curve25519_ifma_sqr_times(b, a, 5);
+	curve25519_ifma_mul(a, b, a);				/* 2^10 - 1 */
+	curve25519_ifma_sqr_times(b, a, 10);
+	curve25519_ifma_mul(z9, b, a);				/* 2^20 - 1 */
+	curve25519_ifma_sqr_times(b, z9, 20);
+	curve25519_ifma_mul(b, b, z9);				/* 2^40 - 1 */
+	curve25519_ifma_sqr_times(b, b, 10);
+	curve25519_ifma_mul(a, b, a);				/* 2^50 - 1 */
+	curve25519_ifma_sqr_times(b, a, 50);
+	curve25519_ifma_mul(z9, b, a);				/* 2^100 - 1 */
+	curve25519_ifma_sqr_times(b, z9, 100);
+	curve25519_ifma_mul(b, b, z9);				/* 2^200 - 1 */
+	curve25519_ifma_sqr_times(b, b, 50);
+	curve25519_ifma_mul(b, b, a);				/* 2^250 - 1 */
+	curve25519_ifma_sqr_times(b, b, 5);
+	curve25519_ifma_mul(out, b, z11);			/* 2^255 - 21 */
+}
+
+static void curve25519_ifma_expand(struct curve25519_fe8 *out,
+				   const unsigned int lane, const u8 in[32])
+{
+	const u64 mask = (1ULL << 51) - 1;
+
+	out->limb[0][lane] = get_unaligned_le64(in) & mask;
+	out->limb[1][lane] = (get_unaligned_le64(in + 6) >> 3) & mask;
+	out->limb[2][lane] = (get_unaligned_le64(in + 12) >> 6) & mask;
+	out->limb[3][lane] = (get_unaligned_le64(in + 19) >> 1) & mask;
+	out->limb[4][lane] = (get_unaligned_le64(in + 24) >> 12) & mask;
+}
+
+static void curve25519_ifma_contract(u8 out[32],
+				     const struct curve25519_fe8 *in,
+				     const unsigned int lane)
+{
+	const u64 mask = (1ULL << 51) - 1;
+	u64 t[5], q;
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		t[i] = in->limb[i][lane];
+
+	/* Fully carry, so that t < 2^255 with every limb below 2^51, and then
+	 * subtract p in constant time if t >= p, which is when t + 19 carries
+	 * out of bit 255.
+	 */
+	for (i = 0; i < 4; ++i) {
+		t[i + 1] += t[i] >> 51;
+		t[i] &= mask;
+	}
+	t[0] += 19 * (t[4] >> 51);
+	t[4] &= mask;
+	for (i = 0; i < 4; ++i) {
+		t[i + 1] += t[i] >> 51;
+		t[i] &= mask;
+	}
+	q = (t[0] + 19) >> 51;
+	for (i = 1; i < 5; ++i)
+		q = (t[i] + q) >> 51;
+	t[0] += 19 * q;
+	for (i = 0; i < 4; ++i) {
+		t[i + 1] += t[i] >> 51;
+		t[i] &= mask;
+	}
+	t[4] &= mask;
+
+	put_unaligned_le64(t[0] | t[1] << 51, out);
+	put_unaligned_le64(t[1] >> 13 | t[2] << 38, out + 8);
+	put_unaligned_le64(t[2] >> 26 | t[3] << 25, out + 16);
+	put_unaligned_le64(t[3] >> 39 | t[4] << 12, out + 24);
+	memzero_explicit(t, sizeof(t));
+}
+
+/* Runs the RFC7748 Montgomery ladder for up to CURVE25519_BATCH_MAX scalar
+ * multiplications at once, one per 64-bit lane. The ladder is the same
+ * sequence of operations for every lane and every scalar, and the per-lane
+ * conditional swaps are done with masks, so it is constant time in the same
+ * way the single ladders are. Lanes past count compute on zeros.
+ */
+static void curve25519_ifma(u8 *const mypublic[],
+			    const u8 *const secret[],
+			    const u8 *const basepoint[],
+			    const unsigned int count)
+{
+	struct curve25519_ifma_ladder *l;
+	u64 prev[CURVE25519_BATCH_MAX] = { 0 }, bit;
+	struct curve25519_fe8 *t;
+	unsigned int lane;
+	int i;
+
+	l = this_cpu_ptr(&curve25519_ifma_ladder);
+	t = l->t;
+
+	memset(l, 0, sizeof(*l));
+	for (lane = 0; lane < count; ++lane) {
+		memcpy(l->scalar[lane], secret[lane], CURVE25519_KEY_SIZE);
+		curve25519_clamp_secret(l->scalar[lane]);
+		curve25519_ifma_expand(&l->x1, lane, basepoint[lane]);
+	}
+	l->x3 = l->x1;
+	for (lane = 0; lane < CURVE25519_BATCH_MAX; ++lane) {
+		l->x2.limb[0][lane] = 1;
+		l->z3.limb[0][lane] = 1;
+	}
+
+	for (i = 254; i >= 0; --i) {
+		for (lane = 0; lane < CURVE25519_BATCH_MAX; ++lane) {
+			bit = (l->scalar[lane][i >> 3] >> (i & 7)) & 1;
+			l->swap[lane] = 0 - (bit ^ prev[lane]);
+			prev[lane] = bit;
+		}
+		curve25519_ifma_cswap(&l->x2, &l->x3, l->swap);
+		curve25519_ifma_cswap(&l->z2, &l->z3, l->swap);
+
+		curve25519_ifma_add(&t[0], &l->x2, &l->z2);	/* A */
+		curve25519_ifma_sub(&t[1], &l->x2, &l->z2);	/* B */
+		curve25519_ifma_add(&t[2], &l->x3, &l->z3);	/* C */
+		curve25519_ifma_sub(&t[3], &l->x3, &l->z3);	/* D */
+		curve25519_ifma_mul(&t[3], &t[3], &t[0]);	/* DA */
+		curve25519_ifma_mul(&t[2], &t[2], &t[1]);	/* CB */
+		curve25519_ifma_sqr(&t[0], &t[0]);		/* AA */
+		curve25519_ifma_sqr(&t[1], &t[1]);		/* BB */
+		curve25519_ifma_add(&l->x3, &t[3], &t[2]);
+		curve25519_ifma_sqr(&l->x3, &l->x3);
+		curve25519_ifma_sub(&l->z3, &t[3], &t[2]);
+		curve25519_ifma_sqr(&l->z3, &l->z3);
+		curve25519_ifma_mul(&l->z3, &l->z3, &l->x1);
+		curve25519_ifma_mul(&l->x2, &t[0], &t[1]);
+		curve25519_ifma_sub(&t[1], &t[0], &t[1]);	/* E */
+		curve25519_ifma_mul121665(&l->z2, &t[1]);
+		curve25519_ifma_add(&l->z2, &l->z2, &t[0]);
+		curve25519_ifma_mul(&l->z2, &l->z2, &t[1]);
+	}
+	for (lane = 0; lane < CURVE25519_BATCH_MAX; ++lane)
+		l->swap[lane] = 0 - prev[lane];
+	curve25519_ifma_cswap(&l->x2, &l->x3, l->swap);
+	curve25519_ifma_cswap(&l->z2, &l->z3, l->swap);
+
+	curve25519_ifma_invert(&l->z3, &l->z2, t);
+	curve25519_ifma_mul(&l->x2, &l->x2, &l->z3);
+	for (lane = 0; lane < count; ++lane)
+		curve25519_ifma_contract(mypublic[lane], &l->x2, lane);
+
+	memzero_explicit(l, sizeof(*l));
+	memzero_explicit(prev, sizeof(prev));
+}
+
+/* Returns how many of the count multiplications were done, always from the
+ * front. Fewer than three are left to the ADX or BMI2 ladder, which does two
+ * in about the time the eight lane ladder takes.
+ */
+static inline unsigned int curve25519_batch_arch(u8 *const mypublic[],
+						 const u8 *const secret[],
+						 const u8 *const basepoint[],
+						 unsigned int count)
+{
+	simd_context_t simd_context;
+	unsigned int done = 0, n;
+
+	if (!IS_ENABLED(CONFIG_AS_AVX512IFMA) || !curve25519_use_avx512ifma ||
+	    count < 3)
+		return 0;
+
+	simd_get(&simd_context);
+	while (count - done >= 3 && simd_use(&simd_context)) {
+		n = min_t(unsigned int, count - done, CURVE25519_BATCH_MAX);
+		curve25519_ifma(mypublic + done, secret + done,
+				basepoint + done, n);
+		done += n;
+		simd_relax(&simd_context);
+	}
+	simd_put(&simd_context);
+	return done;
+}
@@ -40,6 +40,13 @@ static inline bool curve25519_base_arch(u8 pub[CURVE25519_KEY_SIZE],
 {
 	return false;
 }
+static inline unsigned int curve25519_batch_arch(u8 *const mypublic[],
+						 const u8 *const secret[],
+						 const u8 *const basepoint[],
+						 unsigned int count)
+{
+	return 0;
+}
 #endif
 
 #if defined(CONFIG_ARCH_SUPPORTS_INT128) && defined(__SIZEOF_INT128__)
@@ -60,6 +67,31 @@ bool curve25519(u8 mypublic[CURVE25519_KEY_SIZE],
 }
 EXPORT_SYMBOL(curve25519);
 
+void curve25519_batch(u8 *const mypublic[], const u8 *const secret[],
+		      const u8 *const basepoint[], bool valid[],
+		      unsigned int count)
+{
+	static const u8 base[CURVE25519_KEY_SIZE] = { 9 };
+	unsigned int i;
+
+	/* Whatever the batched implementation leaves over is done one at a
+	 * time, with the fixed-base path for the base point if there is one.
+	 */
+	i = curve25519_batch_arch(mypublic, secret, basepoint, count);
+	for (; i < count; ++i) {
+		if (!memcmp(basepoint[i], base, CURVE25519_KEY_SIZE) &&
+		    curve25519_base_arch(mypublic[i], secret[i]))
+			continue;
+		if (!curve25519_arch(mypublic[i], secret[i], basepoint[i]))
+			curve25519_generic(mypublic[i], secret[i],
+					   basepoint[i]);
+	}
+	for (i = 0; i < count; ++i)
+		valid[i] = crypto_memneq(mypublic[i], null_point,
+					 CURVE25519_KEY_SIZE);
+}
+EXPORT_SYMBOL(curve25519_batch);
+
 bool curve25519_generate_public(u8 pub[CURVE25519_KEY_SIZE],
 				const u8 secret[CURVE25519_KEY_SIZE])
 {
@@ -2059,10 +2059,14 @@ static const u8 blake2s_keyed_testvecs[][BLAKE2S_HASH_SIZE] __initconst = {
 
 static bool __init blake2s_selftest(void)
 {
+	struct blake2s_state states[BLAKE2S_LANES + 1];
+	u8 hashes[BLAKE2S_LANES + 1][BLAKE2S_HASH_SIZE];
+	u8 *outs[BLAKE2S_LANES + 1];
+	const u8 *ins[BLAKE2S_LANES + 1];
 	u8 key[BLAKE2S_KEY_SIZE];
 	u8 buf[ARRAY_SIZE(blake2s_testvecs)];
 	u8 hash[BLAKE2S_HASH_SIZE];
-	size_t i;
+	size_t i, j, lanes;
 	bool success = true;
 
 	for (i = 0; i < BLAKE2S_KEY_SIZE; ++i)
@@ -2086,5 +2090,29 @@ static bool __init blake2s_selftest(void)
 			success = false;
 		}
 	}
+
+	/* Each lane gets a different message, so that mixing up lanes shows.
+	 * One more than BLAKE2S_LANES needs to be split in two.
+	 */
+	for (i = 0; i < ARRAY_SIZE(blake2s_testvecs) - (BLAKE2S_LANES + 1);
+	     i += 3) {
+		lanes = i % (BLAKE2S_LANES + 1) + 1;
+		for (j = 0; j < lanes; ++j) {
+			blake2s_init_key(&states[j], BLAKE2S_HASH_SIZE, key,
+					 BLAKE2S_KEY_SIZE);
+			ins[j] = buf + j;
+			outs[j] = hashes[j];
+		}
+		blake2s_final_lanes(states, ins, i, outs, lanes);
+		for (j = 0; j < lanes; ++j) {
+			blake2s(hash, buf + j, key, BLAKE2S_HASH_SIZE, i,
+				BLAKE2S_KEY_SIZE);
+			if (memcmp(hash, hashes[j], BLAKE2S_HASH_SIZE)) {
+				pr_err("blake2s lanes self-test %zu: FAIL\n",
+				       i + 1);
+				success = false;
+			}
+		}
+	}
 	return success;
 }
@@ -8937,6 +8937,96 @@ static bool __init chacha20poly1305_selftest(void)
 			success = false;
 		}
 	}
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_enc_vectors); ++i) {
+		const size_t ilen = chacha20poly1305_enc_vectors[i].ilen;
+
+		if (chacha20poly1305_enc_vectors[i].nlen != 8)
+			continue;
+		memcpy(input, chacha20poly1305_enc_vectors[i].input, ilen);
+		memset(computed_output, 0, MAXIMUM_TEST_BUFFER_LEN);
+		sg_init_table(sg_src, 3);
+		sg_set_buf(&sg_src[0], input, ilen / 3);
+		sg_set_buf(&sg_src[1], input + ilen / 3, ilen / 3);
+		sg_set_buf(&sg_src[2], input + 2 * (ilen / 3),
+			   ilen - 2 * (ilen / 3));
+		ret = chacha20poly1305_encrypt_sg(computed_output, sg_src, ilen,
+			chacha20poly1305_enc_vectors[i].assoc,
+			chacha20poly1305_enc_vectors[i].alen,
+			get_unaligned_le64(chacha20poly1305_enc_vectors[i].nonce),
+			chacha20poly1305_enc_vectors[i].key,
+			&simd_context);
+		if (!ret || memcmp(computed_output,
+				   chacha20poly1305_enc_vectors[i].output,
+				   ilen + POLY1305_MAC_SIZE) ||
+		    memcmp(input, chacha20poly1305_enc_vectors[i].input, ilen)) {
+			pr_err("chacha20poly1305 out-of-place sg encryption self-test %zu: FAIL\n",
+			       i + 1);
+			success = false;
+		}
+	}
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_enc_vectors); ++i) {
+		const size_t ilen = chacha20poly1305_enc_vectors[i].ilen;
+		const size_t csum_start = ilen / 4;
+		const size_t csum_offset = (ilen - csum_start - 2) / 2;
+		__sum16 check;
+
+		if (chacha20poly1305_enc_vectors[i].nlen != 8 || ilen < 2)
+			continue;
+
+		/* The reference sums and then encrypts, in place in input. */
+		memcpy(computed_output, chacha20poly1305_enc_vectors[i].input,
+		       ilen);
+		sg_init_table(sg_src, 3);
+		sg_set_buf(&sg_src[0], computed_output, ilen / 3);
+		sg_set_buf(&sg_src[1], computed_output + ilen / 3, ilen / 3);
+		sg_set_buf(&sg_src[2], computed_output + 2 * (ilen / 3),
+			   ilen - 2 * (ilen / 3));
+		memcpy(input, chacha20poly1305_enc_vectors[i].input, ilen);
+		check = csum_fold(csum_partial(input + csum_start,
+					       ilen - csum_start, 0));
+		put_unaligned(check ?: CSUM_MANGLED_0,
+			      (__sum16 *)(input + csum_start + csum_offset));
+		chacha20poly1305_encrypt_simd(input, input, ilen,
+			chacha20poly1305_enc_vectors[i].assoc,
+			chacha20poly1305_enc_vectors[i].alen,
+			get_unaligned_le64(chacha20poly1305_enc_vectors[i].nonce),
+			chacha20poly1305_enc_vectors[i].key,
+			&simd_context);
+		ret = chacha20poly1305_encrypt_csum_sg(computed_output, sg_src,
+			ilen, chacha20poly1305_enc_vectors[i].assoc,
+			chacha20poly1305_enc_vectors[i].alen, csum_start,
+			csum_offset,
+			get_unaligned_le64(chacha20poly1305_enc_vectors[i].nonce),
+			chacha20poly1305_enc_vectors[i].key,
+			&simd_context);
+		if (!ret || memcmp(computed_output, input,
+				   ilen + POLY1305_MAC_SIZE)) {
+			pr_err("chacha20poly1305 checksumming sg encryption self-test %zu: FAIL\n",
+			       i + 1);
+			success = false;
+		}
+	}
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_enc_vectors); ++i) {
+		if (chacha20poly1305_enc_vectors[i].nlen != 8)
+			continue;
+		memcpy(computed_output, chacha20poly1305_enc_vectors[i].input,
+		       chacha20poly1305_enc_vectors[i].ilen);
+		chacha20poly1305_encrypt_simd(computed_output, computed_output,
+			chacha20poly1305_enc_vectors[i].ilen,
+			chacha20poly1305_enc_vectors[i].assoc,
+			chacha20poly1305_enc_vectors[i].alen,
+			get_unaligned_le64(chacha20poly1305_enc_vectors[i].nonce),
+			chacha20poly1305_enc_vectors[i].key,
+			&simd_context);
+		if (memcmp(computed_output,
+			   chacha20poly1305_enc_vectors[i].output,
+			   chacha20poly1305_enc_vectors[i].ilen +
+							POLY1305_MAC_SIZE)) {
+			pr_err("chacha20poly1305 in-place encryption self-test %zu: FAIL\n",
+			       i + 1);
+			success = false;
+		}
+	}
 	simd_put(&simd_context);
 	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_dec_vectors); ++i) {
 		memset(computed_output, 0, MAXIMUM_TEST_BUFFER_LEN);
@@ -8980,6 +9070,50 @@ static bool __init chacha20poly1305_selftest(void)
 			success = false;
 		}
 	}
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_dec_vectors); ++i) {
+		const size_t ilen = chacha20poly1305_dec_vectors[i].ilen;
+
+		memcpy(input, chacha20poly1305_dec_vectors[i].input, ilen);
+		memset(computed_output, 0, MAXIMUM_TEST_BUFFER_LEN);
+		sg_init_table(sg_src, 3);
+		sg_set_buf(&sg_src[0], input, ilen / 3);
+		sg_set_buf(&sg_src[1], input + ilen / 3, ilen / 3);
+		sg_set_buf(&sg_src[2], input + 2 * (ilen / 3),
+			   ilen - 2 * (ilen / 3));
+		ret = chacha20poly1305_decrypt_sg(computed_output, sg_src, ilen,
+			chacha20poly1305_dec_vectors[i].assoc,
+			chacha20poly1305_dec_vectors[i].alen,
+			get_unaligned_le64(chacha20poly1305_dec_vectors[i].nonce),
+			chacha20poly1305_dec_vectors[i].key, &simd_context);
+		if (!decryption_success(ret,
+			chacha20poly1305_dec_vectors[i].failure,
+			memcmp(computed_output, chacha20poly1305_dec_vectors[i].output,
+			       ilen - POLY1305_MAC_SIZE)) ||
+		    memcmp(input, chacha20poly1305_dec_vectors[i].input, ilen)) {
+			pr_err("chacha20poly1305 out-of-place sg decryption self-test %zu: FAIL\n",
+			       i + 1);
+			success = false;
+		}
+	}
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_dec_vectors); ++i) {
+		memcpy(computed_output, chacha20poly1305_dec_vectors[i].input,
+		       chacha20poly1305_dec_vectors[i].ilen);
+		ret = chacha20poly1305_decrypt_simd(computed_output,
+			computed_output, chacha20poly1305_dec_vectors[i].ilen,
+			chacha20poly1305_dec_vectors[i].assoc,
+			chacha20poly1305_dec_vectors[i].alen,
+			get_unaligned_le64(chacha20poly1305_dec_vectors[i].nonce),
+			chacha20poly1305_dec_vectors[i].key, &simd_context);
+		if (!decryption_success(ret,
+			chacha20poly1305_dec_vectors[i].failure,
+			memcmp(computed_output, chacha20poly1305_dec_vectors[i].output,
+			       chacha20poly1305_dec_vectors[i].ilen -
+							POLY1305_MAC_SIZE))) {
+			pr_err("chacha20poly1305 in-place decryption self-test %zu: FAIL\n",
+			       i + 1);
+			success = false;
+		}
+	}
 	simd_put(&simd_context);
 	for (i = 0; i < ARRAY_SIZE(xchacha20poly1305_enc_vectors); ++i) {
 		memset(computed_output, 0, MAXIMUM_TEST_BUFFER_LEN);
@@ -1278,6 +1278,69 @@ static const struct curve25519_test_vector curve25519_test_vectors[] __initconst
 	}
 };
 
+static bool __init curve25519_batch_selftest(void)
+{
+	enum { BATCH = CURVE25519_BATCH_MAX + 1 };
+	u8 secret[BATCH][CURVE25519_KEY_SIZE];
+	u8 basepoint[BATCH][CURVE25519_KEY_SIZE];
+	u8 out[BATCH][CURVE25519_KEY_SIZE], expected[CURVE25519_KEY_SIZE];
+	const struct curve25519_test_vector *vec;
+	const u8 *secrets[BATCH], *basepoints[BATCH];
+	u8 *outs[BATCH];
+	bool success = true, valid[BATCH], ret;
+	size_t i, j, n, count;
+
+	for (j = 0; j < BATCH; ++j)
+		outs[j] = out[j];
+
+	/* Both a small batch and one that spills past a single ladder, so that
+	 * the vectors land in different lanes and on both paths.
+	 */
+	for (n = 3; n <= BATCH; n += BATCH - 3) {
+		for (i = 0; i < ARRAY_SIZE(curve25519_test_vectors); i += n) {
+			vec = &curve25519_test_vectors[i];
+			count = min(n, ARRAY_SIZE(curve25519_test_vectors) - i);
+			for (j = 0; j < count; ++j) {
+				secrets[j] = vec[j].private;
+				basepoints[j] = vec[j].public;
+			}
+			memset(out, 0, sizeof(out));
+			curve25519_batch(outs, secrets, basepoints, valid,
+					 count);
+			for (j = 0; j < count; ++j) {
+				if (valid[j] == vec[j].valid &&
+				    !memcmp(out[j], vec[j].result,
+					    CURVE25519_KEY_SIZE))
+					continue;
+				pr_err("curve25519 batch self-test %zu: FAIL\n",
+				       i + j + 1);
+				success = false;
+			}
+		}
+	}
+
+	for (i = 0; i < 4; ++i) {
+		get_random_bytes(secret, sizeof(secret));
+		get_random_bytes(basepoint, sizeof(basepoint));
+		for (j = 0; j < BATCH; ++j) {
+			secrets[j] = secret[j];
+			basepoints[j] = basepoint[j];
+		}
+		curve25519_batch(outs, secrets, basepoints, valid, BATCH);
+		for (j = 0; j < BATCH; ++j) {
+			ret = curve25519(expected, secret[j], basepoint[j]);
+			if (ret == valid[j] &&
+			    !memcmp(out[j], expected, CURVE25519_KEY_SIZE))
+				continue;
+			pr_err("curve25519 batch random self-test %zu: FAIL\n",
+			       i * BATCH + j + 1);
+			success = false;
+		}
+	}
+
+	return success;
+}
+
 static bool __init curve25519_selftest(void)
 {
 	bool success = true, ret, ret2;
@@ -1311,5 +1374,8 @@ static bool __init curve25519_selftest(void)
 		}
 	}
 
+	if (!curve25519_batch_selftest())
+		success = false;
+
 	return success;
 }
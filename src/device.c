@@ -80,6 +80,10 @@ static int wg_pm_notification(struct notifier_block *nb, unsigned long action,
 	if (IS_ENABLED(CONFIG_PM_AUTOSLEEP) || IS_ENABLED(CONFIG_ANDROID))
 		return 0;
 
+	if (action == PM_POST_HIBERNATION || action == PM_POST_SUSPEND) {
+		wg_noise_ephemeral_pools_resume();
+		return 0;
+	}
 	if (action != PM_HIBERNATION_PREPARE && action != PM_SUSPEND_PREPARE)
 		return 0;
 
@@ -87,13 +91,14 @@ static int wg_pm_notification(struct notifier_block *nb, unsigned long action,
 	list_for_each_entry(wg, &device_list, device_list) {
 		mutex_lock(&wg->device_update_lock);
 		list_for_each_entry(peer, &wg->peer_list, peer_list) {
-			del_timer(&peer->timer_zero_key_material);
+			wg_timers_del(peer, WG_TIMER_ZERO_KEY_MATERIAL);
 			wg_noise_handshake_clear(&peer->handshake);
 			wg_noise_keypairs_clear(&peer->keypairs);
 		}
 		mutex_unlock(&wg->device_update_lock);
 	}
 	rtnl_unlock();
+	wg_noise_ephemeral_pools_suspend();
 	rcu_barrier();
 	return 0;
 }
@@ -109,13 +114,14 @@ static int wg_stop(struct net_device *dev)
 	mutex_lock(&wg->device_update_lock);
 	list_for_each_entry(peer, &wg->peer_list, peer_list) {
 		wg_packet_purge_staged_packets(peer);
+		wg_packet_initiation_backlog_remove(peer);
 		wg_timers_stop(peer);
 		wg_noise_handshake_clear(&peer->handshake);
 		wg_noise_keypairs_clear(&peer->keypairs);
 		wg_noise_reset_last_sent_handshake(&peer->last_sent_handshake);
 	}
 	mutex_unlock(&wg->device_update_lock);
-	skb_queue_purge(&wg->incoming_handshakes);
+	wg_packet_handshake_queues_purge(wg);
 	wg_socket_reinit(wg, NULL, NULL);
 	return 0;
 }
@@ -197,6 +203,7 @@ static netdev_tx_t wg_xmit(struct sk_buff *skb, struct net_device *dev)
 	while (skb_queue_len(&peer->staged_packet_queue) > MAX_STAGED_PACKETS) {
 		dev_kfree_skb(__skb_dequeue(&peer->staged_packet_queue));
 		++dev->stats.tx_dropped;
+		wg_peer_stats_tx_dropped(peer, 1);
 	}
 	skb_queue_splice_tail(&packets, &peer->staged_packet_queue);
 	spin_unlock_bh(&peer->staged_packet_queue.lock);
@@ -237,20 +244,25 @@ static void wg_destruct(struct net_device *dev)
 	wg_socket_reinit(wg, NULL, NULL);
 	/* The final references are cleared in the below calls to destroy_workqueue. */
 	wg_peer_remove_all(wg);
+	wg_timers_wheel_destroy(&wg->timer_wheel);
+	cancel_delayed_work_sync(&wg->initiation_scheduler.work);
 	destroy_workqueue(wg->handshake_receive_wq);
 	destroy_workqueue(wg->handshake_send_wq);
 	destroy_workqueue(wg->packet_crypt_wq);
 	wg_packet_queue_free(&wg->decrypt_queue, true);
 	wg_packet_queue_free(&wg->encrypt_queue, true);
 	rcu_barrier(); /* Wait for all the peers to be actually freed. */
+	wg_packet_shared_napi_free(wg);
+	wg_packet_rx_page_pools_free(wg);
+	wg_cookie_checker_uninit(&wg->cookie_checker);
 	wg_ratelimiter_uninit();
 	memzero_explicit(&wg->static_identity, sizeof(wg->static_identity));
-	skb_queue_purge(&wg->incoming_handshakes);
+	wg_packet_handshake_queues_free(wg);
 	free_percpu(dev->tstats);
-	free_percpu(wg->incoming_handshakes_worker);
+	free_percpu(wg->stats);
 	if (wg->have_creating_net_ref)
 		put_net(wg->creating_net);
-	kvfree(wg->index_hashtable);
+	wg_index_hashtable_free(wg->index_hashtable);
 	kvfree(wg->peer_hashtable);
 	mutex_unlock(&wg->device_update_lock);
 
@@ -307,9 +319,10 @@ static int wg_newlink(struct net *src_net, struct net_device *dev,
 	init_rwsem(&wg->static_identity.lock);
 	mutex_init(&wg->socket_update_lock);
 	mutex_init(&wg->device_update_lock);
-	skb_queue_head_init(&wg->incoming_handshakes);
 	wg_allowedips_init(&wg->peer_allowedips);
 	wg_cookie_checker_init(&wg->cookie_checker, wg);
+	wg_timers_wheel_init(&wg->timer_wheel);
+	wg_packet_initiation_scheduler_init(wg);
 	INIT_LIST_HEAD(&wg->peer_list);
 	wg->device_update_gen = 1;
 
@@ -325,16 +338,17 @@ static int wg_newlink(struct net *src_net, struct net_device *dev,
 	if (!dev->tstats)
 		goto err_free_index_hashtable;
 
-	wg->incoming_handshakes_worker =
-		wg_packet_percpu_multicore_worker_alloc(
-				wg_packet_handshake_receive_worker, wg);
-	if (!wg->incoming_handshakes_worker)
+	wg->stats = netdev_alloc_pcpu_stats(struct wg_device_stats);
+	if (!wg->stats)
 		goto err_free_tstats;
 
+	if (wg_packet_handshake_queues_init(wg) < 0)
+		goto err_free_stats;
+
 	wg->handshake_receive_wq = alloc_workqueue("wg-kex-%s",
 			WQ_CPU_INTENSIVE | WQ_FREEZABLE, 0, dev->name);
 	if (!wg->handshake_receive_wq)
-		goto err_free_incoming_handshakes;
+		goto err_free_handshake_queues;
 
 	wg->handshake_send_wq = alloc_workqueue("wg-kex-%s",
 			WQ_UNBOUND | WQ_FREEZABLE, 0, dev->name);
@@ -356,10 +370,14 @@ static int wg_newlink(struct net *src_net, struct net_device *dev,
 	if (ret < 0)
 		goto err_free_encrypt_queue;
 
-	ret = wg_ratelimiter_init();
+	ret = wg_packet_rx_page_pools_init(wg);
 	if (ret < 0)
 		goto err_free_decrypt_queue;
 
+	ret = wg_ratelimiter_init();
+	if (ret < 0)
+		goto err_free_rx_page_pools;
+
 	ret = register_netdevice(dev);
 	if (ret < 0)
 		goto err_uninit_ratelimiter;
@@ -376,6 +394,8 @@ static int wg_newlink(struct net *src_net, struct net_device *dev,
 
 err_uninit_ratelimiter:
 	wg_ratelimiter_uninit();
+err_free_rx_page_pools:
+	wg_packet_rx_page_pools_free(wg);
 err_free_decrypt_queue:
 	wg_packet_queue_free(&wg->decrypt_queue, true);
 err_free_encrypt_queue:
@@ -386,12 +406,14 @@ err_destroy_handshake_send:
 	destroy_workqueue(wg->handshake_send_wq);
 err_destroy_handshake_receive:
 	destroy_workqueue(wg->handshake_receive_wq);
-err_free_incoming_handshakes:
-	free_percpu(wg->incoming_handshakes_worker);
+err_free_handshake_queues:
+	wg_packet_handshake_queues_free(wg);
+err_free_stats:
+	free_percpu(wg->stats);
 err_free_tstats:
 	free_percpu(dev->tstats);
 err_free_index_hashtable:
-	kvfree(wg->index_hashtable);
+	wg_index_hashtable_free(wg->index_hashtable);
 err_free_peer_hashtable:
 	kvfree(wg->peer_hashtable);
 	return ret;
@@ -10,6 +10,8 @@
 #include "allowedips.h"
 #include "peerlookup.h"
 #include "cookie.h"
+#include "timers.h"
+#include "uapi/wireguard.h"
 
 #include <linux/types.h>
 #include <linux/netdevice.h>
@@ -17,8 +19,11 @@
 #include <linux/mutex.h>
 #include <linux/net.h>
 #include <linux/ptr_ring.h>
+#include <linux/smp.h>
+#include <linux/u64_stats_sync.h>
 
 struct wg_device;
+struct page_pool;
 
 struct multicore_worker {
 	void *ptr;
@@ -36,6 +41,70 @@ struct crypt_queue {
 	};
 };
 
+/* Each CPU queues up the handshake packets it receives for its own worker, and
+ * a worker whose queue has run dry may steal from the others.
+ */
+struct handshake_queue {
+	struct sk_buff_head skbs;
+	struct work_struct work;
+	struct wg_device *wg;
+};
+
+/* Estimates whether handshakes arrive faster than they can be processed, from
+ * how long they wait in the queues on average, and from how long the queued
+ * ones will take at the average cost of processing one. The device is under
+ * load while either exceeds HANDSHAKE_LOAD_TARGET_MSECS, and until it has
+ * stayed below for HANDSHAKE_LOAD_HOLD seconds. The average wait is also
+ * halved for every HANDSHAKE_LOAD_INTERVAL_MSECS that passes, so that it soon
+ * forgets a flood that is over. All workers update this racily, which is fine
+ * for an estimate.
+ */
+struct handshake_load {
+	u64 sojourn_avg, cost_avg;
+	u64 sojourn_decayed, last_overloaded;
+};
+
+static inline bool wg_handshake_under_load(const struct handshake_load *load,
+					   u64 now)
+{
+	u64 last = READ_ONCE(load->last_overloaded);
+
+	return last && now - last < (u64)HANDSHAKE_LOAD_HOLD * NSEC_PER_SEC;
+}
+
+/* In the default mode, each peer allocates one of these, and `peer' points
+ * back to it. When WGDEVICE_FEATURE_SHARED_NAPI is set, the device instead owns
+ * one per CPU, which peers only point to, `peer' is NULL, and `peers' holds
+ * those peers that have decrypted packets waiting, in the order in which they
+ * should be serviced.
+ */
+struct rx_napi {
+	struct napi_struct napi;
+	struct wg_peer *peer;
+	struct list_head peers;
+	spinlock_t lock;
+	call_single_data_t steer_csd;
+	unsigned long steer_pending;
+};
+
+struct wg_device_stats {
+	u64 counters[__WGDEVICE_STAT_A_LAST];
+	struct u64_stats_sync syncp;
+};
+
+/* Paces the handshake initiations of all peers to at most rate per second,
+ * allowing bursts of up to a second's worth, with the rest waiting their turn
+ * in backlog.
+ */
+struct initiation_scheduler {
+	spinlock_t lock;
+	struct list_head backlog;
+	unsigned int backlog_len;
+	u32 rate;
+	u64 next_slot;
+	struct delayed_work work;
+};
+
 struct wg_device {
 	struct net_device *dev;
 	struct crypt_queue encrypt_queue, decrypt_queue;
@@ -44,17 +113,22 @@ struct wg_device {
 	struct noise_static_identity static_identity;
 	struct workqueue_struct *handshake_receive_wq, *handshake_send_wq;
 	struct workqueue_struct *packet_crypt_wq;
-	struct sk_buff_head incoming_handshakes;
-	int incoming_handshake_cpu;
-	struct multicore_worker __percpu *incoming_handshakes_worker;
+	struct handshake_queue __percpu *handshake_queues;
+	int handshake_steal_cpu;
+	struct handshake_load handshake_load;
+	struct rx_napi __percpu *shared_rx_napi;
+	struct wg_device_stats __percpu *stats;
+	struct page_pool * __percpu *rx_page_pools;
 	struct cookie_checker cookie_checker;
+	struct wg_timer_wheel timer_wheel;
+	struct initiation_scheduler initiation_scheduler;
 	struct pubkey_hashtable *peer_hashtable;
 	struct index_hashtable *index_hashtable;
 	struct allowedips peer_allowedips;
 	struct mutex device_update_lock, socket_update_lock;
 	struct list_head device_list, peer_list;
 	unsigned int num_peers, device_update_gen;
-	u32 fwmark;
+	u32 fwmark, features;
 	u16 incoming_port;
 	bool have_creating_net_ref;
 };
@@ -62,6 +136,17 @@ struct wg_device {
 int wg_device_init(void);
 void wg_device_uninit(void);
 
+/* Must be called with bh disabled. */
+static inline void wg_device_stat_add(struct wg_device *wg,
+				      enum wgdevice_stat_attribute stat, u64 n)
+{
+	struct wg_device_stats *stats = this_cpu_ptr(wg->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	stats->counters[stat] += n;
+	u64_stats_update_end(&stats->syncp);
+}
+
 /* Later after the dust settles, this can be moved into include/linux/skbuff.h,
  * where virtually all code that deals with GSO segs can benefit, around ~30
  * drivers as of writing.
@@ -8,6 +8,7 @@
 #include "noise.h"
 #include "queueing.h"
 #include "ratelimiter.h"
+#include "peerlookup.h"
 #include "netlink.h"
 #include "uapi/wireguard.h"
 #include "crypto/zinc.h"
@@ -28,10 +29,12 @@ static int __init mod_init(void)
 
 #ifdef DEBUG
 	if (!wg_allowedips_selftest() || !wg_packet_counter_selftest() ||
-	    !wg_ratelimiter_selftest())
+	    !wg_ratelimiter_selftest() || !wg_index_hashtable_selftest())
 		return -ENOTRECOVERABLE;
 #endif
-	wg_noise_init();
+	ret = wg_noise_init();
+	if (ret < 0)
+		return ret;
 
 	ret = wg_device_init();
 	if (ret < 0)
@@ -49,6 +52,7 @@ static int __init mod_init(void)
 err_netlink:
 	wg_device_uninit();
 err_device:
+	wg_noise_uninit();
 	return ret;
 }
 
@@ -56,6 +60,7 @@ static void __exit mod_exit(void)
 {
 	wg_genetlink_uninit();
 	wg_device_uninit();
+	wg_noise_uninit();
 }
 
 module_init(mod_init);
@@ -43,12 +43,18 @@ enum limits {
 	REKEY_TIMEOUT = 5,
 	REKEY_TIMEOUT_JITTER_MAX_JIFFIES = HZ / 3,
 	REKEY_AFTER_TIME = 120,
+	REKEY_AFTER_TIME_JITTER_MAX = REKEY_AFTER_TIME / 8,
 	REJECT_AFTER_TIME = 180,
 	INITIATIONS_PER_SECOND = 50,
 	MAX_PEERS_PER_DEVICE = 1U << 20,
 	KEEPALIVE_TIMEOUT = 10,
 	MAX_TIMER_HANDSHAKES = 90 / REKEY_TIMEOUT,
 	MAX_QUEUED_INCOMING_HANDSHAKES = 4096, /* TODO: replace this with DQL */
+	MIN_QUEUED_INCOMING_HANDSHAKES_PER_CPU = 128,
+	HANDSHAKE_QUEUE_STEAL_THRESHOLD = 16,
+	HANDSHAKE_LOAD_TARGET_MSECS = 10,
+	HANDSHAKE_LOAD_HOLD = 1,
+	HANDSHAKE_LOAD_INTERVAL_MSECS = 100,
 	MAX_STAGED_PACKETS = 128,
 	MAX_QUEUED_PACKETS = 1024 /* TODO: replace this with DQL */
 };
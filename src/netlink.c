@@ -25,7 +25,10 @@ static const struct nla_policy device_policy[WGDEVICE_A_MAX + 1] = {
 	[WGDEVICE_A_FLAGS]		= { .type = NLA_U32 },
 	[WGDEVICE_A_LISTEN_PORT]	= { .type = NLA_U16 },
 	[WGDEVICE_A_FWMARK]		= { .type = NLA_U32 },
-	[WGDEVICE_A_PEERS]		= { .type = NLA_NESTED }
+	[WGDEVICE_A_PEERS]		= { .type = NLA_NESTED },
+	[WGDEVICE_A_FEATURES]		= { .type = NLA_U32 },
+	[WGDEVICE_A_STATS]		= { .type = NLA_NESTED },
+	[WGDEVICE_A_HANDSHAKE_RATE]	= { .type = NLA_U32 }
 };
 
 static const struct nla_policy peer_policy[WGPEER_A_MAX + 1] = {
@@ -38,7 +41,11 @@ static const struct nla_policy peer_policy[WGPEER_A_MAX + 1] = {
 	[WGPEER_A_RX_BYTES]				= { .type = NLA_U64 },
 	[WGPEER_A_TX_BYTES]				= { .type = NLA_U64 },
 	[WGPEER_A_ALLOWEDIPS]				= { .type = NLA_NESTED },
-	[WGPEER_A_PROTOCOL_VERSION]			= { .type = NLA_U32 }
+	[WGPEER_A_PROTOCOL_VERSION]			= { .type = NLA_U32 },
+	[WGPEER_A_RX_PACKETS]				= { .type = NLA_U64 },
+	[WGPEER_A_TX_PACKETS]				= { .type = NLA_U64 },
+	[WGPEER_A_RX_DROPPED]				= { .type = NLA_U64 },
+	[WGPEER_A_TX_DROPPED]				= { .type = NLA_U64 }
 };
 
 static const struct nla_policy allowedip_policy[WGALLOWEDIP_A_MAX + 1] = {
@@ -70,6 +77,48 @@ static struct wg_device *lookup_interface(struct nlattr **attrs,
 	return netdev_priv(dev);
 }
 
+static int get_stats(struct wg_device *wg, struct sk_buff *skb)
+{
+	u64 stats[__WGDEVICE_STAT_A_LAST] = { 0 };
+	struct nlattr *stats_nest;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		const struct wg_device_stats *pcpu_stats =
+			per_cpu_ptr(wg->stats, cpu);
+		u64 counters[__WGDEVICE_STAT_A_LAST];
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&pcpu_stats->syncp);
+			memcpy(counters, pcpu_stats->counters,
+			       sizeof(counters));
+		} while (u64_stats_fetch_retry_irq(&pcpu_stats->syncp, start));
+		for (i = 0; i < __WGDEVICE_STAT_A_LAST; ++i)
+			stats[i] += counters[i];
+	}
+
+	stats_nest = nla_nest_start(skb, WGDEVICE_A_STATS);
+	if (!stats_nest)
+		return -EMSGSIZE;
+	for (i = WGDEVICE_STAT_A_UNSPEC + 1; i < __WGDEVICE_STAT_A_LAST; ++i) {
+		if (nla_put_u64_64bit(skb, i, stats[i],
+				      WGDEVICE_STAT_A_UNSPEC)) {
+			nla_nest_cancel(skb, stats_nest);
+			return -EMSGSIZE;
+		}
+	}
+	nla_nest_end(skb, stats_nest);
+	return 0;
+}
+
+/* In microseconds. */
+static u32 get_handshake_sojourn(struct wg_device *wg)
+{
+	return div_u64(READ_ONCE(wg->handshake_load.sojourn_avg),
+		       NSEC_PER_USEC);
+}
+
 static int get_allowedips(struct sk_buff *skb, const u8 *ip, u8 cidr,
 			  int family)
 {
@@ -123,6 +172,7 @@ get_peer(struct wg_peer *peer, struct sk_buff *skb, struct dump_ctx *ctx)
 			.tv_sec = peer->walltime_last_handshake.tv_sec,
 			.tv_nsec = peer->walltime_last_handshake.tv_nsec
 		};
+		struct wg_peer_stats stats;
 
 		down_read(&peer->handshake.lock);
 		fail = nla_put(skb, WGPEER_A_PRESHARED_KEY,
@@ -132,14 +182,23 @@ get_peer(struct wg_peer *peer, struct sk_buff *skb, struct dump_ctx *ctx)
 		if (fail)
 			goto err;
 
+		wg_peer_get_stats(peer, &stats);
 		if (nla_put(skb, WGPEER_A_LAST_HANDSHAKE_TIME,
 			    sizeof(last_handshake), &last_handshake) ||
 		    nla_put_u16(skb, WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL,
 				peer->persistent_keepalive_interval) ||
-		    nla_put_u64_64bit(skb, WGPEER_A_TX_BYTES, peer->tx_bytes,
+		    nla_put_u64_64bit(skb, WGPEER_A_TX_BYTES, stats.tx_bytes,
 				      WGPEER_A_UNSPEC) ||
-		    nla_put_u64_64bit(skb, WGPEER_A_RX_BYTES, peer->rx_bytes,
+		    nla_put_u64_64bit(skb, WGPEER_A_RX_BYTES, stats.rx_bytes,
 				      WGPEER_A_UNSPEC) ||
+		    nla_put_u64_64bit(skb, WGPEER_A_TX_PACKETS,
+				      stats.tx_packets, WGPEER_A_UNSPEC) ||
+		    nla_put_u64_64bit(skb, WGPEER_A_RX_PACKETS,
+				      stats.rx_packets, WGPEER_A_UNSPEC) ||
+		    nla_put_u64_64bit(skb, WGPEER_A_TX_DROPPED,
+				      stats.tx_dropped, WGPEER_A_UNSPEC) ||
+		    nla_put_u64_64bit(skb, WGPEER_A_RX_DROPPED,
+				      stats.rx_dropped, WGPEER_A_UNSPEC) ||
 		    nla_put_u32(skb, WGPEER_A_PROTOCOL_VERSION, 1))
 			goto err;
 
@@ -205,6 +264,18 @@ static int wg_get_device_start(struct netlink_callback *cb)
 	return 0;
 }
 
+static u32 get_features(struct wg_device *wg)
+{
+	u32 features = wg->features & ~WGDEVICE_FEATURE_THREADED_NAPI;
+
+#ifndef COMPAT_CANNOT_USE_THREADED_NAPI
+	/* This may also be changed through sysfs, behind our back. */
+	if (READ_ONCE(wg->dev->threaded))
+		features |= WGDEVICE_FEATURE_THREADED_NAPI;
+#endif
+	return features;
+}
+
 static int wg_get_device_dump(struct sk_buff *skb, struct netlink_callback *cb)
 {
 	struct wg_peer *peer, *next_peer_cursor;
@@ -230,8 +301,19 @@ static int wg_get_device_dump(struct sk_buff *skb, struct netlink_callback *cb)
 		if (nla_put_u16(skb, WGDEVICE_A_LISTEN_PORT,
 				wg->incoming_port) ||
 		    nla_put_u32(skb, WGDEVICE_A_FWMARK, wg->fwmark) ||
+		    nla_put_u32(skb, WGDEVICE_A_FEATURES, get_features(wg)) ||
+		    nla_put_u32(skb, WGDEVICE_A_HANDSHAKE_RATE,
+				READ_ONCE(wg->initiation_scheduler.rate)) ||
+		    nla_put_u32(skb, WGDEVICE_A_HANDSHAKE_BACKLOG,
+				READ_ONCE(wg->initiation_scheduler.backlog_len)) ||
+		    nla_put_u8(skb, WGDEVICE_A_HANDSHAKE_UNDER_LOAD,
+			       wg_handshake_under_load(&wg->handshake_load,
+						       ktime_get_ns())) ||
+		    nla_put_u32(skb, WGDEVICE_A_HANDSHAKE_SOJOURN,
+				get_handshake_sojourn(wg)) ||
 		    nla_put_u32(skb, WGDEVICE_A_IFINDEX, wg->dev->ifindex) ||
-		    nla_put_string(skb, WGDEVICE_A_IFNAME, wg->dev->name))
+		    nla_put_string(skb, WGDEVICE_A_IFNAME, wg->dev->name) ||
+		    get_stats(wg, skb))
 			goto out;
 
 		down_read(&wg->static_identity.lock);
@@ -324,6 +406,64 @@ static int set_port(struct wg_device *wg, u16 port)
 	return wg_socket_init(wg, port);
 }
 
+static int set_features(struct wg_device *wg, u32 features)
+{
+	const u32 napi_features = WGDEVICE_FEATURE_SHARED_NAPI |
+				  WGDEVICE_FEATURE_BUSY_POLL;
+	u32 changed = get_features(wg) ^ features;
+	int ret;
+
+	if (features & ~__WGDEVICE_FEATURE_ALL)
+		return -EOPNOTSUPP;
+#ifdef COMPAT_CANNOT_USE_THREADED_NAPI
+	if (features & WGDEVICE_FEATURE_THREADED_NAPI)
+		return -EOPNOTSUPP;
+#endif
+#ifdef COMPAT_CANNOT_USE_NAPI_BUSY_POLL
+	if (features & WGDEVICE_FEATURE_BUSY_POLL)
+		return -EOPNOTSUPP;
+#endif
+#ifdef COMPAT_CANNOT_USE_RPS_SOCK_FLOW_TABLE
+	if (features & WGDEVICE_FEATURE_FLOW_STEERING)
+		return -EOPNOTSUPP;
+#endif
+	if (!changed)
+		return 0;
+
+	/* Peers pick their NAPI context when they are created and keep it for
+	 * their entire lifetime, so that the order of received packets is
+	 * maintained, and busy polling can only be allowed when a context is
+	 * added. Therefore these can only change when there are no peers
+	 * around to be moved from one context to another.
+	 */
+	if (changed & napi_features) {
+		if (wg->num_peers)
+			return -EBUSY;
+		wg_packet_shared_napi_free(wg);
+		wg->features = (wg->features & ~napi_features) |
+			       (features & napi_features);
+		if (features & WGDEVICE_FEATURE_SHARED_NAPI) {
+			ret = wg_packet_shared_napi_init(wg);
+			if (ret) {
+				wg->features &= ~WGDEVICE_FEATURE_SHARED_NAPI;
+				return ret;
+			}
+		}
+	}
+
+#ifndef COMPAT_CANNOT_USE_THREADED_NAPI
+	/* This applies to existing contexts, as well as to those added later. */
+	if (changed & WGDEVICE_FEATURE_THREADED_NAPI) {
+		ret = dev_set_threaded(wg->dev,
+				       !!(features & WGDEVICE_FEATURE_THREADED_NAPI));
+		if (ret)
+			return ret;
+	}
+#endif
+	wg->features = features;
+	return 0;
+}
+
 static int set_allowedip(struct wg_peer *peer, struct nlattr **attrs)
 {
 	int ret = -EINVAL;
@@ -515,7 +655,9 @@ static int wg_set_device(struct sk_buff *skb, struct genl_info *info)
 
 	ret = -EPERM;
 	if ((info->attrs[WGDEVICE_A_LISTEN_PORT] ||
-	     info->attrs[WGDEVICE_A_FWMARK]) &&
+	     info->attrs[WGDEVICE_A_FWMARK] ||
+	     info->attrs[WGDEVICE_A_FEATURES] ||
+	     info->attrs[WGDEVICE_A_HANDSHAKE_RATE]) &&
 	    !ns_capable(wg->creating_net->user_ns, CAP_NET_ADMIN))
 		goto out;
 
@@ -529,6 +671,10 @@ static int wg_set_device(struct sk_buff *skb, struct genl_info *info)
 			wg_socket_clear_peer_endpoint_src(peer);
 	}
 
+	if (info->attrs[WGDEVICE_A_HANDSHAKE_RATE])
+		wg_packet_initiation_scheduler_set_rate(wg,
+			nla_get_u32(info->attrs[WGDEVICE_A_HANDSHAKE_RATE]));
+
 	if (info->attrs[WGDEVICE_A_LISTEN_PORT]) {
 		ret = set_port(wg,
 			nla_get_u16(info->attrs[WGDEVICE_A_LISTEN_PORT]));
@@ -539,6 +685,13 @@ static int wg_set_device(struct sk_buff *skb, struct genl_info *info)
 	if (flags & WGDEVICE_F_REPLACE_PEERS)
 		wg_peer_remove_all(wg);
 
+	if (info->attrs[WGDEVICE_A_FEATURES]) {
+		ret = set_features(wg,
+			nla_get_u32(info->attrs[WGDEVICE_A_FEATURES]));
+		if (ret)
+			goto out;
+	}
+
 	if (info->attrs[WGDEVICE_A_PRIVATE_KEY] &&
 	    nla_len(info->attrs[WGDEVICE_A_PRIVATE_KEY]) ==
 		    NOISE_PUBLIC_KEY_LEN) {
@@ -594,8 +747,15 @@ skip_set_private_key:
 	ret = 0;
 
 out:
-	mutex_unlock(&wg->device_update_lock);
+	/* Changing allowed IPs drops the compiled lookup tables, so that they
+	 * are rebuilt just once here, for however many changes were made. That
+	 * takes time in proportion to the number of allowed IPs, and the tables
+	 * are only changed under device_update_lock, so the rest of the system
+	 * need not wait on RTNL for it.
+	 */
 	rtnl_unlock();
+	wg_allowedips_compile(&wg->peer_allowedips, &wg->device_update_lock);
+	mutex_unlock(&wg->device_update_lock);
 	dev_put(wg->dev);
 out_nodev:
 	if (info->attrs[WGDEVICE_A_PRIVATE_KEY])
@@ -15,6 +15,7 @@
 #include <linux/bitmap.h>
 #include <linux/scatterlist.h>
 #include <linux/highmem.h>
+#include <linux/random.h>
 #include <crypto/algapi.h>
 
 /* This implements Noise_IKpsk2:
@@ -31,9 +32,134 @@ static u8 handshake_init_hash[NOISE_HASH_LEN] __ro_after_init;
 static u8 handshake_init_chaining_key[NOISE_HASH_LEN] __ro_after_init;
 static atomic64_t keypair_counter = ATOMIC64_INIT(0);
 
-void __init wg_noise_init(void)
+/* Each CPU keeps a few ephemeral keypairs generated ahead of time, so that
+ * creating a handshake message need not wait on a scalar multiplication. Each
+ * pool is refilled by its own work item once it runs half empty, and each
+ * keypair is zeroed as soon as it is taken. While the system is suspended, the
+ * pools stay empty.
+ */
+enum { EPHEMERAL_POOL_SIZE = 16 };
+
+struct ephemeral_keypair {
+	u8 private[NOISE_PUBLIC_KEY_LEN];
+	u8 public[NOISE_PUBLIC_KEY_LEN];
+};
+
+struct ephemeral_pool {
+	spinlock_t lock;
+	unsigned int count;
+	struct ephemeral_keypair keypairs[EPHEMERAL_POOL_SIZE];
+	struct work_struct refill_work;
+};
+
+static struct ephemeral_pool __percpu *ephemeral_pools;
+static bool ephemeral_pools_suspended;
+
+static void ephemeral_pool_refill(struct work_struct *work)
+{
+	static const u8 basepoint[CURVE25519_KEY_SIZE] = { 9 };
+	struct ephemeral_pool *pool = container_of(work, struct ephemeral_pool,
+						   refill_work);
+	struct ephemeral_keypair keypairs[CURVE25519_BATCH_MAX];
+	const u8 *secrets[CURVE25519_BATCH_MAX];
+	const u8 *basepoints[CURVE25519_BATCH_MAX];
+	u8 *publics[CURVE25519_BATCH_MAX];
+	bool valid[CURVE25519_BATCH_MAX];
+	unsigned int i, n;
+
+	for (i = 0; i < CURVE25519_BATCH_MAX; ++i) {
+		secrets[i] = keypairs[i].private;
+		basepoints[i] = basepoint;
+		publics[i] = keypairs[i].public;
+	}
+
+	/* The publics are computed a batch at a time, side by side where the
+	 * CPU allows it.
+	 */
+	while (READ_ONCE(pool->count) < EPHEMERAL_POOL_SIZE) {
+		n = min_t(unsigned int, CURVE25519_BATCH_MAX,
+			  EPHEMERAL_POOL_SIZE - READ_ONCE(pool->count));
+		for (i = 0; i < n; ++i)
+			curve25519_generate_secret(keypairs[i].private);
+		curve25519_batch(publics, secrets, basepoints, valid, n);
+		spin_lock(&pool->lock);
+		/* Checked under the lock, so that a refill racing with
+		 * suspending either finishes before the pool is wiped or puts
+		 * nothing back into it.
+		 */
+		if (unlikely(READ_ONCE(ephemeral_pools_suspended))) {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		for (i = 0; i < n; ++i) {
+			if (valid[i] && pool->count < EPHEMERAL_POOL_SIZE)
+				pool->keypairs[pool->count++] = keypairs[i];
+		}
+		spin_unlock(&pool->lock);
+		cond_resched();
+	}
+	memzero_explicit(keypairs, sizeof(keypairs));
+}
+
+/* Must be called from process context. */
+static bool ephemeral_keypair_generate(u8 private[NOISE_PUBLIC_KEY_LEN],
+				       u8 public[NOISE_PUBLIC_KEY_LEN])
+{
+	struct ephemeral_pool *pool = raw_cpu_ptr(ephemeral_pools);
+	struct ephemeral_keypair *keypair;
+	bool taken = false, refill;
+
+	spin_lock(&pool->lock);
+	if (pool->count) {
+		keypair = &pool->keypairs[--pool->count];
+		memcpy(private, keypair->private, NOISE_PUBLIC_KEY_LEN);
+		memcpy(public, keypair->public, NOISE_PUBLIC_KEY_LEN);
+		memzero_explicit(keypair, sizeof(*keypair));
+		taken = true;
+	}
+	refill = pool->count < EPHEMERAL_POOL_SIZE / 2 &&
+		 !READ_ONCE(ephemeral_pools_suspended);
+	spin_unlock(&pool->lock);
+	if (refill)
+		queue_work(system_unbound_wq, &pool->refill_work);
+	if (taken)
+		return true;
+
+	curve25519_generate_secret(private);
+	return curve25519_generate_public(public, private);
+}
+
+static void ephemeral_pools_clear(void)
+{
+	struct ephemeral_pool *pool;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(ephemeral_pools, cpu);
+		cancel_work_sync(&pool->refill_work);
+		spin_lock(&pool->lock);
+		memzero_explicit(pool->keypairs, sizeof(pool->keypairs));
+		pool->count = 0;
+		spin_unlock(&pool->lock);
+	}
+}
+
+/* Wipes the pools and keeps them from being refilled until resuming. */
+void wg_noise_ephemeral_pools_suspend(void)
+{
+	WRITE_ONCE(ephemeral_pools_suspended, true);
+	ephemeral_pools_clear();
+}
+
+void wg_noise_ephemeral_pools_resume(void)
+{
+	WRITE_ONCE(ephemeral_pools_suspended, false);
+}
+
+int __init wg_noise_init(void)
 {
 	struct blake2s_state blake;
+	int cpu;
 
 	blake2s(handshake_init_chaining_key, handshake_name, NULL,
 		NOISE_HASH_LEN, sizeof(handshake_name), 0);
@@ -41,6 +167,23 @@ void __init wg_noise_init(void)
 	blake2s_update(&blake, handshake_init_chaining_key, NOISE_HASH_LEN);
 	blake2s_update(&blake, identifier_name, sizeof(identifier_name));
 	blake2s_final(&blake, handshake_init_hash);
+
+	ephemeral_pools = alloc_percpu(struct ephemeral_pool);
+	if (!ephemeral_pools)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		spin_lock_init(&per_cpu_ptr(ephemeral_pools, cpu)->lock);
+		per_cpu_ptr(ephemeral_pools, cpu)->count = 0;
+		INIT_WORK(&per_cpu_ptr(ephemeral_pools, cpu)->refill_work,
+			  ephemeral_pool_refill);
+	}
+	return 0;
+}
+
+void wg_noise_uninit(void)
+{
+	ephemeral_pools_clear();
+	free_percpu(ephemeral_pools);
 }
 
 /* Must hold peer->handshake.static_identity->lock */
@@ -386,6 +529,14 @@ static void derive_keys(struct noise_symmetric_key *first_dst,
 	symmetric_key_init(second_dst);
 }
 
+static void mix_precomputed_dh(u8 chaining_key[NOISE_HASH_LEN],
+			       u8 key[NOISE_SYMMETRIC_KEY_LEN],
+			       const u8 dh_calculation[NOISE_PUBLIC_KEY_LEN])
+{
+	kdf(chaining_key, key, NULL, dh_calculation, NOISE_HASH_LEN,
+	    NOISE_SYMMETRIC_KEY_LEN, 0, NOISE_PUBLIC_KEY_LEN, chaining_key);
+}
+
 static bool __must_check mix_dh(u8 chaining_key[NOISE_HASH_LEN],
 				u8 key[NOISE_SYMMETRIC_KEY_LEN],
 				const u8 private[NOISE_PUBLIC_KEY_LEN],
@@ -395,12 +546,30 @@ static bool __must_check mix_dh(u8 chaining_key[NOISE_HASH_LEN],
 
 	if (unlikely(!curve25519(dh_calculation, private, public)))
 		return false;
-	kdf(chaining_key, key, NULL, dh_calculation, NOISE_HASH_LEN,
-	    NOISE_SYMMETRIC_KEY_LEN, 0, NOISE_PUBLIC_KEY_LEN, chaining_key);
+	mix_precomputed_dh(chaining_key, key, dh_calculation);
 	memzero_explicit(dh_calculation, NOISE_PUBLIC_KEY_LEN);
 	return true;
 }
 
+/* Mixes in the DH of our static private key and e, taking it from dh if that
+ * was computed for the static identity we still have.
+ */
+static bool __must_check
+mix_static_dh(u8 chaining_key[NOISE_HASH_LEN], u8 key[NOISE_SYMMETRIC_KEY_LEN],
+	      const struct noise_static_identity *static_identity,
+	      const struct noise_consumption_dh *dh,
+	      const u8 e[NOISE_PUBLIC_KEY_LEN])
+{
+	if (!dh || memcmp(dh->static_public, static_identity->static_public,
+			  NOISE_PUBLIC_KEY_LEN))
+		return mix_dh(chaining_key, key,
+			      static_identity->static_private, e);
+	if (unlikely(!dh->valid))
+		return false;
+	mix_precomputed_dh(chaining_key, key, dh->result);
+	return true;
+}
+
 static void mix_hash(u8 hash[NOISE_HASH_LEN], const u8 *src, size_t src_len)
 {
 	struct blake2s_state blake;
@@ -510,9 +679,8 @@ wg_noise_handshake_create_initiation(struct message_handshake_initiation *dst,
 		       handshake->remote_static);
 
 	/* e */
-	curve25519_generate_secret(handshake->ephemeral_private);
-	if (!curve25519_generate_public(dst->unencrypted_ephemeral,
-					handshake->ephemeral_private))
+	if (!ephemeral_keypair_generate(handshake->ephemeral_private,
+					dst->unencrypted_ephemeral))
 		goto out;
 	message_ephemeral(dst->unencrypted_ephemeral,
 			  dst->unencrypted_ephemeral, handshake->chaining_key,
@@ -539,9 +707,11 @@ wg_noise_handshake_create_initiation(struct message_handshake_initiation *dst,
 	message_encrypt(dst->encrypted_timestamp, timestamp,
 			NOISE_TIMESTAMP_LEN, key, handshake->hash);
 
-	dst->sender_index = wg_index_hashtable_insert(
-		handshake->entry.peer->device->index_hashtable,
-		&handshake->entry);
+	if (!wg_index_hashtable_insert(
+			handshake->entry.peer->device->index_hashtable,
+			&handshake->entry))
+		goto out;
+	dst->sender_index = handshake->entry.index;
 
 	handshake->state = HANDSHAKE_CREATED_INITIATION;
 	ret = true;
@@ -553,9 +723,46 @@ out:
 	return ret;
 }
 
+/* Computes the static-ephemeral DH of a batch of incoming initiations side by
+ * side, for wg_noise_handshake_consume_initiation() to pick up. This is most of
+ * the cost of consuming one, and only needs our static private key. Responses
+ * are left out: they first have to match a handshake we initiated, and
+ * computing theirs beforehand would let anyone who knows our public key have
+ * us do a scalar multiplication per packet.
+ */
+void wg_noise_handshake_precompute_consumption(
+	struct wg_device *wg, const u8 *const ephemerals[],
+	struct noise_consumption_dh dh[], unsigned int count)
+{
+	const u8 *secrets[CURVE25519_BATCH_MAX];
+	u8 *results[CURVE25519_BATCH_MAX];
+	bool valid[CURVE25519_BATCH_MAX];
+	unsigned int i, n;
+
+	down_read(&wg->static_identity.lock);
+	for (; count; count -= n, dh += n, ephemerals += n) {
+		n = min_t(unsigned int, count, CURVE25519_BATCH_MAX);
+		for (i = 0; i < n; ++i) {
+			memcpy(dh[i].static_public,
+			       wg->static_identity.static_public,
+			       NOISE_PUBLIC_KEY_LEN);
+			secrets[i] = wg->static_identity.static_private;
+			results[i] = dh[i].result;
+			dh[i].valid = false;
+		}
+		if (unlikely(!wg->static_identity.has_identity))
+			continue;
+		curve25519_batch(results, secrets, ephemerals, valid, n);
+		for (i = 0; i < n; ++i)
+			dh[i].valid = valid[i];
+	}
+	up_read(&wg->static_identity.lock);
+}
+
 struct wg_peer *
 wg_noise_handshake_consume_initiation(struct message_handshake_initiation *src,
-				      struct wg_device *wg)
+				      struct wg_device *wg,
+				      const struct noise_consumption_dh *dh)
 {
 	struct wg_peer *peer = NULL, *ret_peer = NULL;
 	struct noise_handshake *handshake;
@@ -578,7 +785,7 @@ wg_noise_handshake_consume_initiation(struct message_handshake_initiation *src,
 	message_ephemeral(e, src->unencrypted_ephemeral, chaining_key, hash);
 
 	/* es */
-	if (!mix_dh(chaining_key, key, wg->static_identity.static_private, e))
+	if (!mix_static_dh(chaining_key, key, &wg->static_identity, dh, e))
 		goto out;
 
 	/* s */
@@ -637,8 +844,56 @@ out:
 	return ret_peer;
 }
 
+/* Takes an ephemeral for each handshake that has consumed an initiation, and
+ * computes its ee and se, for all of them side by side. The handshakes are
+ * only read here, so that no two of their locks are ever held at once, and
+ * wg_noise_handshake_create_response() checks that the remote ephemeral is
+ * the one the results are for. Must be called from process context.
+ */
+void wg_noise_handshake_precompute_responses(
+	struct noise_handshake *const handshakes[],
+	struct noise_response_dh dh[], unsigned int count)
+{
+	const u8 *secrets[CURVE25519_BATCH_MAX];
+	const u8 *publics[CURVE25519_BATCH_MAX];
+	u8 *results[CURVE25519_BATCH_MAX];
+	struct noise_response_dh *pending[CURVE25519_BATCH_MAX / 2];
+	bool valid[CURVE25519_BATCH_MAX], consumed;
+	unsigned int i, j, n = 0;
+
+	for (i = 0; i < count; ++i) {
+		dh[i].valid = false;
+		down_read(&handshakes[i]->lock);
+		consumed = handshakes[i]->state ==
+			   HANDSHAKE_CONSUMED_INITIATION;
+		memcpy(dh[i].remote_ephemeral, handshakes[i]->remote_ephemeral,
+		       NOISE_PUBLIC_KEY_LEN);
+		up_read(&handshakes[i]->lock);
+
+		if (consumed && ephemeral_keypair_generate(
+					dh[i].ephemeral_private,
+					dh[i].ephemeral_public)) {
+			secrets[2 * n] = dh[i].ephemeral_private;
+			secrets[2 * n + 1] = dh[i].ephemeral_private;
+			publics[2 * n] = dh[i].remote_ephemeral;
+			publics[2 * n + 1] = handshakes[i]->remote_static;
+			results[2 * n] = dh[i].ee;
+			results[2 * n + 1] = dh[i].se;
+			pending[n++] = &dh[i];
+		}
+		if (!n || (n < ARRAY_SIZE(pending) && i + 1 < count))
+			continue;
+
+		curve25519_batch(results, secrets, publics, valid, 2 * n);
+		for (j = 0; j < n; ++j)
+			pending[j]->valid = valid[2 * j] && valid[2 * j + 1];
+		n = 0;
+	}
+}
+
 bool wg_noise_handshake_create_response(struct message_handshake_response *dst,
-					struct noise_handshake *handshake)
+					struct noise_handshake *handshake,
+					const struct noise_response_dh *dh)
 {
 	u8 key[NOISE_SYMMETRIC_KEY_LEN];
 	bool ret = false;
@@ -657,23 +912,39 @@ bool wg_noise_handshake_create_response(struct message_handshake_response *dst,
 	dst->header.type = cpu_to_le32(MESSAGE_HANDSHAKE_RESPONSE);
 	dst->receiver_index = handshake->remote_index;
 
+	if (dh && (!dh->valid || memcmp(dh->remote_ephemeral,
+					handshake->remote_ephemeral,
+					NOISE_PUBLIC_KEY_LEN)))
+		dh = NULL;
+
 	/* e */
-	curve25519_generate_secret(handshake->ephemeral_private);
-	if (!curve25519_generate_public(dst->unencrypted_ephemeral,
-					handshake->ephemeral_private))
+	if (dh) {
+		memcpy(handshake->ephemeral_private, dh->ephemeral_private,
+		       NOISE_PUBLIC_KEY_LEN);
+		memcpy(dst->unencrypted_ephemeral, dh->ephemeral_public,
+		       NOISE_PUBLIC_KEY_LEN);
+	} else if (!ephemeral_keypair_generate(handshake->ephemeral_private,
+					       dst->unencrypted_ephemeral)) {
 		goto out;
+	}
 	message_ephemeral(dst->unencrypted_ephemeral,
 			  dst->unencrypted_ephemeral, handshake->chaining_key,
 			  handshake->hash);
 
 	/* ee */
-	if (!mix_dh(handshake->chaining_key, NULL, handshake->ephemeral_private,
-		    handshake->remote_ephemeral))
+	if (dh)
+		mix_precomputed_dh(handshake->chaining_key, NULL, dh->ee);
+	else if (!mix_dh(handshake->chaining_key, NULL,
+			 handshake->ephemeral_private,
+			 handshake->remote_ephemeral))
 		goto out;
 
 	/* se */
-	if (!mix_dh(handshake->chaining_key, NULL, handshake->ephemeral_private,
-		    handshake->remote_static))
+	if (dh)
+		mix_precomputed_dh(handshake->chaining_key, NULL, dh->se);
+	else if (!mix_dh(handshake->chaining_key, NULL,
+			 handshake->ephemeral_private,
+			 handshake->remote_static))
 		goto out;
 
 	/* psk */
@@ -683,9 +954,11 @@ bool wg_noise_handshake_create_response(struct message_handshake_response *dst,
 	/* {} */
 	message_encrypt(dst->encrypted_nothing, NULL, 0, key, handshake->hash);
 
-	dst->sender_index = wg_index_hashtable_insert(
-		handshake->entry.peer->device->index_hashtable,
-		&handshake->entry);
+	if (!wg_index_hashtable_insert(
+			handshake->entry.peer->device->index_hashtable,
+			&handshake->entry))
+		goto out;
+	dst->sender_index = handshake->entry.index;
 
 	handshake->state = HANDSHAKE_CREATED_RESPONSE;
 	ret = true;
@@ -807,6 +1080,15 @@ bool wg_noise_handshake_begin_session(struct noise_handshake *handshake,
 		derive_keys(&new_keypair->receiving, &new_keypair->sending,
 			    handshake->chaining_key);
 
+	/* Peers that handshook together would otherwise all rekey together, so
+	 * each keypair is rekeyed at a random point somewhat before
+	 * REKEY_AFTER_TIME instead.
+	 */
+	new_keypair->rekey_time = new_keypair->sending.birthdate +
+		(u64)REKEY_AFTER_TIME * NSEC_PER_SEC -
+		(u64)prandom_u32_max(REKEY_AFTER_TIME_JITTER_MAX * MSEC_PER_SEC) *
+		NSEC_PER_MSEC;
+
 	handshake_zero(handshake);
 	rcu_read_lock_bh();
 	if (likely(!READ_ONCE(container_of(handshake, struct wg_peer,
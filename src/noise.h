@@ -26,20 +26,24 @@ union noise_counter {
 
 struct noise_symmetric_key {
 	u8 key[NOISE_SYMMETRIC_KEY_LEN];
-	union noise_counter counter;
 	u64 birthdate;
 	bool is_valid;
+	/* The counter, and on receive its replay bitmap, is written for every
+	 * packet, so it stays off of the line holding the read-only key.
+	 */
+	union noise_counter counter ____cacheline_aligned_in_smp;
 };
 
 struct noise_keypair {
 	struct index_hashtable_entry entry;
-	struct noise_symmetric_key sending;
-	struct noise_symmetric_key receiving;
 	__le32 remote_index;
 	bool i_am_the_initiator;
-	struct kref refcount;
-	struct rcu_head rcu;
+	u64 rekey_time;
 	u64 internal_id;
+	struct rcu_head rcu;
+	struct kref refcount ____cacheline_aligned_in_smp;
+	struct noise_symmetric_key sending ____cacheline_aligned_in_smp;
+	struct noise_symmetric_key receiving ____cacheline_aligned_in_smp;
 };
 
 struct noise_keypairs {
@@ -91,9 +95,35 @@ struct noise_handshake {
 	struct rw_semaphore lock;
 };
 
+/* The es of an incoming initiation, which is computed for a whole batch of them
+ * at once by wg_noise_handshake_precompute_consumption(). It is only used if
+ * the static identity it was computed for is still the current one.
+ */
+struct noise_consumption_dh {
+	u8 static_public[NOISE_PUBLIC_KEY_LEN];
+	u8 result[NOISE_PUBLIC_KEY_LEN];
+	bool valid;
+};
+
+/* The e, ee and se of an outgoing response, which are computed for a whole
+ * batch of handshakes at once by wg_noise_handshake_precompute_responses().
+ * They are only used if the handshake still has the same remote ephemeral.
+ */
+struct noise_response_dh {
+	u8 ephemeral_private[NOISE_PUBLIC_KEY_LEN];
+	u8 ephemeral_public[NOISE_PUBLIC_KEY_LEN];
+	u8 remote_ephemeral[NOISE_PUBLIC_KEY_LEN];
+	u8 ee[NOISE_PUBLIC_KEY_LEN];
+	u8 se[NOISE_PUBLIC_KEY_LEN];
+	bool valid;
+};
+
 struct wg_device;
 
-void wg_noise_init(void);
+int wg_noise_init(void);
+void wg_noise_uninit(void);
+void wg_noise_ephemeral_pools_suspend(void);
+void wg_noise_ephemeral_pools_resume(void);
 bool wg_noise_handshake_init(struct noise_handshake *handshake,
 			   struct noise_static_identity *static_identity,
 			   const u8 peer_public_key[NOISE_PUBLIC_KEY_LEN],
@@ -121,12 +151,20 @@ bool wg_noise_precompute_static_static(struct wg_peer *peer);
 bool
 wg_noise_handshake_create_initiation(struct message_handshake_initiation *dst,
 				     struct noise_handshake *handshake);
+void wg_noise_handshake_precompute_consumption(
+	struct wg_device *wg, const u8 *const ephemerals[],
+	struct noise_consumption_dh dh[], unsigned int count);
 struct wg_peer *
 wg_noise_handshake_consume_initiation(struct message_handshake_initiation *src,
-				      struct wg_device *wg);
+				      struct wg_device *wg,
+				      const struct noise_consumption_dh *dh);
 
+void wg_noise_handshake_precompute_responses(
+	struct noise_handshake *const handshakes[],
+	struct noise_response_dh dh[], unsigned int count);
 bool wg_noise_handshake_create_response(struct message_handshake_response *dst,
-					struct noise_handshake *handshake);
+					struct noise_handshake *handshake,
+					const struct noise_response_dh *dh);
 struct wg_peer *
 wg_noise_handshake_consume_response(struct message_handshake_response *src,
 				    struct wg_device *wg);
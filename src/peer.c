@@ -17,6 +17,19 @@
 
 static atomic64_t peer_counter = ATOMIC64_INIT(0);
 
+/* Shared NAPI contexts are handed out to peers round robin, and a peer never
+ * changes its context, so that its packets are always delivered in order.
+ */
+static int choose_shared_napi_cpu(struct wg_peer *peer)
+{
+	unsigned int cpu_index = peer->internal_id % num_possible_cpus(), i;
+	int cpu = cpumask_first(cpu_possible_mask);
+
+	for (i = 0; i < cpu_index; ++i)
+		cpu = cpumask_next(cpu, cpu_possible_mask);
+	return cpu;
+}
+
 struct wg_peer *wg_peer_create(struct wg_device *wg,
 			       const u8 public_key[NOISE_PUBLIC_KEY_LEN],
 			       const u8 preshared_key[NOISE_SYMMETRIC_KEY_LEN])
@@ -47,6 +60,18 @@ struct wg_peer *wg_peer_create(struct wg_device *wg,
 	if (wg_packet_queue_init(&peer->rx_queue, NULL, false,
 				 MAX_QUEUED_PACKETS))
 		goto err_3;
+	peer->stats = netdev_alloc_pcpu_stats(struct wg_peer_stats);
+	if (unlikely(!peer->stats))
+		goto err_4;
+	if (wg->features & WGDEVICE_FEATURE_SHARED_NAPI) {
+		peer->rx_napi = per_cpu_ptr(wg->shared_rx_napi,
+					    choose_shared_napi_cpu(peer));
+	} else {
+		peer->rx_napi = kzalloc(sizeof(*peer->rx_napi), GFP_KERNEL);
+		if (unlikely(!peer->rx_napi))
+			goto err_5;
+		peer->rx_napi->peer = peer;
+	}
 
 	peer->internal_id = atomic64_inc_return(&peer_counter);
 	peer->serial_work_cpu = nr_cpumask_bits;
@@ -56,14 +81,14 @@ struct wg_peer *wg_peer_create(struct wg_device *wg,
 	spin_lock_init(&peer->keypairs.keypair_update_lock);
 	INIT_WORK(&peer->transmit_handshake_work,
 		  wg_packet_handshake_send_worker);
+	INIT_LIST_HEAD(&peer->initiation_backlog_entry);
+	init_completion(&peer->rx_napi_drained);
 	rwlock_init(&peer->endpoint_lock);
 	kref_init(&peer->refcount);
 	skb_queue_head_init(&peer->staged_packet_queue);
 	wg_noise_reset_last_sent_handshake(&peer->last_sent_handshake);
-	set_bit(NAPI_STATE_NO_BUSY_POLL, &peer->napi.state);
-	netif_napi_add(wg->dev, &peer->napi, wg_packet_rx_poll,
-		       NAPI_POLL_WEIGHT);
-	napi_enable(&peer->napi);
+	if (peer->rx_napi->peer == peer)
+		wg_packet_napi_add(wg, peer->rx_napi, wg_packet_rx_poll);
 	list_add_tail(&peer->peer_list, &wg->peer_list);
 	INIT_LIST_HEAD(&peer->allowedips_list);
 	wg_pubkey_hashtable_add(wg->peer_hashtable, peer);
@@ -71,6 +96,10 @@ struct wg_peer *wg_peer_create(struct wg_device *wg,
 	pr_debug("%s: Peer %llu created\n", wg->dev->name, peer->internal_id);
 	return peer;
 
+err_5:
+	free_percpu(peer->stats);
+err_4:
+	wg_packet_queue_free(&peer->rx_queue, false);
 err_3:
 	wg_packet_queue_free(&peer->tx_queue, false);
 err_2:
@@ -129,15 +158,28 @@ static void peer_remove_after_dead(struct wg_peer *peer)
 	/* b.1) For send (but not receive, since that's napi). */
 	flush_workqueue(peer->device->packet_crypt_wq);
 	/* b.2.1) For receive (but not send, since that's wq). */
-	napi_disable(&peer->napi);
-	/* b.2.1) It's now safe to remove the napi struct, which must be done
-	 * here from process context.
-	 */
-	netif_napi_del(&peer->napi);
+	if (peer->rx_napi->peer == peer) {
+		wg_packet_napi_del(peer->rx_napi);
+		kfree(peer->rx_napi);
+		peer->rx_napi = NULL;
+	} else {
+		/* b.2.2) A shared napi can't be disabled on behalf of a single
+		 * peer, so instead we wait for it to drain our rx_queue and let
+		 * go of us. No new packets can arrive after the flushes above,
+		 * so once it has been dequeued, it stays that way.
+		 */
+		spin_lock_bh(&peer->rx_napi->lock);
+		peer->rx_napi_draining = peer->rx_napi_queued;
+		spin_unlock_bh(&peer->rx_napi->lock);
+		if (peer->rx_napi_draining)
+			wait_for_completion(&peer->rx_napi_drained);
+	}
 
-	/* Ensure any workstructs we own (like transmit_handshake_work or
-	 * clear_peer_work) no longer are in use.
+	/* Ensure any workstructs we own (like transmit_handshake_work) no
+	 * longer are in use, after taking ourselves out of the initiation
+	 * backlog, from which no more can be queued.
 	 */
+	wg_packet_initiation_backlog_remove(peer);
 	flush_workqueue(peer->device->handshake_send_wq);
 
 	/* After the above flushes, a peer might still be active in a few
@@ -195,6 +237,37 @@ void wg_peer_remove_all(struct wg_device *wg)
 		peer_remove_after_dead(peer);
 }
 
+void wg_peer_get_stats(struct wg_peer *peer, struct wg_peer_stats *stats)
+{
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		const struct wg_peer_stats *pcpu_stats =
+			per_cpu_ptr(peer->stats, cpu);
+		u64 rx_bytes, tx_bytes, rx_packets, tx_packets;
+		u64 rx_dropped, tx_dropped;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&pcpu_stats->syncp);
+			rx_bytes = pcpu_stats->rx_bytes;
+			tx_bytes = pcpu_stats->tx_bytes;
+			rx_packets = pcpu_stats->rx_packets;
+			tx_packets = pcpu_stats->tx_packets;
+			rx_dropped = pcpu_stats->rx_dropped;
+			tx_dropped = pcpu_stats->tx_dropped;
+		} while (u64_stats_fetch_retry_irq(&pcpu_stats->syncp, start));
+
+		stats->rx_bytes += rx_bytes;
+		stats->tx_bytes += tx_bytes;
+		stats->rx_packets += rx_packets;
+		stats->tx_packets += tx_packets;
+		stats->rx_dropped += rx_dropped;
+		stats->tx_dropped += tx_dropped;
+	}
+}
+
 static void rcu_release(struct rcu_head *rcu)
 {
 	struct wg_peer *peer = container_of(rcu, struct wg_peer, rcu);
@@ -202,6 +275,7 @@ static void rcu_release(struct rcu_head *rcu)
 	dst_cache_destroy(&peer->endpoint_cache);
 	wg_packet_queue_free(&peer->rx_queue, false);
 	wg_packet_queue_free(&peer->tx_queue, false);
+	free_percpu(peer->stats);
 
 	/* The final zeroing takes care of clearing any remaining handshake key
 	 * material and other potentially sensitive information.
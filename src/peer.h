@@ -14,6 +14,8 @@
 #include <linux/netfilter.h>
 #include <linux/spinlock.h>
 #include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/u64_stats_sync.h>
 #include <net/dst_cache.h>
 
 struct wg_device;
@@ -34,42 +36,113 @@ struct endpoint {
 	};
 };
 
+struct wg_peer_stats {
+	u64 rx_bytes, tx_bytes;
+	u64 rx_packets, tx_packets;
+	u64 rx_dropped, tx_dropped;
+	struct u64_stats_sync syncp;
+};
+
 struct wg_peer {
+	/* Read by the data path on every packet, but rarely written. */
 	struct wg_device *device;
-	struct crypt_queue tx_queue, rx_queue;
-	struct sk_buff_head staged_packet_queue;
-	int serial_work_cpu;
 	struct noise_keypairs keypairs;
 	struct endpoint endpoint;
 	struct dst_cache endpoint_cache;
 	rwlock_t endpoint_lock;
-	struct noise_handshake handshake;
+	struct rx_napi *rx_napi;
+	struct wg_peer_stats __percpu *stats;
+	int serial_work_cpu;
+	u16 persistent_keepalive_interval;
+	bool is_dead;
+
+	/* Written by the transmit path. */
+	struct crypt_queue tx_queue ____cacheline_aligned_in_smp;
+	struct sk_buff_head staged_packet_queue;
+
+	/* Written by the receive path. */
+	struct crypt_queue rx_queue ____cacheline_aligned_in_smp;
+	struct list_head rx_napi_list;
+	u32 rx_flow_hash;
+	bool rx_napi_queued, rx_napi_draining;
+
+	/* Taken and put by every CPU handling this peer's packets. */
+	struct kref refcount ____cacheline_aligned_in_smp;
+
+	/* Recorded by the packet path for the timers to look at lazily. */
+	unsigned long timer_last_traversal ____cacheline_aligned_in_smp;
+	unsigned long timer_keepalive_deadline, timer_new_handshake_deadline;
+	unsigned int timer_received_since_sent; /* A bool, but cmpxchg()'d. */
+	bool timer_sent_since_received, timer_need_another_keepalive;
+
+	/* Handshake, timer and bookkeeping state, off of the packet path. */
+	struct noise_handshake handshake ____cacheline_aligned_in_smp;
 	atomic64_t last_sent_handshake;
-	struct work_struct transmit_handshake_work, clear_peer_work;
+	struct work_struct transmit_handshake_work;
+	struct completion rx_napi_drained;
+	struct list_head initiation_backlog_entry;
 	struct cookie latest_cookie;
 	struct hlist_node pubkey_hash;
-	u64 rx_bytes, tx_bytes;
-	struct timer_list timer_retransmit_handshake, timer_send_keepalive;
-	struct timer_list timer_new_handshake, timer_zero_key_material;
-	struct timer_list timer_persistent_keepalive;
+	struct hlist_node timer_node;
+	unsigned long timer_expires[__WG_TIMER_COUNT];
+	unsigned long timer_pending, timer_next;
+	unsigned int timer_slot;
 	unsigned int timer_handshake_attempts;
-	u16 persistent_keepalive_interval;
-	bool timer_need_another_keepalive;
 	bool sent_lastminute_handshake;
 	struct timespec64 walltime_last_handshake;
-	struct kref refcount;
 	struct rcu_head rcu;
 	struct list_head peer_list;
 	struct list_head allowedips_list;
 	u64 internal_id;
-	struct napi_struct napi;
-	bool is_dead;
 };
 
 struct wg_peer *wg_peer_create(struct wg_device *wg,
 			       const u8 public_key[NOISE_PUBLIC_KEY_LEN],
 			       const u8 preshared_key[NOISE_SYMMETRIC_KEY_LEN]);
 
+void wg_peer_get_stats(struct wg_peer *peer, struct wg_peer_stats *stats);
+
+/* The following must be called with bh disabled. */
+static inline void wg_peer_stats_rx(struct wg_peer *peer, size_t len)
+{
+	struct wg_peer_stats *stats = this_cpu_ptr(peer->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	++stats->rx_packets;
+	stats->rx_bytes += len;
+	u64_stats_update_end(&stats->syncp);
+}
+
+static inline void wg_peer_stats_tx(struct wg_peer *peer, size_t len)
+{
+	struct wg_peer_stats *stats = this_cpu_ptr(peer->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	++stats->tx_packets;
+	stats->tx_bytes += len;
+	u64_stats_update_end(&stats->syncp);
+}
+
+static inline void wg_peer_stats_rx_dropped(struct wg_peer *peer,
+					    unsigned int packets)
+{
+	struct wg_peer_stats *stats = this_cpu_ptr(peer->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	stats->rx_dropped += packets;
+	u64_stats_update_end(&stats->syncp);
+}
+
+static inline void wg_peer_stats_tx_dropped(struct wg_peer *peer,
+					    unsigned int packets)
+{
+	struct wg_peer_stats *stats = this_cpu_ptr(peer->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	stats->tx_dropped += packets;
+	u64_stats_update_end(&stats->syncp);
+}
+
 struct wg_peer *__must_check wg_peer_get_maybe_zero(struct wg_peer *peer);
 static inline struct wg_peer *wg_peer_get(struct wg_peer *peer)
 {
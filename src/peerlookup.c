@@ -70,125 +70,189 @@ wg_pubkey_hashtable_lookup(struct pubkey_hashtable *table,
 	return peer;
 }
 
-static struct hlist_head *index_bucket(struct index_hashtable *table,
-				       const __le32 index)
+/* An index is a random 32-bit number, whose low bits name a slot in a flat
+ * array that holds its entry, and whose remaining high bits are a random tag
+ * that tells it apart from every other index that would land in that slot.
+ * Looking one up is thus just a mask, a load and a comparison, with nothing
+ * to hash and no chain to walk.
+ */
+struct index_slots {
+	struct rcu_head rcu;
+	u32 mask;
+	struct index_hashtable_entry __rcu *entries[];
+};
+
+enum { INDEX_SLOTS_MIN = 256 };
+
+static struct index_slots *index_slots_alloc(u32 size)
 {
-	/* Since the indices are random and thus all bits are uniformly
-	 * distributed, we can find its bucket simply by masking.
-	 */
-	return &table->hashtable[(__force u32)index &
-				 (HASH_SIZE(table->hashtable) - 1)];
+	struct index_slots *slots = kvzalloc(sizeof(*slots) +
+					     size * sizeof(slots->entries[0]),
+					     GFP_KERNEL);
+
+	if (!slots)
+		return NULL;
+	slots->mask = size - 1;
+	return slots;
+}
+
+static void index_slots_free_rcu(struct rcu_head *rcu)
+{
+	kvfree(container_of(rcu, struct index_slots, rcu));
+}
+
+static struct index_slots *index_slots(struct index_hashtable *table)
+{
+	return rcu_dereference_protected(table->slots,
+					 lockdep_is_held(&table->lock));
+}
+
+/* Doubling the array brings one more bit of each index into its slot number,
+ * so every entry moves to one of two slots without ever colliding, and all
+ * indices handed out so far stay valid. The array never shrinks, since
+ * halving it would make pairs of live indices collide.
+ */
+static bool index_slots_grow(struct index_hashtable *table, u32 size)
+{
+	struct index_hashtable_entry *entry;
+	struct index_slots *old, *new;
+	u32 i, slot;
+
+	if (size >= 1U << 31)
+		return false;
+	new = index_slots_alloc(size * 2);
+	if (!new)
+		return false;
+
+	spin_lock_bh(&table->lock);
+	old = index_slots(table);
+	if (old->mask + 1 != size) {
+		/* Somebody else beat us to it. */
+		spin_unlock_bh(&table->lock);
+		kvfree(new);
+		return true;
+	}
+	for (i = 0; i <= old->mask; ++i) {
+		entry = rcu_dereference_protected(old->entries[i],
+				lockdep_is_held(&table->lock));
+		if (!entry)
+			continue;
+		slot = (__force u32)entry->index & new->mask;
+		RCU_INIT_POINTER(new->entries[slot], entry);
+	}
+	rcu_assign_pointer(table->slots, new);
+	spin_unlock_bh(&table->lock);
+
+	call_rcu(&old->rcu, index_slots_free_rcu);
+	return true;
 }
 
 struct index_hashtable *wg_index_hashtable_alloc(void)
 {
-	struct index_hashtable *table = kvmalloc(sizeof(*table), GFP_KERNEL);
+	struct index_hashtable *table = kzalloc(sizeof(*table), GFP_KERNEL);
+	struct index_slots *slots;
 
 	if (!table)
 		return NULL;
 
-	hash_init(table->hashtable);
+	slots = index_slots_alloc(INDEX_SLOTS_MIN);
+	if (!slots) {
+		kfree(table);
+		return NULL;
+	}
+	RCU_INIT_POINTER(table->slots, slots);
 	spin_lock_init(&table->lock);
 	return table;
 }
 
-/* At the moment, we limit ourselves to 2^20 total peers, which generally might
- * amount to 2^20*3 items in this hashtable. The algorithm below works by
- * picking a random number and testing it. We can see that these limits mean we
- * usually succeed pretty quickly:
+void wg_index_hashtable_free(struct index_hashtable *table)
+{
+	kvfree(rcu_dereference_protected(table->slots, true));
+	kfree(table);
+}
+
+/* The algorithm below works by picking a random number and taking it if the
+ * slot it names is free. The array doubles before it is three quarters full,
+ * so each try succeeds with probability at least 1/4, and usually far more.
  *
- * >>> def calculation(tries, size):
- * ...     return (size / 2**32)**(tries - 1) *  (1 - (size / 2**32))
- * ...
- * >>> calculation(1, 2**20 * 3)
- * 0.999267578125
- * >>> calculation(2, 2**20 * 3)
- * 0.0007318854331970215
- * >>> calculation(3, 2**20 * 3)
- * 5.360489012673497e-07
- * >>> calculation(4, 2**20 * 3)
- * 3.9261394135792216e-10
+ * Since the index is drawn uniformly from all those whose slot is free, an
+ * outsider who guesses an index hits a live one with the same count / 2^32
+ * probability as when indices were looked up by hash, and the indices it
+ * has seen tell it nothing about the others, whose tags are independent.
  *
  * At the moment, we don't do any masking, so this algorithm isn't exactly
- * constant time in either the random guessing or in the hash list lookup. We
- * could require a minimum of 3 tries, which would successfully mask the
- * guessing. this would not, however, help with the growing hash lengths, which
- * is another thing to consider moving forward.
+ * constant time in the random guessing. We could require a minimum number of
+ * tries, which would successfully mask the guessing.
+ *
+ * This may sleep when the array needs to grow, and it fails only if that
+ * growth cannot be allocated, in which case the caller fails the handshake
+ * message and a later one will try again.
  */
-
-__le32 wg_index_hashtable_insert(struct index_hashtable *table,
-				 struct index_hashtable_entry *entry)
+bool wg_index_hashtable_insert(struct index_hashtable *table,
+			       struct index_hashtable_entry *entry)
 {
-	struct index_hashtable_entry *existing_entry;
+	struct index_slots *slots;
+	u32 index, size;
 
-	spin_lock_bh(&table->lock);
-	hlist_del_init_rcu(&entry->index_hash);
-	spin_unlock_bh(&table->lock);
+	wg_index_hashtable_remove(table, entry);
 
-	rcu_read_lock_bh();
-
-search_unused_slot:
-	/* First we try to find an unused slot, randomly, while unlocked. */
-	entry->index = (__force __le32)get_random_u32();
-	hlist_for_each_entry_rcu_bh(existing_entry,
-				    index_bucket(table, entry->index),
-				    index_hash) {
-		if (existing_entry->index == entry->index)
-			/* If it's already in use, we continue searching. */
-			goto search_unused_slot;
-	}
-
-	/* Once we've found an unused slot, we lock it, and then double-check
-	 * that nobody else stole it from us.
-	 */
 	spin_lock_bh(&table->lock);
-	hlist_for_each_entry_rcu_bh(existing_entry,
-				    index_bucket(table, entry->index),
-				    index_hash) {
-		if (existing_entry->index == entry->index) {
-			spin_unlock_bh(&table->lock);
-			/* If it was stolen, we start over. */
-			goto search_unused_slot;
-		}
+	slots = index_slots(table);
+	while (table->count >= (slots->mask + 1) / 4 * 3) {
+		size = slots->mask + 1;
+		spin_unlock_bh(&table->lock);
+		if (!index_slots_grow(table, size))
+			return false;
+		spin_lock_bh(&table->lock);
+		slots = index_slots(table);
 	}
-	/* Otherwise, we know we have it exclusively (since we're locked),
-	 * so we insert.
-	 */
-	hlist_add_head_rcu(&entry->index_hash,
-			   index_bucket(table, entry->index));
+	do {
+		index = get_random_u32();
+	} while (rcu_access_pointer(slots->entries[index & slots->mask]));
+	entry->index = (__force __le32)index;
+	rcu_assign_pointer(slots->entries[index & slots->mask], entry);
+	++table->count;
 	spin_unlock_bh(&table->lock);
 
-	rcu_read_unlock_bh();
-
-	return entry->index;
+	return true;
 }
 
 bool wg_index_hashtable_replace(struct index_hashtable *table,
 				struct index_hashtable_entry *old,
 				struct index_hashtable_entry *new)
 {
-	if (unlikely(hlist_unhashed(&old->index_hash)))
-		return false;
+	struct index_slots *slots;
+	u32 slot;
+
 	spin_lock_bh(&table->lock);
+	slots = index_slots(table);
+	slot = (__force u32)old->index & slots->mask;
+	if (unlikely(rcu_access_pointer(slots->entries[slot]) != old)) {
+		spin_unlock_bh(&table->lock);
+		return false;
+	}
 	new->index = old->index;
-	hlist_replace_rcu(&old->index_hash, &new->index_hash);
-
-	/* Calling init here NULLs out index_hash, and in fact after this
-	 * function returns, it's theoretically possible for this to get
-	 * reinserted elsewhere. That means the RCU lookup below might either
-	 * terminate early or jump between buckets, in which case the packet
-	 * simply gets dropped, which isn't terrible.
-	 */
-	INIT_HLIST_NODE(&old->index_hash);
+	rcu_assign_pointer(slots->entries[slot], new);
 	spin_unlock_bh(&table->lock);
 	return true;
 }
 
+/* Removing an entry that isn't in the table is harmless and simply does
+ * nothing, which wg_noise_handshake_clear and keypair teardown rely on.
+ */
 void wg_index_hashtable_remove(struct index_hashtable *table,
 			       struct index_hashtable_entry *entry)
 {
+	struct index_slots *slots;
+	u32 slot;
+
 	spin_lock_bh(&table->lock);
-	hlist_del_init_rcu(&entry->index_hash);
+	slots = index_slots(table);
+	slot = (__force u32)entry->index & slots->mask;
+	if (rcu_access_pointer(slots->entries[slot]) == entry) {
+		RCU_INIT_POINTER(slots->entries[slot], NULL);
+		--table->count;
+	}
 	spin_unlock_bh(&table->lock);
 }
 
@@ -198,17 +262,16 @@ wg_index_hashtable_lookup(struct index_hashtable *table,
 			  const enum index_hashtable_type type_mask,
 			  const __le32 index, struct wg_peer **peer)
 {
-	struct index_hashtable_entry *iter_entry, *entry = NULL;
+	struct index_hashtable_entry *entry;
+	struct index_slots *slots;
 
 	rcu_read_lock_bh();
-	hlist_for_each_entry_rcu_bh(iter_entry, index_bucket(table, index),
-				    index_hash) {
-		if (iter_entry->index == index) {
-			if (likely(iter_entry->type & type_mask))
-				entry = iter_entry;
-			break;
-		}
-	}
+	slots = rcu_dereference_bh(table->slots);
+	entry = rcu_dereference_bh(slots->entries[(__force u32)index &
+						  slots->mask]);
+	if (likely(entry) && unlikely(entry->index != index ||
+				      !(entry->type & type_mask)))
+		entry = NULL;
 	if (likely(entry)) {
 		entry->peer = wg_peer_get_maybe_zero(entry->peer);
 		if (likely(entry->peer))
@@ -219,3 +282,5 @@ wg_index_hashtable_lookup(struct index_hashtable *table,
 	rcu_read_unlock_bh();
 	return entry;
 }
+
+#include "selftest/peerlookup.c"
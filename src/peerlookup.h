@@ -31,8 +31,8 @@ wg_pubkey_hashtable_lookup(struct pubkey_hashtable *table,
 			   const u8 pubkey[NOISE_PUBLIC_KEY_LEN]);
 
 struct index_hashtable {
-	/* TODO: move to rhashtable */
-	DECLARE_HASHTABLE(hashtable, 13);
+	struct index_slots __rcu *slots;
+	unsigned int count;
 	spinlock_t lock;
 };
 
@@ -43,14 +43,14 @@ enum index_hashtable_type {
 
 struct index_hashtable_entry {
 	struct wg_peer *peer;
-	struct hlist_node index_hash;
 	enum index_hashtable_type type;
 	__le32 index;
 };
 
 struct index_hashtable *wg_index_hashtable_alloc(void);
-__le32 wg_index_hashtable_insert(struct index_hashtable *table,
-				 struct index_hashtable_entry *entry);
+void wg_index_hashtable_free(struct index_hashtable *table);
+bool wg_index_hashtable_insert(struct index_hashtable *table,
+			       struct index_hashtable_entry *entry);
 bool wg_index_hashtable_replace(struct index_hashtable *table,
 				struct index_hashtable_entry *old,
 				struct index_hashtable_entry *new);
@@ -61,4 +61,8 @@ wg_index_hashtable_lookup(struct index_hashtable *table,
 			  const enum index_hashtable_type type_mask,
 			  const __le32 index, struct wg_peer **peer);
 
+#ifdef DEBUG
+bool wg_index_hashtable_selftest(void);
+#endif
+
 #endif /* _WG_PEERLOOKUP_H */
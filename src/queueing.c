@@ -4,6 +4,12 @@
  */
 
 #include "queueing.h"
+#include "device.h"
+#include "messages.h"
+
+#ifndef COMPAT_CANNOT_USE_PAGE_POOL
+#include <net/page_pool.h>
+#endif
 
 struct multicore_worker __percpu *
 wg_packet_percpu_multicore_worker_alloc(work_func_t function, void *ptr)
@@ -22,6 +28,119 @@ wg_packet_percpu_multicore_worker_alloc(work_func_t function, void *ptr)
 	return worker;
 }
 
+void wg_packet_napi_add(struct wg_device *wg, struct rx_napi *rx_napi,
+			int (*poll)(struct napi_struct *, int))
+{
+	rx_napi->steer_csd.func = wg_packet_rx_steer_ipi;
+	rx_napi->steer_csd.info = rx_napi;
+	if (!(wg->features & WGDEVICE_FEATURE_BUSY_POLL))
+		set_bit(NAPI_STATE_NO_BUSY_POLL, &rx_napi->napi.state);
+	netif_napi_add(wg->dev, &rx_napi->napi, poll, NAPI_POLL_WEIGHT);
+	napi_enable(&rx_napi->napi);
+}
+
+void wg_packet_napi_del(struct rx_napi *rx_napi)
+{
+	napi_disable(&rx_napi->napi);
+	/* An IPI that is still in flight would otherwise schedule the napi
+	 * after it's gone. Once disabled, that scheduling is a no-op.
+	 */
+	while (test_bit(0, &rx_napi->steer_pending))
+		cpu_relax();
+	/* It's now safe to remove the napi struct, which must be done here
+	 * from process context.
+	 */
+	netif_napi_del(&rx_napi->napi);
+}
+
+int wg_packet_shared_napi_init(struct wg_device *wg)
+{
+	int cpu;
+
+	wg->shared_rx_napi = alloc_percpu(struct rx_napi);
+	if (!wg->shared_rx_napi)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct rx_napi *rx_napi = per_cpu_ptr(wg->shared_rx_napi, cpu);
+
+		INIT_LIST_HEAD(&rx_napi->peers);
+		spin_lock_init(&rx_napi->lock);
+		wg_packet_napi_add(wg, rx_napi, wg_packet_rx_poll_shared);
+	}
+	return 0;
+}
+
+void wg_packet_shared_napi_free(struct wg_device *wg)
+{
+	int cpu;
+
+	if (!wg->shared_rx_napi)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct rx_napi *rx_napi = per_cpu_ptr(wg->shared_rx_napi, cpu);
+
+		wg_packet_napi_del(rx_napi);
+		WARN_ON(!list_empty(&rx_napi->peers));
+	}
+	/* Busy pollers may still be looking at these by id. */
+	synchronize_net();
+	free_percpu(wg->shared_rx_napi);
+	wg->shared_rx_napi = NULL;
+}
+
+/* Decryption writes plaintext into pages from these, when the ciphertext can't
+ * be decrypted in place without first being copied. Each CPU's decryption
+ * worker allocates only from its own pool, which the page pool API requires,
+ * while freed skbs may recycle pages into it from anywhere.
+ */
+int wg_packet_rx_page_pools_init(struct wg_device *wg)
+{
+#ifndef COMPAT_CANNOT_USE_PAGE_POOL
+	struct page_pool_params params = {
+		.order = 0,
+		.pool_size = MAX_QUEUED_PACKETS / 4,
+		.dma_dir = DMA_NONE
+	};
+	struct page_pool *pool;
+	int cpu;
+
+	wg->rx_page_pools = alloc_percpu(struct page_pool *);
+	if (!wg->rx_page_pools)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		params.nid = cpu_to_node(cpu);
+		pool = page_pool_create(&params);
+		if (IS_ERR(pool)) {
+			wg_packet_rx_page_pools_free(wg);
+			return PTR_ERR(pool);
+		}
+		*per_cpu_ptr(wg->rx_page_pools, cpu) = pool;
+	}
+#endif
+	return 0;
+}
+
+void wg_packet_rx_page_pools_free(struct wg_device *wg)
+{
+#ifndef COMPAT_CANNOT_USE_PAGE_POOL
+	int cpu;
+
+	if (!wg->rx_page_pools)
+		return;
+	/* Pages still attached to skbs are returned to the page allocator
+	 * later on, as they are freed.
+	 */
+	for_each_possible_cpu(cpu) {
+		if (*per_cpu_ptr(wg->rx_page_pools, cpu))
+			page_pool_destroy(*per_cpu_ptr(wg->rx_page_pools, cpu));
+	}
+	free_percpu(wg->rx_page_pools);
+	wg->rx_page_pools = NULL;
+#endif
+}
+
 int wg_packet_queue_init(struct crypt_queue *queue, work_func_t function,
 			 bool multicore, unsigned int len)
 {
@@ -51,3 +170,36 @@ void wg_packet_queue_free(struct crypt_queue *queue, bool multicore)
 	WARN_ON(!__ptr_ring_empty(&queue->ring));
 	ptr_ring_cleanup(&queue->ring, NULL);
 }
+
+int wg_packet_handshake_queues_init(struct wg_device *wg)
+{
+	struct handshake_queue *queue;
+	int cpu;
+
+	wg->handshake_queues = alloc_percpu(struct handshake_queue);
+	if (!wg->handshake_queues)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		queue = per_cpu_ptr(wg->handshake_queues, cpu);
+		skb_queue_head_init(&queue->skbs);
+		INIT_WORK(&queue->work, wg_packet_handshake_receive_worker);
+		queue->wg = wg;
+	}
+	wg->handshake_steal_cpu = 0;
+	memset(&wg->handshake_load, 0, sizeof(wg->handshake_load));
+	return 0;
+}
+
+void wg_packet_handshake_queues_purge(struct wg_device *wg)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		skb_queue_purge(&per_cpu_ptr(wg->handshake_queues, cpu)->skbs);
+}
+
+void wg_packet_handshake_queues_free(struct wg_device *wg)
+{
+	wg_packet_handshake_queues_purge(wg);
+	free_percpu(wg->handshake_queues);
+}
@@ -24,27 +24,46 @@ int wg_packet_queue_init(struct crypt_queue *queue, work_func_t function,
 void wg_packet_queue_free(struct crypt_queue *queue, bool multicore);
 struct multicore_worker __percpu *
 wg_packet_percpu_multicore_worker_alloc(work_func_t function, void *ptr);
+void wg_packet_napi_add(struct wg_device *wg, struct rx_napi *rx_napi,
+			int (*poll)(struct napi_struct *, int));
+void wg_packet_napi_del(struct rx_napi *rx_napi);
+int wg_packet_shared_napi_init(struct wg_device *wg);
+void wg_packet_shared_napi_free(struct wg_device *wg);
+int wg_packet_rx_page_pools_init(struct wg_device *wg);
+void wg_packet_rx_page_pools_free(struct wg_device *wg);
+int wg_packet_handshake_queues_init(struct wg_device *wg);
+void wg_packet_handshake_queues_purge(struct wg_device *wg);
+void wg_packet_handshake_queues_free(struct wg_device *wg);
 
 /* receive.c APIs: */
 void wg_packet_receive(struct wg_device *wg, struct sk_buff *skb);
 void wg_packet_handshake_receive_worker(struct work_struct *work);
-/* NAPI poll function: */
+void wg_packet_rx_napi_schedule(struct wg_peer *peer);
+void wg_packet_rx_steer_ipi(void *info);
+/* NAPI poll functions: */
 int wg_packet_rx_poll(struct napi_struct *napi, int budget);
+int wg_packet_rx_poll_shared(struct napi_struct *napi, int budget);
 /* Workqueue worker: */
 void wg_packet_decrypt_worker(struct work_struct *work);
 
 /* send.c APIs: */
 void wg_packet_send_queued_handshake_initiation(struct wg_peer *peer,
 						bool is_retry);
-void wg_packet_send_handshake_response(struct wg_peer *peer);
+void wg_packet_send_handshake_responses(struct wg_peer *const peers[],
+					unsigned int count);
 void wg_packet_send_handshake_cookie(struct wg_device *wg,
 				     struct sk_buff *initiating_skb,
 				     __le32 sender_index);
 void wg_packet_send_keepalive(struct wg_peer *peer);
+void wg_packet_send_keepalives(struct wg_device *wg, struct wg_peer *peers[],
+			       unsigned int count, struct cpumask *cpus);
 void wg_packet_purge_staged_packets(struct wg_peer *peer);
 void wg_packet_send_staged_packets(struct wg_peer *peer);
 /* Workqueue workers: */
 void wg_packet_handshake_send_worker(struct work_struct *work);
+void wg_packet_initiation_backlog_remove(struct wg_peer *peer);
+void wg_packet_initiation_scheduler_init(struct wg_device *wg);
+void wg_packet_initiation_scheduler_set_rate(struct wg_device *wg, u32 rate);
 void wg_packet_tx_worker(struct work_struct *work);
 void wg_packet_encrypt_worker(struct work_struct *work);
 
@@ -55,11 +74,15 @@ enum packet_state {
 };
 
 struct packet_cb {
-	u64 nonce;
+	union {
+		u64 nonce;
+		u64 queued_at; /* For handshakes, in ktime_get_ns(). */
+	};
 	struct noise_keypair *keypair;
 	atomic_t state;
 	u32 mtu;
 	u8 ds;
+	bool mac1_validated;
 };
 
 #define PACKET_CB(skb) ((struct packet_cb *)((skb)->cb))
@@ -139,9 +162,12 @@ static inline int wg_cpumask_next_online(int *next)
 	return cpu;
 }
 
-static inline int wg_queue_enqueue_per_device_and_peer(
+/* Returns the CPU whose worker is to consume the packet, which the caller must
+ * then wake up, or a negative error.
+ */
+static inline int __wg_queue_enqueue_per_device_and_peer(
 	struct crypt_queue *device_queue, struct crypt_queue *peer_queue,
-	struct sk_buff *skb, struct workqueue_struct *wq, int *next_cpu)
+	struct sk_buff *skb, int *next_cpu)
 {
 	int cpu;
 
@@ -157,6 +183,19 @@ static inline int wg_queue_enqueue_per_device_and_peer(
 	cpu = wg_cpumask_next_online(next_cpu);
 	if (unlikely(ptr_ring_produce_bh(&device_queue->ring, skb)))
 		return -EPIPE;
+	return cpu;
+}
+
+static inline int wg_queue_enqueue_per_device_and_peer(
+	struct crypt_queue *device_queue, struct crypt_queue *peer_queue,
+	struct sk_buff *skb, struct workqueue_struct *wq, int *next_cpu)
+{
+	int cpu = __wg_queue_enqueue_per_device_and_peer(device_queue,
+							 peer_queue, skb,
+							 next_cpu);
+
+	if (unlikely(cpu < 0))
+		return cpu;
 	queue_work_on(cpu, wq, &per_cpu_ptr(device_queue->worker, cpu)->work);
 	return 0;
 }
@@ -186,7 +225,11 @@ static inline void wg_queue_enqueue_per_peer_napi(struct sk_buff *skb,
 	struct wg_peer *peer = wg_peer_get(PACKET_PEER(skb));
 
 	atomic_set_release(&PACKET_CB(skb)->state, state);
-	napi_schedule(&peer->napi);
+	if (likely(!(peer->device->features & (WGDEVICE_FEATURE_SHARED_NAPI |
+					      WGDEVICE_FEATURE_FLOW_STEERING))))
+		napi_schedule(&peer->rx_napi->napi);
+	else
+		wg_packet_rx_napi_schedule(peer);
 	wg_peer_put(peer);
 }
 
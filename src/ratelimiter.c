@@ -17,13 +17,13 @@
 
 #include "ratelimiter.h"
 #include <linux/siphash.h>
+#include <linux/module.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <net/ip.h>
 
 static struct kmem_cache *entry_cache;
 static hsiphash_key_t key;
-static spinlock_t table_lock = __SPIN_LOCK_UNLOCKED("ratelimiter_table_lock");
 static DEFINE_MUTEX(init_lock);
 static u64 init_refcnt; /* Protected by init_lock, hence not atomic. */
 static atomic_t total_entries = ATOMIC_INIT(0);
@@ -35,11 +35,44 @@ static struct hlist_head *table_v4;
 static struct hlist_head *table_v6;
 #endif
 
+static bool ratelimiter_sketch;
+module_param(ratelimiter_sketch, bool, 0444);
+MODULE_PARM_DESC(ratelimiter_sketch, "Ratelimit handshakes with a fixed-size sketch instead of a table of sources");
+
+/* In sketch mode, rather than one token bucket per source, there are a few
+ * rows of buckets, each source hashes to one bucket in every row, and it is
+ * limited by the least loaded of them, as in a count-min sketch. Each bucket
+ * is a single word holding the time at which it will have a full burst again,
+ * as in GCRA, so that it can be updated without locks and needs no gc once it
+ * goes idle. Collisions can only ever limit a source early, never late, and
+ * since memory is fixed, a flood of spoofed sources makes such collisions
+ * gradually likelier instead of locking out every new source once the table
+ * is full.
+ */
+enum { SKETCH_ROWS = 4 };
+static bool use_sketch; /* Latched from ratelimiter_sketch by the first init. */
+static siphash_key_t sketch_key;
+static atomic64_t *sketch;
+static unsigned int sketch_width;
+
+/* Each shard owns the hash buckets whose index is congruent to it, and keeps
+ * its entries on a list ordered by the time they were last queued for expiry.
+ * Since every entry has the same one second lifetime, that list is already in
+ * expiry order, so it acts as a single-slot timer wheel: the gc only ever looks
+ * at the head of the list, and stops at the first entry that is not yet due.
+ */
+enum { RATELIMITER_SHARDS = 64 };
+static struct ratelimiter_shard {
+	spinlock_t lock;
+	struct list_head entries;
+} ____cacheline_aligned_in_smp shards[RATELIMITER_SHARDS];
+
 struct ratelimiter_entry {
-	u64 last_time_ns, tokens, ip;
+	u64 last_time_ns, tokens, ip, queued_ns;
 	void *net;
 	spinlock_t lock;
 	struct hlist_node hash;
+	struct list_head expiry;
 	struct rcu_head rcu;
 };
 
@@ -63,29 +96,45 @@ static void entry_uninit(struct ratelimiter_entry *entry)
 	call_rcu(&entry->rcu, entry_free);
 }
 
+static void gc_shard(struct ratelimiter_shard *shard, bool all)
+{
+	struct ratelimiter_entry *entry, *temp;
+	u64 now;
+
+	spin_lock(&shard->lock);
+	now = ktime_get_coarse_boottime_ns();
+	list_for_each_entry_safe(entry, temp, &shard->entries, expiry) {
+		if (likely(!all) && now - entry->queued_ns <= NSEC_PER_SEC)
+			break;
+		/* Refreshing an entry in wg_ratelimiter_allow() does not touch
+		 * its position here, so that the hot path never takes the shard
+		 * lock. Instead, entries that have seen traffic since they were
+		 * queued are requeued at the tail when they reach the head.
+		 */
+		if (unlikely(all) || now - entry->last_time_ns > NSEC_PER_SEC) {
+			list_del(&entry->expiry);
+			entry_uninit(entry);
+		} else {
+			entry->queued_ns = now;
+			list_move_tail(&entry->expiry, &shard->entries);
+		}
+	}
+	spin_unlock(&shard->lock);
+}
+
 /* Calling this function with a NULL work uninits all entries. */
 static void wg_ratelimiter_gc_entries(struct work_struct *work)
 {
-	const u64 now = ktime_get_coarse_boottime_ns();
-	struct ratelimiter_entry *entry;
-	struct hlist_node *temp;
 	unsigned int i;
 
-	for (i = 0; i < table_size; ++i) {
-		spin_lock(&table_lock);
-		hlist_for_each_entry_safe(entry, temp, &table_v4[i], hash) {
-			if (unlikely(!work) ||
-			    now - entry->last_time_ns > NSEC_PER_SEC)
-				entry_uninit(entry);
-		}
-#if IS_ENABLED(CONFIG_IPV6)
-		hlist_for_each_entry_safe(entry, temp, &table_v6[i], hash) {
-			if (unlikely(!work) ||
-			    now - entry->last_time_ns > NSEC_PER_SEC)
-				entry_uninit(entry);
-		}
-#endif
-		spin_unlock(&table_lock);
+	if (use_sketch) {
+		if (unlikely(!work))
+			memset(sketch, 0, SKETCH_ROWS * sketch_width *
+					  sizeof(*sketch));
+		return;
+	}
+	for (i = 0; i < RATELIMITER_SHARDS; ++i) {
+		gc_shard(&shards[i], unlikely(!work));
 		if (likely(work))
 			cond_resched();
 	}
@@ -93,6 +142,47 @@ static void wg_ratelimiter_gc_entries(struct work_struct *work)
 		queue_delayed_work(system_power_efficient_wq, &gc_work, HZ);
 }
 
+static bool sketch_allow(u32 net_word, __be16 protocol, u64 ip)
+{
+	const u64 hash = siphash_4u32(net_word, (__force u16)protocol, ip >> 32,
+				      ip, &sketch_key);
+	const u32 h1 = hash, h2 = (hash >> 32) | 1;
+	atomic64_t *buckets[SKETCH_ROWS];
+	u64 now, tat = U64_MAX;
+	unsigned int i;
+
+	for (i = 0; i < SKETCH_ROWS; ++i) {
+		buckets[i] = &sketch[i * sketch_width +
+				     ((h1 + i * h2) & (sketch_width - 1))];
+		tat = min_t(u64, tat, atomic64_read(buckets[i]));
+	}
+	now = ktime_get_coarse_boottime_ns();
+	tat = max(tat, now);
+	/* This is the same limit as the table's, with a burst of
+	 * PACKETS_BURSTABLE, expressed as a theoretical arrival time.
+	 */
+	if (tat - now > TOKEN_MAX - PACKET_COST)
+		return false;
+	tat += PACKET_COST;
+
+	/* Conservative update: only raise buckets that are behind, so that
+	 * heavy sources inflate their colliders as little as possible.
+	 * Concurrent callers may both pass the check above before either
+	 * raises the buckets, which lets an extra packet through at worst.
+	 */
+	for (i = 0; i < SKETCH_ROWS; ++i) {
+		u64 old = atomic64_read(buckets[i]), prev;
+
+		while (old < tat) {
+			prev = atomic64_cmpxchg(buckets[i], old, tat);
+			if (prev == old)
+				break;
+			old = prev;
+		}
+	}
+	return true;
+}
+
 bool wg_ratelimiter_allow(struct sk_buff *skb, struct net *net)
 {
 	/* We only take the bottom half of the net pointer, so that we can hash
@@ -100,25 +190,33 @@ bool wg_ratelimiter_allow(struct sk_buff *skb, struct net *net)
 	 * u32, and we don't incur an extra round.
 	 */
 	const u32 net_word = (unsigned long)net;
+	struct ratelimiter_shard *shard;
 	struct ratelimiter_entry *entry;
 	struct hlist_head *bucket;
+	unsigned int index;
 	u64 ip;
 
 	if (skb->protocol == htons(ETH_P_IP)) {
 		ip = (u64 __force)ip_hdr(skb)->saddr;
-		bucket = &table_v4[hsiphash_2u32(net_word, ip, &key) &
-				   (table_size - 1)];
+		if (use_sketch)
+			return sketch_allow(net_word, skb->protocol, ip);
+		index = hsiphash_2u32(net_word, ip, &key) & (table_size - 1);
+		bucket = &table_v4[index];
 	}
 #if IS_ENABLED(CONFIG_IPV6)
 	else if (skb->protocol == htons(ETH_P_IPV6)) {
 		/* Only use 64 bits, so as to ratelimit the whole /64. */
 		memcpy(&ip, &ipv6_hdr(skb)->saddr, sizeof(ip));
-		bucket = &table_v6[hsiphash_3u32(net_word, ip >> 32, ip, &key) &
-				   (table_size - 1)];
+		if (use_sketch)
+			return sketch_allow(net_word, skb->protocol, ip);
+		index = hsiphash_3u32(net_word, ip >> 32, ip, &key) &
+			(table_size - 1);
+		bucket = &table_v6[index];
 	}
 #endif
 	else
 		return false;
+	shard = &shards[index & (RATELIMITER_SHARDS - 1)];
 	rcu_read_lock();
 	hlist_for_each_entry_rcu(entry, bucket, hash) {
 		if (entry->net == net && entry->ip == ip) {
@@ -157,9 +255,12 @@ bool wg_ratelimiter_allow(struct sk_buff *skb, struct net *net)
 	spin_lock_init(&entry->lock);
 	entry->last_time_ns = ktime_get_coarse_boottime_ns();
 	entry->tokens = TOKEN_MAX - PACKET_COST;
-	spin_lock(&table_lock);
+	spin_lock(&shard->lock);
+	/* Taken under the shard lock, so that the expiry list stays sorted. */
+	entry->queued_ns = ktime_get_coarse_boottime_ns();
+	list_add_tail(&entry->expiry, &shard->entries);
 	hlist_add_head_rcu(&entry->hash, bucket);
-	spin_unlock(&table_lock);
+	spin_unlock(&shard->lock);
 	return true;
 
 err_oom:
@@ -169,13 +270,16 @@ err_oom:
 
 int wg_ratelimiter_init(void)
 {
+	unsigned int i;
+
 	mutex_lock(&init_lock);
 	if (++init_refcnt != 1)
 		goto out;
 
-	entry_cache = KMEM_CACHE(ratelimiter_entry, 0);
-	if (!entry_cache)
-		goto err;
+	for (i = 0; i < RATELIMITER_SHARDS; ++i) {
+		spin_lock_init(&shards[i].lock);
+		INIT_LIST_HEAD(&shards[i].entries);
+	}
 
 	/* xt_hashlimit.c uses a slightly different algorithm for ratelimiting,
 	 * but what it shares in common is that it uses a massive hashtable. So,
@@ -188,6 +292,24 @@ int wg_ratelimiter_init(void)
 			(1U << 14) / sizeof(struct hlist_head)));
 	max_entries = table_size * 8;
 
+	use_sketch = ratelimiter_sketch;
+	if (use_sketch) {
+		/* Half a bucket per row for each entry the table could hold,
+		 * which is still far less memory than the full table.
+		 */
+		sketch_width = max_entries / 2;
+		sketch = kvzalloc(SKETCH_ROWS * sketch_width * sizeof(*sketch),
+				  GFP_KERNEL);
+		if (unlikely(!sketch))
+			goto err;
+		get_random_bytes(&sketch_key, sizeof(sketch_key));
+		goto out;
+	}
+
+	entry_cache = KMEM_CACHE(ratelimiter_entry, 0);
+	if (!entry_cache)
+		goto err;
+
 	table_v4 = kvzalloc(table_size * sizeof(*table_v4), GFP_KERNEL);
 	if (unlikely(!table_v4))
 		goto err_kmemcache;
@@ -220,6 +342,11 @@ void wg_ratelimiter_uninit(void)
 	if (!init_refcnt || --init_refcnt)
 		goto out;
 
+	if (use_sketch) {
+		kvfree(sketch);
+		goto out;
+	}
+
 	cancel_delayed_work_sync(&gc_work);
 	wg_ratelimiter_gc_entries(NULL);
 	rcu_barrier();
@@ -17,6 +17,10 @@
 #include <linux/udp.h>
 #include <net/ip_tunnels.h>
 
+#ifndef COMPAT_CANNOT_USE_PAGE_POOL
+#include <net/page_pool.h>
+#endif
+
 /* Must be called with bh disabled. */
 static void update_rx_stats(struct wg_peer *peer, size_t len)
 {
@@ -26,9 +30,9 @@ static void update_rx_stats(struct wg_peer *peer, size_t len)
 	u64_stats_update_begin(&tstats->syncp);
 	++tstats->rx_packets;
 	tstats->rx_bytes += len;
-	peer->rx_bytes += len;
 	u64_stats_update_end(&tstats->syncp);
 	put_cpu_ptr(tstats);
+	wg_peer_stats_rx(peer, len);
 }
 
 #define SKB_TYPE_LE32(skb) (((struct message_header *)(skb)->data)->type)
@@ -97,34 +101,101 @@ static int prepare_skb_header(struct sk_buff *skb, struct wg_device *wg)
 	return 0;
 }
 
-static void wg_receive_handshake_packet(struct wg_device *wg,
-					struct sk_buff *skb)
+/* Each CPU's queue gets an even share of the device's budget, but no less than
+ * MIN_QUEUED_INCOMING_HANDSHAKES_PER_CPU.
+ */
+static unsigned int handshake_queue_limit(void)
+{
+	return max_t(unsigned int,
+		     MAX_QUEUED_INCOMING_HANDSHAKES / num_online_cpus(),
+		     MIN_QUEUED_INCOMING_HANDSHAKES_PER_CPU);
+}
+
+static void ewma_add(u64 *avg, u64 sample)
+{
+	u64 old = READ_ONCE(*avg);
+
+	WRITE_ONCE(*avg, old - (old >> 3) + (sample >> 3));
+}
+
+/* Halves the average wait once for every interval since it was last decayed,
+ * which between floods brings it back under the target well before the average
+ * of new samples alone would.
+ */
+static void sojourn_decay(struct handshake_load *load, u64 now)
+{
+	const u64 interval = HANDSHAKE_LOAD_INTERVAL_MSECS * NSEC_PER_MSEC;
+	u64 last = READ_ONCE(load->sojourn_decayed), intervals;
+
+	if ((s64)(now - last) < (s64)interval)
+		return;
+	intervals = div64_u64(now - last, interval);
+	WRITE_ONCE(load->sojourn_avg, intervals >= 64 ? 0 :
+				      READ_ONCE(load->sojourn_avg) >> intervals);
+	WRITE_ONCE(load->sojourn_decayed, last + intervals * interval);
+}
+
+/* Accounts for skb having waited in queue until now, and returns whether the
+ * device is under load.
+ */
+static bool handshake_load_update(struct wg_device *wg,
+				  struct handshake_queue *queue,
+				  struct sk_buff *skb, u64 now)
+{
+	const u64 target = HANDSHAKE_LOAD_TARGET_MSECS * NSEC_PER_MSEC;
+	struct handshake_load *load = &wg->handshake_load;
+	s64 sojourn = now - PACKET_CB(skb)->queued_at;
+	u64 backlog;
+
+	sojourn_decay(load, now);
+	ewma_add(&load->sojourn_avg, max_t(s64, sojourn, 0));
+	backlog = skb_queue_len(&queue->skbs) * READ_ONCE(load->cost_avg);
+	if (READ_ONCE(load->sojourn_avg) > target || backlog > target) {
+		if (!wg_handshake_under_load(load, now)) {
+			local_bh_disable();
+			wg_device_stat_add(wg,
+				WGDEVICE_STAT_A_HANDSHAKE_LOAD_TRANSITIONS, 1);
+			local_bh_enable();
+		}
+		WRITE_ONCE(load->last_overloaded, now);
+		return true;
+	}
+	return wg_handshake_under_load(load, now);
+}
+
+/* Returns the ephemeral of an initiation that is going to be consumed, so that
+ * its DH can be computed along with the rest of its batch, or NULL.
+ */
+static const u8 *handshake_ephemeral(struct sk_buff *skb, bool under_load,
+				     enum cookie_mac_state mac_state)
+{
+	if (mac_state != (under_load ? VALID_MAC_WITH_COOKIE :
+				       VALID_MAC_BUT_NO_COOKIE) ||
+	    SKB_TYPE_LE32(skb) != cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION))
+		return NULL;
+	return ((struct message_handshake_initiation *)skb->data)
+		->unencrypted_ephemeral;
+}
+
+/* Returns the peer of a consumed initiation, with the reference still held,
+ * for the caller to respond to along with the rest of the batch.
+ */
+static struct wg_peer *
+wg_receive_handshake_packet(struct wg_device *wg, struct sk_buff *skb,
+			    bool under_load, enum cookie_mac_state mac_state,
+			    const struct noise_consumption_dh *dh)
 {
-	enum cookie_mac_state mac_state;
 	struct wg_peer *peer = NULL;
-	/* This is global, so that our load calculation applies to the whole
-	 * system. We don't care about races with it at all.
-	 */
-	static u64 last_under_load;
 	bool packet_needs_cookie;
-	bool under_load;
 
 	if (SKB_TYPE_LE32(skb) == cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE)) {
 		net_dbg_skb_ratelimited("%s: Receiving cookie response from %pISpfsc\n",
 					wg->dev->name, skb);
 		wg_cookie_message_consume(
 			(struct message_handshake_cookie *)skb->data, wg);
-		return;
+		return NULL;
 	}
 
-	under_load = skb_queue_len(&wg->incoming_handshakes) >=
-		     MAX_QUEUED_INCOMING_HANDSHAKES / 8;
-	if (under_load)
-		last_under_load = ktime_get_coarse_boottime_ns();
-	else if (last_under_load)
-		under_load = !wg_birthdate_has_expired(last_under_load, 1);
-	mac_state = wg_cookie_validate_packet(&wg->cookie_checker, skb,
-					      under_load);
 	if ((under_load && mac_state == VALID_MAC_WITH_COOKIE) ||
 	    (!under_load && mac_state == VALID_MAC_BUT_NO_COOKIE)) {
 		packet_needs_cookie = false;
@@ -133,7 +204,13 @@ static void wg_receive_handshake_packet(struct wg_device *wg,
 	} else {
 		net_dbg_skb_ratelimited("%s: Invalid MAC of handshake, dropping packet from %pISpfsc\n",
 					wg->dev->name, skb);
-		return;
+		if (mac_state == INVALID_MAC) {
+			local_bh_disable();
+			wg_device_stat_add(
+				wg, WGDEVICE_STAT_A_HANDSHAKES_BAD_MAC, 1);
+			local_bh_enable();
+		}
+		return NULL;
 	}
 
 	switch (SKB_TYPE_LE32(skb)) {
@@ -144,19 +221,18 @@ static void wg_receive_handshake_packet(struct wg_device *wg,
 		if (packet_needs_cookie) {
 			wg_packet_send_handshake_cookie(wg, skb,
 							message->sender_index);
-			return;
+			return NULL;
 		}
-		peer = wg_noise_handshake_consume_initiation(message, wg);
+		peer = wg_noise_handshake_consume_initiation(message, wg, dh);
 		if (unlikely(!peer)) {
 			net_dbg_skb_ratelimited("%s: Invalid handshake initiation from %pISpfsc\n",
 						wg->dev->name, skb);
-			return;
+			return NULL;
 		}
 		wg_socket_set_peer_endpoint_from_skb(peer, skb);
 		net_dbg_ratelimited("%s: Receiving handshake initiation from peer %llu (%pISpfsc)\n",
 				    wg->dev->name, peer->internal_id,
 				    &peer->endpoint.addr);
-		wg_packet_send_handshake_response(peer);
 		break;
 	}
 	case cpu_to_le32(MESSAGE_HANDSHAKE_RESPONSE): {
@@ -166,13 +242,13 @@ static void wg_receive_handshake_packet(struct wg_device *wg,
 		if (packet_needs_cookie) {
 			wg_packet_send_handshake_cookie(wg, skb,
 							message->sender_index);
-			return;
+			return NULL;
 		}
 		peer = wg_noise_handshake_consume_response(message, wg);
 		if (unlikely(!peer)) {
 			net_dbg_skb_ratelimited("%s: Invalid handshake response from %pISpfsc\n",
 						wg->dev->name, skb);
-			return;
+			return NULL;
 		}
 		wg_socket_set_peer_endpoint_from_skb(peer, skb);
 		net_dbg_ratelimited("%s: Receiving handshake response from peer %llu (%pISpfsc)\n",
@@ -196,7 +272,7 @@ static void wg_receive_handshake_packet(struct wg_device *wg,
 
 	if (unlikely(!peer)) {
 		WARN(1, "Somehow a wrong type of packet wound up in the handshake queue!\n");
-		return;
+		return NULL;
 	}
 
 	local_bh_disable();
@@ -205,19 +281,119 @@ static void wg_receive_handshake_packet(struct wg_device *wg,
 
 	wg_timers_any_authenticated_packet_received(peer);
 	wg_timers_any_authenticated_packet_traversal(peer);
+	if (SKB_TYPE_LE32(skb) == cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION))
+		return peer;
 	wg_peer_put(peer);
+	return NULL;
 }
 
-void wg_packet_handshake_receive_worker(struct work_struct *work)
+static void handshake_process(struct wg_device *wg,
+			      struct handshake_queue *queue,
+			      struct sk_buff *skbs[], unsigned int count)
+{
+	const struct noise_consumption_dh *dh_of[COOKIE_BATCH_MAX];
+	struct noise_consumption_dh dh[COOKIE_BATCH_MAX];
+	enum cookie_mac_state mac_states[COOKIE_BATCH_MAX];
+	const u8 *ephemerals[COOKIE_BATCH_MAX];
+	struct wg_peer *responders[COOKIE_BATCH_MAX];
+	bool under_load[COOKIE_BATCH_MAX];
+	u64 start = ktime_get_ns(), cost;
+	unsigned int i, n;
+
+	for (i = 0; i < count; ++i)
+		under_load[i] = handshake_load_update(wg, queue, skbs[i],
+						      start);
+	wg_cookie_validate_packets(&wg->cookie_checker, skbs, under_load,
+				   mac_states, count);
+
+	for (i = 0, n = 0; i < count; ++i) {
+		ephemerals[n] = handshake_ephemeral(skbs[i], under_load[i],
+						    mac_states[i]);
+		dh_of[i] = ephemerals[n] ? &dh[n++] : NULL;
+	}
+	if (n)
+		wg_noise_handshake_precompute_consumption(wg, ephemerals, dh,
+							  n);
+
+	for (i = 0, n = 0; i < count; ++i) {
+		responders[n] = wg_receive_handshake_packet(
+			wg, skbs[i], under_load[i], mac_states[i], dh_of[i]);
+		if (responders[n])
+			++n;
+		dev_kfree_skb(skbs[i]);
+		cond_resched();
+	}
+	memzero_explicit(dh, sizeof(dh));
+	wg_packet_send_handshake_responses(responders, n);
+	for (i = 0; i < n; ++i)
+		wg_peer_put(responders[i]);
+
+	/* The MACs and the scalar multiplications were computed together, so
+	 * each packet is charged an even share of the whole batch.
+	 */
+	cost = div_u64(ktime_get_ns() - start, count);
+	for (i = 0; i < count; ++i)
+		ewma_add(&wg->handshake_load.cost_avg, cost);
+}
+
+/* Handshakes are taken off the queue in batches, so that their MACs can be
+ * checked side by side.
+ */
+static unsigned int handshake_dequeue(struct handshake_queue *queue,
+				      struct sk_buff *skbs[])
 {
-	struct wg_device *wg = container_of(work, struct multicore_worker,
-					    work)->ptr;
 	struct sk_buff *skb;
+	unsigned long flags;
+	unsigned int count = 0;
+
+	spin_lock_irqsave(&queue->skbs.lock, flags);
+	while (count < COOKIE_BATCH_MAX &&
+	       (skb = __skb_dequeue(&queue->skbs)) != NULL)
+		skbs[count++] = skb;
+	spin_unlock_irqrestore(&queue->skbs.lock, flags);
+	return count;
+}
 
-	while ((skb = skb_dequeue(&wg->incoming_handshakes)) != NULL) {
-		wg_receive_handshake_packet(wg, skb);
-		dev_kfree_skb(skb);
-		cond_resched();
+void wg_packet_handshake_receive_worker(struct work_struct *work)
+{
+	struct handshake_queue *queue = container_of(work,
+						     struct handshake_queue,
+						     work);
+	struct sk_buff *skbs[COOKIE_BATCH_MAX];
+	struct handshake_queue *victim;
+	struct wg_device *wg = queue->wg;
+	unsigned int stolen = 0, count;
+	int cpu;
+
+	while ((count = handshake_dequeue(queue, skbs)) != 0)
+		handshake_process(wg, queue, skbs, count);
+
+	/* With our own queue empty, we help out those CPUs that have fallen
+	 * behind, such as the one receiving a flood on a single flow. But only
+	 * for a little while at a time, after which we requeue ourselves, so
+	 * that neither our own queue nor the other work on this CPU has to wait
+	 * for the flood to end.
+	 */
+	for_each_online_cpu(cpu) {
+		victim = per_cpu_ptr(wg->handshake_queues, cpu);
+		while (victim != queue &&
+		       stolen < HANDSHAKE_QUEUE_STEAL_THRESHOLD &&
+		       skb_queue_len(&victim->skbs) >=
+		       HANDSHAKE_QUEUE_STEAL_THRESHOLD &&
+		       (count = handshake_dequeue(victim, skbs)) != 0) {
+			handshake_process(wg, victim, skbs, count);
+			stolen += count;
+		}
+		if (stolen >= HANDSHAKE_QUEUE_STEAL_THRESHOLD) {
+			queue_work(wg->handshake_receive_wq, &queue->work);
+			break;
+		}
+	}
+	if (stolen) {
+		local_bh_disable();
+		wg_device_stat_add(wg, WGDEVICE_STAT_A_HANDSHAKES_STOLEN,
+				   stolen);
+		local_bh_enable();
 	}
 }
 
@@ -244,10 +420,114 @@ static void keep_key_fresh(struct wg_peer *peer)
 	}
 }
 
+static struct page *rx_page_alloc(struct wg_device *wg)
+{
+#ifndef COMPAT_CANNOT_USE_PAGE_POOL
+	struct page *page;
+
+	/* Only this CPU's worker allocates from this CPU's pool. */
+	local_bh_disable();
+	page = page_pool_dev_alloc_pages(*this_cpu_ptr(wg->rx_page_pools));
+	local_bh_enable();
+	return page;
+#else
+	return alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+#endif
+}
+
+/* When skb is cloned or paged, skb_cow_data would first copy all of its data
+ * to a private linear buffer, just so that we can then decrypt it in place.
+ * Instead, we decrypt it from wherever it is directly into a fresh page,
+ * attached to a new skb that carries a copy of the outer headers, which we
+ * then morph skb into, so that it keeps its place in the peer's queue.
+ */
+static bool decrypt_packet_out_of_place(struct sk_buff *skb,
+					struct noise_symmetric_key *key,
+					simd_context_t *simd_context,
+					bool *fallback)
+{
+	struct wg_device *wg = PACKET_PEER(skb)->device;
+	struct scatterlist sg[MAX_SKB_FRAGS + 2];
+	unsigned int header_len, len, plaintext_len;
+	struct sk_buff *nskb;
+	struct page *page;
+
+	*fallback = true;
+	header_len = skb->data - skb_network_header(skb) +
+		     sizeof(struct message_data);
+	len = skb->len - sizeof(struct message_data);
+	plaintext_len = len - noise_encrypted_len(0);
+	if (unlikely(skb_has_frag_list(skb) ||
+		     skb_shinfo(skb)->nr_frags + 1 > ARRAY_SIZE(sg) ||
+		     !plaintext_len || plaintext_len > PAGE_SIZE))
+		return false;
+
+	nskb = alloc_skb(header_len + sizeof(struct ipv6hdr),
+			 GFP_ATOMIC | __GFP_NOWARN);
+	if (unlikely(!nskb))
+		return false;
+	page = rx_page_alloc(wg);
+	if (unlikely(!page)) {
+		kfree_skb(nskb);
+		return false;
+	}
+	*fallback = false;
+
+	/* The outer headers are kept, so that later we can extract the
+	 * original endpoint, and they're known to be in the linear area,
+	 * because of prepare_skb_header.
+	 */
+	skb_put_data(nskb, skb_network_header(skb), header_len);
+	skb_reset_network_header(nskb);
+	skb_set_transport_header(nskb, skb_transport_header(skb) -
+				       skb_network_header(skb));
+	skb_add_rx_frag(nskb, 0, page, 0, plaintext_len, PAGE_SIZE);
+#ifndef COMPAT_CANNOT_USE_PAGE_POOL
+	skb_mark_for_recycle(nskb);
+#endif
+
+	sg_init_table(sg, ARRAY_SIZE(sg));
+	if (skb_to_sgvec(skb, sg, sizeof(struct message_data), len) <= 0)
+		goto err;
+
+	if (!chacha20poly1305_decrypt_sg(page_address(page), sg, len, NULL, 0,
+					 PACKET_CB(skb)->nonce, key->key,
+					 simd_context))
+		goto err;
+
+	/* The inner IP header is examined and possibly modified later, so it
+	 * needs to be in the linear area, after the outer headers.
+	 */
+	__skb_pull(nskb, header_len);
+	if (unlikely(!pskb_may_pull(nskb, min_t(unsigned int, plaintext_len,
+						 sizeof(struct ipv6hdr)))))
+		goto err;
+	memcpy(nskb->cb, skb->cb, sizeof(nskb->cb));
+	nskb->protocol = skb->protocol;
+	nskb->skb_iif = skb->skb_iif;
+	nskb->dev = skb->dev;
+
+	skb_morph(skb, nskb);
+#ifndef COMPAT_CANNOT_USE_PAGE_POOL
+	skb_mark_for_recycle(skb);
+#endif
+	consume_skb(nskb);
+
+	local_bh_disable();
+	wg_device_stat_add(wg, WGDEVICE_STAT_A_RX_COPIES_AVOIDED, 1);
+	local_bh_enable();
+	return true;
+
+err:
+	kfree_skb(nskb);
+	return false;
+}
+
 static bool decrypt_packet(struct sk_buff *skb, struct noise_symmetric_key *key,
 			   simd_context_t *simd_context)
 {
 	struct scatterlist sg[MAX_SKB_FRAGS + 8];
+	enum wgdevice_stat_attribute stat;
 	struct sk_buff *trailer;
 	unsigned int offset;
 	int num_frags;
@@ -265,6 +545,32 @@ static bool decrypt_packet(struct sk_buff *skb, struct noise_symmetric_key *key,
 	PACKET_CB(skb)->nonce =
 		le64_to_cpu(((struct message_data *)skb->data)->counter);
 
+	if (skb_cloned(skb) || skb_is_nonlinear(skb)) {
+		bool fallback;
+		bool ret = decrypt_packet_out_of_place(skb, key, simd_context,
+						       &fallback);
+
+		if (ret || !fallback)
+			return ret;
+	}
+
+	/* The common case of a single private buffer needs neither
+	 * skb_cow_data nor a scatterlist.
+	 */
+	if (!skb_cloned(skb) && !skb_is_nonlinear(skb)) {
+		offset = sizeof(struct message_data);
+		if (!chacha20poly1305_decrypt_simd(skb->data + offset,
+						   skb->data + offset,
+						   skb->len - offset, NULL, 0,
+						   PACKET_CB(skb)->nonce,
+						   key->key, simd_context))
+			return false;
+		skb_pull(skb, offset);
+		__skb_trim(skb, skb->len - noise_encrypted_len(0));
+		stat = WGDEVICE_STAT_A_RX_LINEAR;
+		goto out;
+	}
+
 	/* We ensure that the network header is part of the packet before we
 	 * call skb_cow_data, so that there's no chance that data is removed
 	 * from the skb, so that later we can extract the original endpoint.
@@ -293,7 +599,12 @@ static bool decrypt_packet(struct sk_buff *skb, struct noise_symmetric_key *key,
 	if (pskb_trim(skb, skb->len - noise_encrypted_len(0)))
 		return false;
 	skb_pull(skb, offset);
+	stat = WGDEVICE_STAT_A_RX_SCATTERGATHER;
 
+out:
+	local_bh_disable();
+	wg_device_stat_add(PACKET_PEER(skb)->device, stat, 1);
+	local_bh_enable();
 	return true;
 }
 
@@ -409,7 +720,7 @@ static void wg_packet_consume_data_done(struct wg_peer *peer,
 		goto dishonest_packet_size;
 	len_before_trim = skb->len;
 	if (unlikely(pskb_trim(skb, len)))
-		goto packet_processed;
+		goto packet_dropped;
 
 	routed_peer = wg_allowedips_lookup_src(&peer->device->peer_allowedips,
 					       skb);
@@ -418,8 +729,26 @@ static void wg_packet_consume_data_done(struct wg_peer *peer,
 	if (unlikely(routed_peer != peer))
 		goto dishonest_packet_peer;
 
-	if (unlikely(napi_gro_receive(&peer->napi, skb) == GRO_DROP)) {
+#ifndef COMPAT_CANNOT_USE_RPS_SOCK_FLOW_TABLE
+	/* This lets the next packets from this peer be delivered where the
+	 * application reading this one runs. A napi can only be polled on one
+	 * CPU at a time, so this steers the peer's context as a whole, after
+	 * whichever inner flow it received last, rather than each flow on its
+	 * own. The hash is of the decrypted packet and stays with the skb, so
+	 * the stack doesn't compute it again, and without an RFS table to look
+	 * it up in, it isn't computed at all.
+	 */
+	if ((peer->device->features & WGDEVICE_FEATURE_FLOW_STEERING) &&
+	    rcu_access_pointer(rps_sock_flow_table))
+		WRITE_ONCE(peer->rx_flow_hash, skb_get_hash(skb));
+#endif
+
+	/* This lets sockets that read this packet find our napi to busy poll. */
+	skb_mark_napi_id(skb, &peer->rx_napi->napi);
+
+	if (unlikely(napi_gro_receive(&peer->rx_napi->napi, skb) == GRO_DROP)) {
 		++dev->stats.rx_dropped;
+		wg_peer_stats_rx_dropped(peer, 1);
 		net_dbg_ratelimited("%s: Failed to give packet to userspace from peer %llu (%pISpfsc)\n",
 				    dev->name, peer->internal_id,
 				    &peer->endpoint.addr);
@@ -434,26 +763,26 @@ dishonest_packet_peer:
 				&peer->endpoint.addr);
 	++dev->stats.rx_errors;
 	++dev->stats.rx_frame_errors;
-	goto packet_processed;
+	goto packet_dropped;
 dishonest_packet_type:
 	net_dbg_ratelimited("%s: Packet is neither ipv4 nor ipv6 from peer %llu (%pISpfsc)\n",
 			    dev->name, peer->internal_id, &peer->endpoint.addr);
 	++dev->stats.rx_errors;
 	++dev->stats.rx_frame_errors;
-	goto packet_processed;
+	goto packet_dropped;
 dishonest_packet_size:
 	net_dbg_ratelimited("%s: Packet has incorrect size from peer %llu (%pISpfsc)\n",
 			    dev->name, peer->internal_id, &peer->endpoint.addr);
 	++dev->stats.rx_errors;
 	++dev->stats.rx_length_errors;
-	goto packet_processed;
+packet_dropped:
+	wg_peer_stats_rx_dropped(peer, 1);
 packet_processed:
 	dev_kfree_skb(skb);
 }
 
-int wg_packet_rx_poll(struct napi_struct *napi, int budget)
+static int rx_poll_peer(struct wg_peer *peer, int budget)
 {
-	struct wg_peer *peer = container_of(napi, struct wg_peer, napi);
 	struct crypt_queue *queue = &peer->rx_queue;
 	struct noise_keypair *keypair;
 	struct endpoint endpoint;
@@ -462,9 +791,6 @@ int wg_packet_rx_poll(struct napi_struct *napi, int budget)
 	int work_done = 0;
 	bool free;
 
-	if (unlikely(budget <= 0))
-		return 0;
-
 	while ((skb = __ptr_ring_peek(&queue->ring)) != NULL &&
 	       (state = atomic_read_acquire(&PACKET_CB(skb)->state)) !=
 		       PACKET_STATE_UNCRYPTED) {
@@ -493,15 +819,190 @@ int wg_packet_rx_poll(struct napi_struct *napi, int budget)
 		free = false;
 
 next:
+		if (unlikely(free)) {
+			wg_peer_stats_rx_dropped(peer, 1);
+			dev_kfree_skb(skb);
+		}
 		wg_noise_keypair_put(keypair, false);
 		wg_peer_put(peer);
-		if (unlikely(free))
-			dev_kfree_skb(skb);
 
 		if (++work_done >= budget)
 			break;
 	}
 
+	return work_done;
+}
+
+int wg_packet_rx_poll(struct napi_struct *napi, int budget)
+{
+	struct wg_peer *peer = container_of(napi, struct rx_napi, napi)->peer;
+	int work_done;
+
+	if (unlikely(budget <= 0))
+		return 0;
+
+	work_done = rx_poll_peer(peer, budget);
+
+	if (work_done < budget)
+		napi_complete_done(napi, work_done);
+
+	return work_done;
+}
+
+/* This is how many packets a peer may hand to the stack before the next peer
+ * sharing the same NAPI context gets its turn.
+ */
+enum { SHARED_NAPI_PEER_QUOTA = NAPI_POLL_WEIGHT / 4 };
+
+static bool rx_queue_ready(struct crypt_queue *queue)
+{
+	struct sk_buff *skb = __ptr_ring_peek(&queue->ring);
+
+	return skb && atomic_read_acquire(&PACKET_CB(skb)->state) !=
+			      PACKET_STATE_UNCRYPTED;
+}
+
+void wg_packet_rx_steer_ipi(void *info)
+{
+	struct rx_napi *rx_napi = info;
+
+	/* This must be cleared before scheduling, so that a packet that
+	 * becomes ready after the napi has been polled here either sees it
+	 * cleared and sends another IPI, or is picked up by this one.
+	 */
+	clear_bit(0, &rx_napi->steer_pending);
+	smp_mb__after_atomic();
+	napi_schedule(&rx_napi->napi);
+}
+
+#ifndef COMPAT_CANNOT_USE_RPS_SOCK_FLOW_TABLE
+/* Returns the CPU on which an application last read the flow with this hash,
+ * according to the RFS socket flow table, or -1 if it isn't known.
+ */
+static int rx_steer_cpu(u32 hash)
+{
+	struct rps_sock_flow_table *sock_flow_table;
+	int cpu = -1;
+	u32 ident;
+
+	if (!hash)
+		return -1;
+
+	rcu_read_lock();
+	sock_flow_table = rcu_dereference(rps_sock_flow_table);
+	if (sock_flow_table) {
+		ident = READ_ONCE(sock_flow_table->ents[hash &
+							sock_flow_table->mask]);
+		if (!((ident ^ hash) & ~rps_cpu_mask)) {
+			cpu = ident & rps_cpu_mask;
+			if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+				cpu = -1;
+		}
+	}
+	rcu_read_unlock();
+	return cpu;
+}
+#endif
+
+/* Must be called with bh disabled. */
+static void rx_napi_schedule(struct wg_peer *peer, struct rx_napi *rx_napi)
+{
+#ifndef COMPAT_CANNOT_USE_RPS_SOCK_FLOW_TABLE
+	struct wg_device *wg = peer->device;
+	int cpu;
+
+	if (!(wg->features & WGDEVICE_FEATURE_FLOW_STEERING))
+		goto schedule_here;
+
+	cpu = rx_steer_cpu(READ_ONCE(peer->rx_flow_hash));
+	if (cpu < 0) {
+		wg_device_stat_add(wg, WGDEVICE_STAT_A_STEER_MISSES, 1);
+		goto schedule_here;
+	}
+	wg_device_stat_add(wg, WGDEVICE_STAT_A_STEER_HITS, 1);
+	if (cpu == smp_processor_id())
+		goto schedule_here;
+
+	/* If an IPI is already on its way, it will take care of this packet
+	 * too, even if it's headed to another CPU.
+	 */
+	if (test_and_set_bit(0, &rx_napi->steer_pending))
+		return;
+	if (unlikely(smp_call_function_single_async(cpu,
+						    &rx_napi->steer_csd))) {
+		clear_bit(0, &rx_napi->steer_pending);
+		goto schedule_here;
+	}
+	wg_device_stat_add(wg, WGDEVICE_STAT_A_STEER_REDIRECTS, 1);
+	return;
+
+schedule_here:
+#endif
+	napi_schedule(&rx_napi->napi);
+}
+
+void wg_packet_rx_napi_schedule(struct wg_peer *peer)
+{
+	struct rx_napi *rx_napi = peer->rx_napi;
+
+	local_bh_disable();
+	/* A peer sharing a napi stays on its list, holding a reference, until
+	 * the poll function finds its head packet not yet decrypted while
+	 * holding the same lock, so the state change made by our caller
+	 * cannot be missed.
+	 */
+	if (peer->device->features & WGDEVICE_FEATURE_SHARED_NAPI) {
+		spin_lock(&rx_napi->lock);
+		if (!peer->rx_napi_queued) {
+			peer->rx_napi_queued = true;
+			list_add_tail(&wg_peer_get(peer)->rx_napi_list,
+				      &rx_napi->peers);
+		}
+		spin_unlock(&rx_napi->lock);
+	}
+	rx_napi_schedule(peer, rx_napi);
+	local_bh_enable();
+}
+
+int wg_packet_rx_poll_shared(struct napi_struct *napi, int budget)
+{
+	struct rx_napi *rx_napi = container_of(napi, struct rx_napi, napi);
+	struct wg_peer *peer;
+	int work_done = 0;
+	bool dequeued, draining;
+
+	if (unlikely(budget <= 0))
+		return 0;
+
+	while (work_done < budget) {
+		spin_lock(&rx_napi->lock);
+		peer = list_first_entry_or_null(&rx_napi->peers, struct wg_peer,
+						rx_napi_list);
+		spin_unlock(&rx_napi->lock);
+		if (!peer)
+			break;
+
+		work_done += rx_poll_peer(peer, min(budget - work_done,
+						    SHARED_NAPI_PEER_QUOTA));
+
+		/* Peers with more ready packets go to the back of the line. */
+		spin_lock(&rx_napi->lock);
+		dequeued = !rx_queue_ready(&peer->rx_queue);
+		draining = false;
+		if (dequeued) {
+			list_del(&peer->rx_napi_list);
+			peer->rx_napi_queued = false;
+			draining = peer->rx_napi_draining;
+		} else {
+			list_move_tail(&peer->rx_napi_list, &rx_napi->peers);
+		}
+		spin_unlock(&rx_napi->lock);
+		if (draining)
+			complete(&peer->rx_napi_drained);
+		if (dequeued)
+			wg_peer_put(peer);
+	}
+
 	if (work_done < budget)
 		napi_complete_done(napi, work_done);
 
@@ -571,22 +1072,57 @@ void wg_packet_receive(struct wg_device *wg, struct sk_buff *skb)
 	case cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION):
 	case cpu_to_le32(MESSAGE_HANDSHAKE_RESPONSE):
 	case cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE): {
+		struct handshake_queue *queue =
+			this_cpu_ptr(wg->handshake_queues);
+		unsigned int len = skb_queue_len(&queue->skbs);
+		unsigned int limit = handshake_queue_limit();
 		int cpu;
 
-		if (skb_queue_len(&wg->incoming_handshakes) >
-			    MAX_QUEUED_INCOMING_HANDSHAKES ||
+		if (len > limit ||
 		    unlikely(!rng_is_initialized())) {
 			net_dbg_skb_ratelimited("%s: Dropping handshake packet from %pISpfsc\n",
 						wg->dev->name, skb);
+			wg_device_stat_add(
+				wg, WGDEVICE_STAT_A_HANDSHAKES_DROPPED, 1);
 			goto err;
 		}
-		skb_queue_tail(&wg->incoming_handshakes, skb);
+		/* Once the queue starts filling up, we check MAC1 right away,
+		 * so that garbage can't crowd out legitimate handshakes. It's
+		 * cheap, but not free, so below that we leave it to the worker.
+		 * Cookie messages carry no MAC1 to check.
+		 */
+		PACKET_CB(skb)->mac1_validated = false;
+		if (len >= limit / 8 &&
+		    SKB_TYPE_LE32(skb) !=
+			    cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE)) {
+			if (!wg_cookie_validate_mac1(&wg->cookie_checker,
+						     skb)) {
+				net_dbg_skb_ratelimited("%s: Invalid MAC of handshake, dropping packet from %pISpfsc\n",
+							wg->dev->name, skb);
+				wg_device_stat_add(
+					wg, WGDEVICE_STAT_A_HANDSHAKES_BAD_MAC,
+					1);
+				goto err;
+			}
+			PACKET_CB(skb)->mac1_validated = true;
+		}
+		PACKET_CB(skb)->queued_at = ktime_get_ns();
+		skb_queue_tail(&queue->skbs, skb);
+		wg_device_stat_add(wg, WGDEVICE_STAT_A_HANDSHAKES_QUEUED, 1);
 		/* Queues up a call to packet_process_queued_handshake_
-		 * packets(skb):
+		 * packets(skb), on this CPU, which received it according to
+		 * RSS:
 		 */
-		cpu = wg_cpumask_next_online(&wg->incoming_handshake_cpu);
-		queue_work_on(cpu, wg->handshake_receive_wq,
-			&per_cpu_ptr(wg->incoming_handshakes_worker, cpu)->work);
+		queue_work_on(smp_processor_id(), wg->handshake_receive_wq,
+			      &queue->work);
+		/* And if we're falling behind, also on the next CPU, which
+		 * will steal from us once it's done with its own.
+		 */
+		if (len >= HANDSHAKE_QUEUE_STEAL_THRESHOLD) {
+			cpu = wg_cpumask_next_online(&wg->handshake_steal_cpu);
+			queue_work_on(cpu, wg->handshake_receive_wq,
+				&per_cpu_ptr(wg->handshake_queues, cpu)->work);
+		}
 		break;
 	}
 	case cpu_to_le32(MESSAGE_DATA):
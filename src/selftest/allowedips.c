@@ -277,7 +277,7 @@ static __init bool randomized_test(void)
 	struct horrible_allowedips h;
 	DEFINE_MUTEX(mutex);
 	struct allowedips t;
-	bool ret = false;
+	bool ret = false, compiled;
 
 	mutex_init(&mutex);
 
@@ -296,6 +296,7 @@ static __init bool randomized_test(void)
 			goto free;
 		}
 		kref_init(&peers[i]->refcount);
+		INIT_LIST_HEAD(&peers[i]->allowedips_list);
 	}
 
 	mutex_lock(&mutex);
@@ -396,20 +397,34 @@ static __init bool randomized_test(void)
 		print_tree(t.root6, 128);
 	}
 
-	for (i = 0; i < NUM_QUERIES; ++i) {
-		prandom_bytes(ip, 4);
-		if (lookup(t.root4, 32, ip) !=
-		    horrible_allowedips_lookup_v4(&h, (struct in_addr *)ip)) {
-			pr_err("allowedips random self-test: FAIL\n");
-			goto free;
+	for (compiled = false;; compiled = true) {
+		for (i = 0; i < NUM_QUERIES; ++i) {
+			prandom_bytes(ip, 4);
+			if (lookup(t.root4, t.poptrie4, 32, ip) !=
+			    horrible_allowedips_lookup_v4(
+				    &h, (struct in_addr *)ip)) {
+				pr_err("allowedips random self-test: FAIL\n");
+				goto free;
+			}
 		}
-	}
 
-	for (i = 0; i < NUM_QUERIES; ++i) {
-		prandom_bytes(ip, 16);
-		if (lookup(t.root6, 128, ip) !=
-		    horrible_allowedips_lookup_v6(&h, (struct in6_addr *)ip)) {
-			pr_err("allowedips random self-test: FAIL\n");
+		for (i = 0; i < NUM_QUERIES; ++i) {
+			prandom_bytes(ip, 16);
+			if (lookup(t.root6, t.poptrie6, 128, ip) !=
+			    horrible_allowedips_lookup_v6(
+				    &h, (struct in6_addr *)ip)) {
+				pr_err("allowedips random self-test: FAIL\n");
+				goto free;
+			}
+		}
+
+		if (compiled)
+			break;
+		mutex_lock(&mutex);
+		wg_allowedips_compile(&t, &mutex);
+		mutex_unlock(&mutex);
+		if (!t.poptrie4 || !t.poptrie6) {
+			pr_err("allowedips random self-test malloc: FAIL\n");
 			goto free;
 		}
 	}
@@ -464,6 +479,130 @@ static __init struct wg_peer *init_peer(void)
 	return peer;
 }
 
+/* Not a pass/fail test of its own, but useful when touching either lookup:
+ * this fills a table with host routes and a sprinkling of shorter prefixes,
+ * and reports the cost of looking up the hosts, first in the trie and then in
+ * the poptrie compiled from it, after checking that both agree. The larger
+ * tables need CONFIG_WIREGUARD_DEBUG_BENCHMARKS.
+ */
+static __init bool benchmark_table(struct wg_peer **peers,
+				   unsigned int num_peers, u8 (*ips)[16],
+				   unsigned int routes, u8 bits)
+{
+	enum { LOOKUPS = 1 << 20, QUERIES = 1 << 14 };
+	u8 ip[16] __aligned(__alignof(u64));
+	struct allowedips_poptrie __rcu *poptrie;
+	struct allowedips_node __rcu *root;
+	u64 start, trie_ns, poptrie_ns;
+	struct allowedips t;
+	DEFINE_MUTEX(mutex);
+	unsigned int i;
+	bool ret = false;
+	u8 cidr;
+	int err;
+
+	mutex_init(&mutex);
+	mutex_lock(&mutex);
+	wg_allowedips_init(&t);
+
+	for (i = 0; i < routes; ++i) {
+		prandom_bytes(ips[i], 16);
+		/* The v6 hosts all sit in one /64, as is typical. */
+		if (bits == 128 && i)
+			memcpy(ips[i], ips[0], 8);
+		cidr = (i % 64) ? bits : bits / 2 + prandom_u32_max(bits / 4);
+		if (bits == 32)
+			err = wg_allowedips_insert_v4(&t,
+				(struct in_addr *)ips[i], cidr,
+				peers[i % num_peers], &mutex);
+		else
+			err = wg_allowedips_insert_v6(&t,
+				(struct in6_addr *)ips[i], cidr,
+				peers[i % num_peers], &mutex);
+		if (err < 0) {
+			pr_info("allowedips benchmark: stopped, out of memory\n");
+			goto out;
+		}
+	}
+
+	root = bits == 32 ? t.root4 : t.root6;
+	start = ktime_get_ns();
+	for (i = 0; i < LOOKUPS; ++i)
+		lookup(root, NULL, bits, ips[i % routes]);
+	trie_ns = ktime_get_ns() - start;
+
+	wg_allowedips_compile(&t, &mutex);
+	poptrie = bits == 32 ? t.poptrie4 : t.poptrie6;
+	if (!poptrie) {
+		pr_info("allowedips benchmark: stopped, out of memory\n");
+		goto out;
+	}
+	for (i = 0; i < routes + QUERIES; ++i) {
+		if (i < routes)
+			memcpy(ip, ips[i], 16);
+		else
+			prandom_bytes(ip, 16);
+		if (lookup(root, NULL, bits, ip) !=
+		    lookup(root, poptrie, bits, ip)) {
+			pr_err("allowedips benchmark: stopped, poptrie disagrees with trie\n");
+			goto out;
+		}
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < LOOKUPS; ++i)
+		lookup(root, poptrie, bits, ips[i % routes]);
+	poptrie_ns = ktime_get_ns() - start;
+
+	pr_info("allowedips benchmark: %u v%d routes, %llu ns/lookup in trie, %llu ns/lookup in poptrie\n",
+		routes, bits == 32 ? 4 : 6, div_u64(trie_ns, LOOKUPS),
+		div_u64(poptrie_ns, LOOKUPS));
+	ret = true;
+
+out:
+	wg_allowedips_free(&t, &mutex);
+	mutex_unlock(&mutex);
+	return ret;
+}
+
+static __init void benchmark(void)
+{
+	static const unsigned int sizes[] __initconst = {
+		1000,
+#ifdef DEBUG_BENCHMARKS
+		10000, 100000
+#endif
+	};
+	struct wg_peer *peers[64] = { NULL };
+	u8 (*ips)[16];
+	unsigned int i;
+
+	ips = kvmalloc(sizeof(*ips) * sizes[ARRAY_SIZE(sizes) - 1],
+		       GFP_KERNEL);
+	if (!ips)
+		goto out;
+	for (i = 0; i < ARRAY_SIZE(peers); ++i) {
+		peers[i] = init_peer();
+		if (!peers[i])
+			goto out;
+	}
+	for (i = 0; i < ARRAY_SIZE(sizes); ++i) {
+		if (!benchmark_table(peers, ARRAY_SIZE(peers), ips, sizes[i],
+				     32) ||
+		    !benchmark_table(peers, ARRAY_SIZE(peers), ips, sizes[i],
+				     128))
+			break;
+		cond_resched();
+	}
+
+out:
+	if (!ips || !peers[ARRAY_SIZE(peers) - 1])
+		pr_info("allowedips benchmark: skipped, out of memory\n");
+	for (i = 0; i < ARRAY_SIZE(peers); ++i)
+		kfree(peers[i]);
+	kvfree(ips);
+}
+
 #define insert(version, mem, ipa, ipb, ipc, ipd, cidr)                       \
 	wg_allowedips_insert_v##version(&t, ip##version(ipa, ipb, ipc, ipd), \
 					cidr, mem, &mutex)
@@ -477,13 +616,15 @@ static __init struct wg_peer *init_peer(void)
 	} while (0)
 
 #define test(version, mem, ipa, ipb, ipc, ipd) do {                          \
-		bool _s = lookup(t.root##version, (version) == 4 ? 32 : 128, \
+		bool _s = lookup(t.root##version, t.poptrie##version,        \
+				 (version) == 4 ? 32 : 128,                  \
 				 ip##version(ipa, ipb, ipc, ipd)) == (mem);  \
 		maybe_fail();                                                \
 	} while (0)
 
 #define test_negative(version, mem, ipa, ipb, ipc, ipd) do {                 \
-		bool _s = lookup(t.root##version, (version) == 4 ? 32 : 128, \
+		bool _s = lookup(t.root##version, t.poptrie##version,        \
+				 (version) == 4 ? 32 : 128,                  \
 				 ip##version(ipa, ipb, ipc, ipd)) != (mem);  \
 		maybe_fail();                                                \
 	} while (0)
@@ -496,7 +637,7 @@ static __init struct wg_peer *init_peer(void)
 bool __init wg_allowedips_selftest(void)
 {
 	bool found_a = false, found_b = false, found_c = false, found_d = false,
-	     found_e = false, found_other = false;
+	     found_e = false, found_other = false, compiled;
 	struct wg_peer *a = init_peer(), *b = init_peer(), *c = init_peer(),
 		       *d = init_peer(), *e = init_peer(), *f = init_peer(),
 		       *g = init_peer(), *h = init_peer();
@@ -552,46 +693,63 @@ bool __init wg_allowedips_selftest(void)
 
 	success = true;
 
-	test(4, a, 192, 168, 4, 20);
-	test(4, a, 192, 168, 4, 0);
-	test(4, b, 192, 168, 4, 4);
-	test(4, c, 192, 168, 200, 182);
-	test(4, c, 192, 95, 5, 68);
-	test(4, e, 192, 95, 5, 96);
-	test(6, d, 0x26075300, 0x60006b00, 0, 0xc05f0543);
-	test(6, c, 0x26075300, 0x60006b00, 0, 0xc02e01ee);
-	test(6, f, 0x26075300, 0x60006b01, 0, 0);
-	test(6, g, 0x24046800, 0x40040806, 0, 0x1006);
-	test(6, g, 0x24046800, 0x40040806, 0x1234, 0x5678);
-	test(6, f, 0x240467ff, 0x40040806, 0x1234, 0x5678);
-	test(6, f, 0x24046801, 0x40040806, 0x1234, 0x5678);
-	test(6, h, 0x24046800, 0x40040800, 0x1234, 0x5678);
-	test(6, h, 0x24046800, 0x40040800, 0, 0);
-	test(6, h, 0x24046800, 0x40040800, 0x10101010, 0x10101010);
-	test(6, a, 0x24046800, 0x40040800, 0xdeadbeef, 0xdeadbeef);
-	test(4, g, 64, 15, 116, 26);
-	test(4, g, 64, 15, 127, 3);
-	test(4, g, 64, 15, 123, 1);
-	test(4, h, 64, 15, 123, 128);
-	test(4, h, 64, 15, 123, 129);
-	test(4, a, 10, 0, 0, 52);
-	test(4, b, 10, 0, 0, 220);
-	test(4, a, 10, 1, 0, 2);
-	test(4, b, 10, 1, 0, 6);
-	test(4, c, 10, 1, 0, 10);
-	test(4, d, 10, 1, 0, 20);
+	/* The first pass looks up in the trie and the second in the poptrie
+	 * compiled from it.
+	 */
+	for (compiled = false;; compiled = true) {
+		test(4, a, 192, 168, 4, 20);
+		test(4, a, 192, 168, 4, 0);
+		test(4, b, 192, 168, 4, 4);
+		test(4, c, 192, 168, 200, 182);
+		test(4, c, 192, 95, 5, 68);
+		test(4, e, 192, 95, 5, 96);
+		test(6, d, 0x26075300, 0x60006b00, 0, 0xc05f0543);
+		test(6, c, 0x26075300, 0x60006b00, 0, 0xc02e01ee);
+		test(6, f, 0x26075300, 0x60006b01, 0, 0);
+		test(6, g, 0x24046800, 0x40040806, 0, 0x1006);
+		test(6, g, 0x24046800, 0x40040806, 0x1234, 0x5678);
+		test(6, f, 0x240467ff, 0x40040806, 0x1234, 0x5678);
+		test(6, f, 0x24046801, 0x40040806, 0x1234, 0x5678);
+		test(6, h, 0x24046800, 0x40040800, 0x1234, 0x5678);
+		test(6, h, 0x24046800, 0x40040800, 0, 0);
+		test(6, h, 0x24046800, 0x40040800, 0x10101010, 0x10101010);
+		test(6, a, 0x24046800, 0x40040800, 0xdeadbeef, 0xdeadbeef);
+		test(4, g, 64, 15, 116, 26);
+		test(4, g, 64, 15, 127, 3);
+		test(4, g, 64, 15, 123, 1);
+		test(4, h, 64, 15, 123, 128);
+		test(4, h, 64, 15, 123, 129);
+		test(4, a, 10, 0, 0, 52);
+		test(4, b, 10, 0, 0, 220);
+		test(4, a, 10, 1, 0, 2);
+		test(4, b, 10, 1, 0, 6);
+		test(4, c, 10, 1, 0, 10);
+		test(4, d, 10, 1, 0, 20);
+
+		if (compiled)
+			break;
+		wg_allowedips_compile(&t, &mutex);
+		test_boolean(t.poptrie4 && t.poptrie6);
+	}
 
 	insert(4, a, 1, 0, 0, 0, 32);
 	insert(4, a, 64, 0, 0, 0, 32);
 	insert(4, a, 128, 0, 0, 0, 32);
 	insert(4, a, 192, 0, 0, 0, 32);
 	insert(4, a, 255, 0, 0, 0, 32);
+	wg_allowedips_compile(&t, &mutex);
+	test(4, a, 64, 0, 0, 0);
 	wg_allowedips_remove_by_peer(&t, a, &mutex);
+	test_boolean(!t.poptrie4 && !t.poptrie6);
 	test_negative(4, a, 1, 0, 0, 0);
 	test_negative(4, a, 64, 0, 0, 0);
 	test_negative(4, a, 128, 0, 0, 0);
 	test_negative(4, a, 192, 0, 0, 0);
 	test_negative(4, a, 255, 0, 0, 0);
+	wg_allowedips_compile(&t, &mutex);
+	test_negative(4, a, 1, 0, 0, 0);
+	test_negative(4, a, 255, 0, 0, 0);
+	test(4, c, 192, 168, 200, 182);
 
 	wg_allowedips_free(&t, &mutex);
 	wg_allowedips_init(&t);
@@ -653,6 +811,8 @@ bool __init wg_allowedips_selftest(void)
 	test_boolean(found_e);
 	test_boolean(!found_other);
 
+	benchmark();
+
 	if (IS_ENABLED(DEBUG_RANDOM_TRIE) && success)
 		success = randomized_test();
 
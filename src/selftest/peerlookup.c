@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2019 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifdef DEBUG
+
+#include <linux/vmalloc.h>
+
+static __init void selftest_peer_release(struct kref *refcount)
+{
+}
+
+static __init struct index_hashtable_entry *
+selftest_lookup(struct index_hashtable *table,
+		const enum index_hashtable_type type_mask, const __le32 index,
+		struct wg_peer *expected_peer)
+{
+	struct index_hashtable_entry *entry;
+	struct wg_peer *peer = NULL;
+
+	entry = wg_index_hashtable_lookup(table, type_mask, index, &peer);
+	if (entry) {
+		if (peer != expected_peer)
+			return ERR_PTR(-EINVAL);
+		kref_put(&peer->refcount, selftest_peer_release);
+	}
+	return entry;
+}
+
+/* Not a pass/fail test, but useful when touching the table: this reports the
+ * cost of inserting into and looking up in a table of the given sizes. Lookups
+ * should cost the same at every size, and inserts only pay for the doublings.
+ * The larger sizes need CONFIG_WIREGUARD_DEBUG_BENCHMARKS.
+ */
+static __init void benchmark(struct index_hashtable *table,
+			     struct wg_peer *peer)
+{
+	static const unsigned int sizes[] __initconst = {
+		1000,
+#ifdef DEBUG_BENCHMARKS
+		100000, 1000000
+#endif
+	};
+	enum { LOOKUPS = 1000000 };
+	struct index_hashtable_entry *entries;
+	unsigned int i, j, rounds, inserted = 0, first;
+	u64 start, insert_ns, lookup_ns;
+
+	entries = vzalloc(sizes[ARRAY_SIZE(sizes) - 1] * sizeof(*entries));
+	if (!entries) {
+		pr_info("index hashtable benchmark: skipped, out of memory\n");
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sizes); ++i) {
+		first = inserted;
+		start = ktime_get_ns();
+		for (j = first; j < sizes[i]; ++j) {
+			entries[j].peer = peer;
+			entries[j].type = INDEX_HASHTABLE_KEYPAIR;
+			if (!wg_index_hashtable_insert(table, &entries[j])) {
+				pr_info("index hashtable benchmark: stopped, table full\n");
+				goto out;
+			}
+			++inserted;
+			if (!(j % 1024))
+				cond_resched();
+		}
+		insert_ns = ktime_get_ns() - start;
+
+		rounds = DIV_ROUND_UP(LOOKUPS, sizes[i]);
+		start = ktime_get_ns();
+		for (j = 0; j < rounds * sizes[i]; ++j) {
+			if (selftest_lookup(table, INDEX_HASHTABLE_KEYPAIR,
+					    entries[j % sizes[i]].index,
+					    peer) != &entries[j % sizes[i]]) {
+				pr_err("index hashtable benchmark: stopped, lookup mismatch\n");
+				goto out;
+			}
+		}
+		lookup_ns = ktime_get_ns() - start;
+
+		pr_info("index hashtable benchmark: %u entries, %llu ns/insert, %llu ns/lookup\n",
+			sizes[i], div_u64(insert_ns, sizes[i] - first),
+			div_u64(lookup_ns, rounds * sizes[i]));
+		cond_resched();
+	}
+
+out:
+	for (j = 0; j < inserted; ++j) {
+		wg_index_hashtable_remove(table, &entries[j]);
+		if (!(j % 1024))
+			cond_resched();
+	}
+	vfree(entries);
+}
+
+bool __init wg_index_hashtable_selftest(void)
+{
+	enum { ENTRIES = 4096 };
+	struct index_hashtable_entry *entries, replacement = { 0 };
+	struct index_hashtable *table;
+	unsigned int i, inserted = 0;
+	struct wg_peer *peer;
+	bool success = false;
+	__le32 old_index;
+	int test = 0;
+
+	table = wg_index_hashtable_alloc();
+	peer = kzalloc(sizeof(*peer), GFP_KERNEL);
+	entries = vzalloc(ENTRIES * sizeof(*entries));
+	if (!table || !peer || !entries) {
+		pr_err("index hashtable self-test malloc: FAIL\n");
+		goto out;
+	}
+	kref_init(&peer->refcount);
+
+	for (i = 0; i < ENTRIES; ++i) {
+		entries[i].peer = peer;
+		entries[i].type = (i & 1) ? INDEX_HASHTABLE_KEYPAIR :
+					    INDEX_HASHTABLE_HANDSHAKE;
+		if (!wg_index_hashtable_insert(table, &entries[i]))
+			goto err;
+		++inserted;
+	}
+	++test;
+
+	for (i = 0; i < ENTRIES; ++i) {
+		if (selftest_lookup(table, entries[i].type, entries[i].index,
+				    peer) != &entries[i])
+			goto err;
+	}
+	++test;
+
+	for (i = 0; i < ENTRIES; ++i) {
+		if (selftest_lookup(table, entries[i].type ^
+				    (INDEX_HASHTABLE_HANDSHAKE |
+				     INDEX_HASHTABLE_KEYPAIR),
+				    entries[i].index, peer))
+			goto err;
+	}
+	++test;
+
+	old_index = entries[0].index;
+	if (!wg_index_hashtable_insert(table, &entries[0]) ||
+	    selftest_lookup(table, entries[0].type, entries[0].index,
+			    peer) != &entries[0] ||
+	    (old_index != entries[0].index &&
+	     selftest_lookup(table, entries[0].type, old_index, peer)))
+		goto err;
+	++test;
+
+	replacement.peer = peer;
+	replacement.type = INDEX_HASHTABLE_KEYPAIR;
+	if (!wg_index_hashtable_replace(table, &entries[2], &replacement) ||
+	    replacement.index != entries[2].index ||
+	    selftest_lookup(table, INDEX_HASHTABLE_KEYPAIR, replacement.index,
+			    peer) != &replacement)
+		goto err;
+	++test;
+
+	/* Once replaced, the old entry is no longer in the table, so neither
+	 * can it be replaced again nor can its removal take out the new one.
+	 */
+	wg_index_hashtable_remove(table, &entries[2]);
+	if (wg_index_hashtable_replace(table, &entries[2], &replacement) ||
+	    selftest_lookup(table, INDEX_HASHTABLE_KEYPAIR, replacement.index,
+			    peer) != &replacement)
+		goto err;
+	++test;
+
+	wg_index_hashtable_remove(table, &replacement);
+	wg_index_hashtable_remove(table, &replacement);
+	if (selftest_lookup(table, INDEX_HASHTABLE_KEYPAIR, replacement.index,
+			    peer) ||
+	    wg_index_hashtable_replace(table, &replacement, &entries[2]))
+		goto err;
+	++test;
+
+	for (i = 0; i < inserted; ++i)
+		wg_index_hashtable_remove(table, &entries[i]);
+	inserted = 0;
+	for (i = 0; i < ENTRIES; ++i) {
+		if (selftest_lookup(table, entries[i].type, entries[i].index,
+				    peer))
+			goto err;
+	}
+	++test;
+
+	benchmark(table, peer);
+	success = true;
+
+err:
+	for (i = 0; i < inserted; ++i)
+		wg_index_hashtable_remove(table, &entries[i]);
+out:
+	if (table)
+		wg_index_hashtable_free(table);
+	vfree(entries);
+	kfree(peer);
+	if (success)
+		pr_info("index hashtable self-tests: pass\n");
+	else if (table && peer && entries)
+		pr_err("index hashtable self-test %d: FAIL\n", test);
+	return success;
+}
+#endif
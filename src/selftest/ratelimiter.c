@@ -115,18 +115,107 @@ static __init int capacity_test(struct sk_buff *skb4, struct iphdr *hdr4,
 	return 0;
 }
 
+static __init int sketch_flood_test(struct sk_buff *skb4, struct iphdr *hdr4,
+				    int *test)
+{
+	const unsigned int sources = max_entries + 1;
+	unsigned int i, denied = 0;
+
+	wg_ratelimiter_gc_entries(NULL);
+
+	/* The table turns away every new source past max_entries, whereas the
+	 * sketch should only turn away the few that collide in every row.
+	 */
+	for (i = 0; i < sources; ++i) {
+		hdr4->saddr = htonl(i);
+		denied += !wg_ratelimiter_allow(skb4, &init_net);
+	}
+	if (denied > sources / 100)
+		return -EXFULL;
+	++(*test);
+
+	/* Collisions must never let a source exceed its own burst. */
+	hdr4->saddr = htonl(sources);
+	for (i = 0; i < PACKETS_BURSTABLE; ++i)
+		wg_ratelimiter_allow(skb4, &init_net);
+	if (wg_ratelimiter_allow(skb4, &init_net))
+		return -EXFULL;
+	++(*test);
+	return 0;
+}
+
+static __init bool timings_test_with_retries(struct sk_buff *skb4,
+					     struct iphdr *hdr4,
+					     struct sk_buff *skb6,
+					     struct ipv6hdr *hdr6, int *test)
+{
+	enum { TRIALS_BEFORE_GIVING_UP = 5000 };
+	int trials;
+
+	for (trials = TRIALS_BEFORE_GIVING_UP;;) {
+		int test_count = 0, ret;
+
+		ret = timings_test(skb4, hdr4, skb6, hdr6, &test_count);
+		*test += test_count;
+		if (ret == -ETIMEDOUT) {
+			if (!trials--)
+				return false;
+			msleep(500);
+			continue;
+		}
+		return ret == 0;
+	}
+}
+
+/* Not a pass/fail test, but useful when touching the table or its gc: this
+ * reports the cost of a lookup across many sources, and of a gc pass that
+ * finds nothing to expire, which should not depend on the number of entries.
+ */
+static __init void benchmark(struct sk_buff *skb4, struct iphdr *hdr4)
+{
+	enum { ROUNDS = 16 };
+	const unsigned int sources = min_t(unsigned int, max_entries, 4096);
+	u64 start, allow_ns, gc_ns;
+	unsigned int i, j;
+
+	wg_ratelimiter_gc_entries(NULL);
+	rcu_barrier();
+
+	start = ktime_get_ns();
+	for (i = 0; i < ROUNDS; ++i) {
+		for (j = 0; j < sources; ++j) {
+			hdr4->saddr = htonl(j);
+			wg_ratelimiter_allow(skb4, &init_net);
+		}
+	}
+	allow_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	wg_ratelimiter_gc_entries(&gc_work.work);
+	gc_ns = ktime_get_ns() - start;
+
+	pr_info("ratelimiter benchmark: %u sources, %llu ns/packet, %llu ns/gc\n",
+		sources, div_u64(allow_ns, ROUNDS * sources), gc_ns);
+
+	wg_ratelimiter_gc_entries(NULL);
+	rcu_barrier();
+}
+
 bool __init wg_ratelimiter_selftest(void)
 {
 	enum { TRIALS_BEFORE_GIVING_UP = 5000 };
 	bool success = false;
 	int test = 0, trials;
 	struct sk_buff *skb4, *skb6;
+	const bool requested_sketch = ratelimiter_sketch;
 	struct iphdr *hdr4;
 	struct ipv6hdr *hdr6;
 
 	if (IS_ENABLED(CONFIG_KASAN) || IS_ENABLED(CONFIG_UBSAN))
 		return true;
 
+	ratelimiter_sketch = false;
+
 	BUILD_BUG_ON(MSEC_PER_SEC % PACKETS_PER_SECOND != 0);
 
 	if (wg_ratelimiter_init())
@@ -167,25 +256,8 @@ bool __init wg_ratelimiter_selftest(void)
 	++test;
 #endif
 
-	for (trials = TRIALS_BEFORE_GIVING_UP;;) {
-		int test_count = 0, ret;
-
-		ret = timings_test(skb4, hdr4, skb6, hdr6, &test_count);
-		if (ret == -ETIMEDOUT) {
-			if (!trials--) {
-				test += test_count;
-				goto err;
-			}
-			msleep(500);
-			continue;
-		} else if (ret < 0) {
-			test += test_count;
-			goto err;
-		} else {
-			test += test_count;
-			break;
-		}
-	}
+	if (!timings_test_with_retries(skb4, hdr4, skb6, hdr6, &test))
+		goto err;
 
 	for (trials = TRIALS_BEFORE_GIVING_UP;;) {
 		int test_count = 0;
@@ -202,6 +274,25 @@ bool __init wg_ratelimiter_selftest(void)
 		break;
 	}
 
+	benchmark(skb4, hdr4);
+
+	/* Now run the same timings, and a flood, against the sketch. Extra
+	 * uninits on the error path are harmless, as checked below.
+	 */
+	wg_ratelimiter_uninit();
+	wg_ratelimiter_uninit();
+	wg_ratelimiter_uninit();
+	ratelimiter_sketch = true;
+	if (wg_ratelimiter_init())
+		goto err;
+	++test;
+
+	if (!timings_test_with_retries(skb4, hdr4, skb6, hdr6, &test))
+		goto err;
+
+	if (sketch_flood_test(skb4, hdr4, &test) < 0)
+		goto err;
+
 	success = true;
 
 err:
@@ -216,6 +307,7 @@ err_nofree:
 	/* Uninit one extra time to check underflow detection. */
 	wg_ratelimiter_uninit();
 out:
+	ratelimiter_sketch = requested_sketch;
 	if (success)
 		pr_info("ratelimiter self-tests: pass\n");
 	else
@@ -53,9 +53,113 @@ void wg_packet_handshake_send_worker(struct work_struct *work)
 	wg_peer_put(peer);
 }
 
+/* Returns true, taking up a slot, if an initiation may be sent at now. Must be
+ * called with the scheduler's lock held.
+ */
+static bool initiation_slot_available(struct initiation_scheduler *sched,
+				      u64 now)
+{
+	if (!sched->rate)
+		return true;
+	if ((s64)(sched->next_slot - now) < 0)
+		sched->next_slot = now;
+	if (sched->next_slot - now >= NSEC_PER_SEC)
+		return false;
+	sched->next_slot += NSEC_PER_SEC / sched->rate;
+	return true;
+}
+
+static void initiation_backlog_schedule(struct wg_device *wg, u64 now)
+{
+	struct initiation_scheduler *sched = &wg->initiation_scheduler;
+	s64 wait = sched->next_slot - NSEC_PER_SEC - now;
+
+	queue_delayed_work(wg->handshake_send_wq, &sched->work,
+			   wait > 0 ? nsecs_to_jiffies(wait) + 1 : 0);
+}
+
+static void wg_packet_initiation_backlog_worker(struct work_struct *work)
+{
+	struct initiation_scheduler *sched = container_of(to_delayed_work(work),
+					struct initiation_scheduler, work);
+	struct wg_device *wg = container_of(sched, struct wg_device,
+					    initiation_scheduler);
+	u64 now = ktime_get_coarse_boottime_ns();
+	struct wg_peer *peer;
+	bool queued;
+
+	spin_lock_bh(&sched->lock);
+	while (!list_empty(&sched->backlog) &&
+	       initiation_slot_available(sched, now)) {
+		peer = list_first_entry(&sched->backlog, struct wg_peer,
+					initiation_backlog_entry);
+		list_del_init(&peer->initiation_backlog_entry);
+		--sched->backlog_len;
+		/* This is queued with the lock held, so that once
+		 * wg_packet_initiation_backlog_remove returns, flushing
+		 * handshake_send_wq is enough to be rid of it.
+		 */
+		queued = queue_work(wg->handshake_send_wq,
+				    &peer->transmit_handshake_work);
+		spin_unlock_bh(&sched->lock);
+		if (!queued)
+			wg_peer_put(peer);
+		spin_lock_bh(&sched->lock);
+	}
+	if (!list_empty(&sched->backlog))
+		initiation_backlog_schedule(wg, now);
+	spin_unlock_bh(&sched->lock);
+}
+
+void wg_packet_initiation_backlog_remove(struct wg_peer *peer)
+{
+	struct initiation_scheduler *sched =
+		&peer->device->initiation_scheduler;
+	bool was_queued = false;
+
+	spin_lock_bh(&sched->lock);
+	if (!list_empty(&peer->initiation_backlog_entry)) {
+		list_del_init(&peer->initiation_backlog_entry);
+		--sched->backlog_len;
+		was_queued = true;
+	}
+	spin_unlock_bh(&sched->lock);
+	if (was_queued)
+		wg_peer_put(peer);
+}
+
+void wg_packet_initiation_scheduler_init(struct wg_device *wg)
+{
+	struct initiation_scheduler *sched = &wg->initiation_scheduler;
+
+	spin_lock_init(&sched->lock);
+	INIT_LIST_HEAD(&sched->backlog);
+	sched->backlog_len = 0;
+	sched->rate = 0;
+	sched->next_slot = 0;
+	INIT_DELAYED_WORK(&sched->work, wg_packet_initiation_backlog_worker);
+}
+
+void wg_packet_initiation_scheduler_set_rate(struct wg_device *wg, u32 rate)
+{
+	struct initiation_scheduler *sched = &wg->initiation_scheduler;
+
+	spin_lock_bh(&sched->lock);
+	sched->rate = rate;
+	sched->next_slot = 0;
+	/* Let the backlog drain right away at the new rate. */
+	if (!list_empty(&sched->backlog))
+		mod_delayed_work(wg->handshake_send_wq, &sched->work, 0);
+	spin_unlock_bh(&sched->lock);
+}
+
 void wg_packet_send_queued_handshake_initiation(struct wg_peer *peer,
 						bool is_retry)
 {
+	struct initiation_scheduler *sched =
+		&peer->device->initiation_scheduler;
+	u64 now;
+
 	if (!is_retry)
 		peer->timer_handshake_attempts = 0;
 
@@ -70,6 +174,26 @@ void wg_packet_send_queued_handshake_initiation(struct wg_peer *peer,
 		goto out;
 
 	wg_peer_get(peer);
+	now = ktime_get_coarse_boottime_ns();
+	spin_lock(&sched->lock);
+	if (!list_empty(&peer->initiation_backlog_entry)) {
+		/* Already waiting its turn, with a reference of its own. */
+		spin_unlock(&sched->lock);
+		wg_peer_put(peer);
+		goto out;
+	}
+	if (!list_empty(&sched->backlog) ||
+	    !initiation_slot_available(sched, now)) {
+		/* Over the device's initiation rate, so the reference is kept
+		 * by the backlog until the scheduler queues us up.
+		 */
+		list_add_tail(&peer->initiation_backlog_entry, &sched->backlog);
+		if (++sched->backlog_len == 1)
+			initiation_backlog_schedule(peer->device, now);
+		spin_unlock(&sched->lock);
+		goto out;
+	}
+	spin_unlock(&sched->lock);
 	/* Queues up calling packet_send_queued_handshakes(peer), where we do a
 	 * peer_put(peer) after:
 	 */
@@ -83,7 +207,8 @@ out:
 	rcu_read_unlock_bh();
 }
 
-void wg_packet_send_handshake_response(struct wg_peer *peer)
+static void send_handshake_response(struct wg_peer *peer,
+				    const struct noise_response_dh *dh)
 {
 	struct message_handshake_response packet;
 
@@ -92,7 +217,8 @@ void wg_packet_send_handshake_response(struct wg_peer *peer)
 			    peer->device->dev->name, peer->internal_id,
 			    &peer->endpoint.addr);
 
-	if (wg_noise_handshake_create_response(&packet, &peer->handshake)) {
+	if (wg_noise_handshake_create_response(&packet, &peer->handshake,
+					       dh)) {
 		wg_cookie_add_mac_to_packet(&packet, sizeof(packet), peer);
 		if (wg_noise_handshake_begin_session(&peer->handshake,
 						     &peer->keypairs)) {
@@ -108,6 +234,27 @@ void wg_packet_send_handshake_response(struct wg_peer *peer)
 	}
 }
 
+/* Responds to a batch of initiations, with the scalar multiplications of the
+ * responses done side by side, two for each.
+ */
+void wg_packet_send_handshake_responses(struct wg_peer *const peers[],
+					unsigned int count)
+{
+	struct noise_response_dh dh[CURVE25519_BATCH_MAX / 2];
+	struct noise_handshake *handshakes[ARRAY_SIZE(dh)];
+	unsigned int i, n;
+
+	for (; count; count -= n, peers += n) {
+		n = min_t(unsigned int, count, ARRAY_SIZE(dh));
+		for (i = 0; i < n; ++i)
+			handshakes[i] = &peers[i]->handshake;
+		wg_noise_handshake_precompute_responses(handshakes, dh, n);
+		for (i = 0; i < n; ++i)
+			send_handshake_response(peers[i], &dh[i]);
+	}
+	memzero_explicit(dh, sizeof(dh));
+}
+
 void wg_packet_send_handshake_cookie(struct wg_device *wg,
 				     struct sk_buff *initiating_skb,
 				     __le32 sender_index)
@@ -133,8 +280,8 @@ static void keep_key_fresh(struct wg_peer *peer)
 	    (unlikely(atomic64_read(&keypair->sending.counter.counter) >
 		      REKEY_AFTER_MESSAGES) ||
 	     (keypair->i_am_the_initiator &&
-	      unlikely(wg_birthdate_has_expired(keypair->sending.birthdate,
-						REKEY_AFTER_TIME)))))
+	      unlikely((s64)(keypair->rekey_time -
+			     ktime_get_coarse_boottime_ns()) <= 0))))
 		send = true;
 	rcu_read_unlock_bh();
 
@@ -157,12 +304,149 @@ static unsigned int calculate_skb_padding(struct sk_buff *skb)
 	return padded_size - last_unit;
 }
 
+static bool can_fuse_checksum(const struct sk_buff *skb)
+{
+	int csum_start = skb_checksum_start_offset(skb);
+
+	return skb->ip_summed == CHECKSUM_PARTIAL && csum_start >= 0 &&
+	       csum_start + skb->csum_offset + sizeof(__sum16) <= skb->len;
+}
+
+/* skb_morph() releases everything that skb holds and then makes it a clone of
+ * nskb, which also resets those few fields that tie skb to its surroundings
+ * rather than to its data. Each of these is carried across here, because:
+ *
+ *   - next links skb into the batch that the encryption worker is walking and
+ *     that the tx worker then sends. That list is only walked forward, so prev
+ *     needn't be kept.
+ *   - destructor, usually sock_wfree(), uncharges sk once the packet is gone,
+ *     which keeps the sender throttled until the outer packet is sent. It is
+ *     cleared beforehand, so that skb_morph() doesn't run it early, and as nskb
+ *     never had an owner, it still runs exactly once, when skb is freed.
+ *   - truesize is what that destructor subtracts from sk, so, as with
+ *     pskb_expand_head(), it is left alone for skbs that are owned.
+ *
+ * Everything else either is copied from skb into nskb by the caller, like the
+ * cb, or is reset by wg_reset_packet() after encryption anyway.
+ */
+static void morph_keeping_owner(struct sk_buff *skb, struct sk_buff *nskb)
+{
+	void (*destructor)(struct sk_buff *) = skb->destructor;
+	unsigned int truesize = skb->truesize;
+	struct sk_buff *next = skb->next;
+	struct sock *sk = skb->sk;
+
+	skb->destructor = NULL;
+	skb_morph(skb, nskb);
+	skb->next = next;
+	skb->sk = sk;
+	skb->destructor = destructor;
+	if (sk)
+		skb->truesize = truesize;
+}
+
+/* When skb is cloned or paged, as is the case for most packets coming from TCP,
+ * whose pages are shared with the socket's retransmit queue, skb_cow_data would
+ * first copy all of its data to a private linear buffer, just so that we can
+ * then encrypt it in place. Instead, we encrypt it from wherever it is directly
+ * into a new linear skb, which we then morph skb into, so that it keeps its
+ * place in the list and the peer's queue, as well as its socket accounting.
+ */
+static bool encrypt_packet_out_of_place(struct sk_buff *skb,
+					struct noise_keypair *keypair,
+					unsigned int padding_len,
+					simd_context_t *simd_context,
+					bool *fallback)
+{
+	const unsigned int plaintext_len = skb->len + padding_len;
+	struct scatterlist sg[MAX_SKB_FRAGS + 3];
+	struct message_data *header;
+	struct sk_buff *nskb;
+	bool fuse_csum, ret;
+	int num_frags;
+	u8 *dst;
+
+	*fallback = true;
+	if (unlikely(skb_has_frag_list(skb) ||
+		     skb_shinfo(skb)->nr_frags + 2 > ARRAY_SIZE(sg)))
+		return false;
+
+	nskb = alloc_skb(DATA_PACKET_HEAD_ROOM + sizeof(*header) +
+			 noise_encrypted_len(plaintext_len),
+			 GFP_ATOMIC | __GFP_NOWARN);
+	if (unlikely(!nskb))
+		return false;
+	*fallback = false;
+	skb_reserve(nskb, DATA_PACKET_HEAD_ROOM + sizeof(*header));
+
+	/* Finalize checksum calculation for the inner packet, if required and
+	 * if it can't be done while encrypting. For cloned skbs, this only
+	 * unshares the header.
+	 */
+	fuse_csum = can_fuse_checksum(skb);
+	if (unlikely(!fuse_csum && skb->ip_summed == CHECKSUM_PARTIAL &&
+		     skb_checksum_help(skb)))
+		goto err;
+
+	/* The padding is read from the zero page, rather than being added. */
+	sg_init_table(sg, ARRAY_SIZE(sg));
+	num_frags = skb_to_sgvec(skb, sg, 0, skb->len);
+	if (unlikely(num_frags <= 0))
+		goto err;
+	if (padding_len) {
+		sg_unmark_end(&sg[num_frags - 1]);
+		sg_set_page(&sg[num_frags], ZERO_PAGE(0), padding_len, 0);
+		sg_mark_end(&sg[num_frags]);
+	}
+
+	dst = skb_put(nskb, noise_encrypted_len(plaintext_len));
+	if (fuse_csum)
+		ret = chacha20poly1305_encrypt_csum_sg(dst, sg, plaintext_len,
+						NULL, 0,
+						skb_checksum_start_offset(skb),
+						skb->csum_offset,
+						PACKET_CB(skb)->nonce,
+						keypair->sending.key,
+						simd_context);
+	else
+		ret = chacha20poly1305_encrypt_sg(dst, sg, plaintext_len, NULL,
+						  0, PACKET_CB(skb)->nonce,
+						  keypair->sending.key,
+						  simd_context);
+	if (!ret)
+		goto err;
+
+	skb_set_inner_network_header(nskb, 0);
+	header = (struct message_data *)skb_push(nskb, sizeof(*header));
+	header->header.type = cpu_to_le32(MESSAGE_DATA);
+	header->key_idx = keypair->remote_index;
+	header->counter = cpu_to_le64(PACKET_CB(skb)->nonce);
+	memcpy(nskb->cb, skb->cb, sizeof(nskb->cb));
+	nskb->protocol = skb->protocol;
+
+	morph_keeping_owner(skb, nskb);
+	consume_skb(nskb);
+
+	local_bh_disable();
+	wg_device_stat_add(keypair->entry.peer->device,
+			   WGDEVICE_STAT_A_TX_COPIES_AVOIDED, 1);
+	local_bh_enable();
+	return true;
+
+err:
+	kfree_skb(nskb);
+	return false;
+}
+
 static bool encrypt_packet(struct sk_buff *skb, struct noise_keypair *keypair,
 			   simd_context_t *simd_context)
 {
 	unsigned int padding_len, plaintext_len, trailer_len;
 	struct scatterlist sg[MAX_SKB_FRAGS + 8];
+	unsigned int csum_start = 0;
 	struct message_data *header;
+	enum wgdevice_stat_attribute stat;
+	bool linear, fuse_csum, ret;
 	struct sk_buff *trailer;
 	int num_frags;
 
@@ -171,6 +455,17 @@ static bool encrypt_packet(struct sk_buff *skb, struct noise_keypair *keypair,
 	trailer_len = padding_len + noise_encrypted_len(0);
 	plaintext_len = skb->len + padding_len;
 
+	if (skb_cloned(skb) || skb_is_nonlinear(skb)) {
+		bool fallback;
+		bool ret = encrypt_packet_out_of_place(skb, keypair,
+						       padding_len,
+						       simd_context,
+						       &fallback);
+
+		if (ret || !fallback)
+			return ret;
+	}
+
 	/* Expand data section to have room for padding and auth tag. */
 	num_frags = skb_cow_data(skb, trailer_len, &trailer);
 	if (unlikely(num_frags < 0 || num_frags > ARRAY_SIZE(sg)))
@@ -187,10 +482,19 @@ static bool encrypt_packet(struct sk_buff *skb, struct noise_keypair *keypair,
 	if (unlikely(skb_cow_head(skb, DATA_PACKET_HEAD_ROOM) < 0))
 		return false;
 
-	/* Finalize checksum calculation for the inner packet, if required. */
-	if (unlikely(skb->ip_summed == CHECKSUM_PARTIAL &&
-		     skb_checksum_help(skb)))
+	/* Finalize checksum calculation for the inner packet, if required. When
+	 * the plaintext is now one linear buffer, it is instead done while
+	 * encrypting.
+	 */
+	linear = trailer == skb && !skb_is_nonlinear(skb);
+	fuse_csum = linear && can_fuse_checksum(skb);
+	if (fuse_csum) {
+		csum_start = skb_checksum_start_offset(skb);
+		skb->ip_summed = CHECKSUM_NONE;
+	} else if (unlikely(skb->ip_summed == CHECKSUM_PARTIAL &&
+			    skb_checksum_help(skb))) {
 		return false;
+	}
 
 	/* Only after checksumming can we safely add on the padding at the end
 	 * and the header.
@@ -202,18 +506,53 @@ static bool encrypt_packet(struct sk_buff *skb, struct noise_keypair *keypair,
 	header->counter = cpu_to_le64(PACKET_CB(skb)->nonce);
 	pskb_put(skb, trailer, trailer_len);
 
-	/* Now we can encrypt the scattergather segments */
-	sg_init_table(sg, num_frags);
-	if (skb_to_sgvec(skb, sg, sizeof(struct message_data),
-			 noise_encrypted_len(plaintext_len)) <= 0)
-		return false;
-	return chacha20poly1305_encrypt_sg_inplace(sg, plaintext_len, NULL, 0,
-						   PACKET_CB(skb)->nonce,
-						   keypair->sending.key,
-						   simd_context);
+	if (linear) {
+		/* The common case of a single buffer needs no scatterlist. */
+		u8 *plaintext = skb->data + sizeof(*header);
+
+		if (fuse_csum) {
+			sg_init_one(sg, plaintext, plaintext_len);
+			ret = chacha20poly1305_encrypt_csum_sg(plaintext, sg,
+						plaintext_len, NULL, 0,
+						csum_start, skb->csum_offset,
+						PACKET_CB(skb)->nonce,
+						keypair->sending.key,
+						simd_context);
+		} else {
+			chacha20poly1305_encrypt_simd(plaintext, plaintext,
+						      plaintext_len, NULL, 0,
+						      PACKET_CB(skb)->nonce,
+						      keypair->sending.key,
+						      simd_context);
+			ret = true;
+		}
+		stat = WGDEVICE_STAT_A_TX_LINEAR;
+	} else {
+		/* Otherwise we encrypt the scattergather segments. */
+		sg_init_table(sg, num_frags);
+		if (skb_to_sgvec(skb, sg, sizeof(struct message_data),
+				 noise_encrypted_len(plaintext_len)) <= 0)
+			return false;
+		ret = chacha20poly1305_encrypt_sg_inplace(sg, plaintext_len,
+							  NULL, 0,
+							  PACKET_CB(skb)->nonce,
+							  keypair->sending.key,
+							  simd_context);
+		stat = WGDEVICE_STAT_A_TX_SCATTERGATHER;
+	}
+
+	if (ret) {
+		local_bh_disable();
+		wg_device_stat_add(keypair->entry.peer->device, stat, 1);
+		local_bh_enable();
+	}
+	return ret;
 }
 
-void wg_packet_send_keepalive(struct wg_peer *peer)
+static void send_staged_packets(struct wg_peer *peer, struct cpumask *cpus);
+
+/* Returns false if there is nothing to send. */
+static bool stage_keepalive(struct wg_peer *peer)
 {
 	struct sk_buff *skb;
 
@@ -221,7 +560,7 @@ void wg_packet_send_keepalive(struct wg_peer *peer)
 		skb = alloc_skb(DATA_PACKET_HEAD_ROOM + MESSAGE_MINIMUM_LENGTH,
 				GFP_ATOMIC);
 		if (unlikely(!skb))
-			return;
+			return false;
 		skb_reserve(skb, DATA_PACKET_HEAD_ROOM);
 		skb->dev = peer->device->dev;
 		PACKET_CB(skb)->mtu = skb->dev->mtu;
@@ -230,8 +569,33 @@ void wg_packet_send_keepalive(struct wg_peer *peer)
 				    peer->device->dev->name, peer->internal_id,
 				    &peer->endpoint.addr);
 	}
+	return true;
+}
+
+void wg_packet_send_keepalive(struct wg_peer *peer)
+{
+	if (stage_keepalive(peer))
+		wg_packet_send_staged_packets(peer);
+}
+
+/* Queues up a keepalive for each of the peers of wg before waking up the
+ * encryption worker of each CPU they went to, just once, rather than once per
+ * keepalive.
+ */
+void wg_packet_send_keepalives(struct wg_device *wg, struct wg_peer *peers[],
+			       unsigned int count, struct cpumask *cpus)
+{
+	unsigned int i;
+	int cpu;
 
-	wg_packet_send_staged_packets(peer);
+	cpumask_clear(cpus);
+	for (i = 0; i < count; ++i) {
+		if (stage_keepalive(peers[i]))
+			send_staged_packets(peers[i], cpus);
+	}
+	for_each_cpu(cpu, cpus)
+		queue_work_on(cpu, wg->packet_crypt_wq,
+			      &per_cpu_ptr(wg->encrypt_queue.worker, cpu)->work);
 }
 
 static void wg_packet_create_data_done(struct sk_buff *first,
@@ -255,6 +619,16 @@ static void wg_packet_create_data_done(struct sk_buff *first,
 	keep_key_fresh(peer);
 }
 
+static unsigned int count_skb_list(struct sk_buff *first)
+{
+	struct sk_buff *skb, *next;
+	unsigned int count = 0;
+
+	skb_list_walk_safe(first, skb, next)
+		++count;
+	return count;
+}
+
 void wg_packet_tx_worker(struct work_struct *work)
 {
 	struct crypt_queue *queue = container_of(work, struct crypt_queue,
@@ -271,10 +645,14 @@ void wg_packet_tx_worker(struct work_struct *work)
 		peer = PACKET_PEER(first);
 		keypair = PACKET_CB(first)->keypair;
 
-		if (likely(state == PACKET_STATE_CRYPTED))
+		if (likely(state == PACKET_STATE_CRYPTED)) {
 			wg_packet_create_data_done(first, peer);
-		else
+		} else {
+			local_bh_disable();
+			wg_peer_stats_tx_dropped(peer, count_skb_list(first));
+			local_bh_enable();
 			kfree_skb_list(first);
+		}
 
 		wg_noise_keypair_put(keypair, false);
 		wg_peer_put(peer);
@@ -310,7 +688,10 @@ void wg_packet_encrypt_worker(struct work_struct *work)
 	simd_put(&simd_context);
 }
 
-static void wg_packet_create_data(struct sk_buff *first)
+/* If cpus is not NULL, rather than waking up the encryption worker, this adds
+ * its CPU to cpus, for the caller to wake up later.
+ */
+static void wg_packet_create_data(struct sk_buff *first, struct cpumask *cpus)
 {
 	struct wg_peer *peer = PACKET_PEER(first);
 	struct wg_device *wg = peer->device;
@@ -320,10 +701,19 @@ static void wg_packet_create_data(struct sk_buff *first)
 	if (unlikely(READ_ONCE(peer->is_dead)))
 		goto err;
 
-	ret = wg_queue_enqueue_per_device_and_peer(&wg->encrypt_queue,
-						   &peer->tx_queue, first,
-						   wg->packet_crypt_wq,
-						   &wg->encrypt_queue.last_cpu);
+	if (cpus) {
+		ret = __wg_queue_enqueue_per_device_and_peer(&wg->encrypt_queue,
+				&peer->tx_queue, first,
+				&wg->encrypt_queue.last_cpu);
+		if (likely(ret >= 0)) {
+			cpumask_set_cpu(ret, cpus);
+			ret = 0;
+		}
+	} else {
+		ret = wg_queue_enqueue_per_device_and_peer(&wg->encrypt_queue,
+				&peer->tx_queue, first, wg->packet_crypt_wq,
+				&wg->encrypt_queue.last_cpu);
+	}
 	if (unlikely(ret == -EPIPE))
 		wg_queue_enqueue_per_peer(&peer->tx_queue, first,
 					  PACKET_STATE_DEAD);
@@ -340,11 +730,17 @@ void wg_packet_purge_staged_packets(struct wg_peer *peer)
 {
 	spin_lock_bh(&peer->staged_packet_queue.lock);
 	peer->device->dev->stats.tx_dropped += peer->staged_packet_queue.qlen;
+	wg_peer_stats_tx_dropped(peer, peer->staged_packet_queue.qlen);
 	__skb_queue_purge(&peer->staged_packet_queue);
 	spin_unlock_bh(&peer->staged_packet_queue.lock);
 }
 
 void wg_packet_send_staged_packets(struct wg_peer *peer)
+{
+	send_staged_packets(peer, NULL);
+}
+
+static void send_staged_packets(struct wg_peer *peer, struct cpumask *cpus)
 {
 	struct noise_symmetric_key *key;
 	struct noise_keypair *keypair;
@@ -392,7 +788,7 @@ void wg_packet_send_staged_packets(struct wg_peer *peer)
 	packets.prev->next = NULL;
 	wg_peer_get(keypair->entry.peer);
 	PACKET_CB(packets.next)->keypair = keypair;
-	wg_packet_create_data(packets.next);
+	wg_packet_create_data(packets.next, cpus);
 	return;
 
 out_invalid:
@@ -191,7 +191,9 @@ int wg_socket_send_skb_to_peer(struct wg_peer *peer, struct sk_buff *skb, u8 ds)
 	else
 		dev_kfree_skb(skb);
 	if (likely(!ret))
-		peer->tx_bytes += skb_len;
+		wg_peer_stats_tx(peer, skb_len);
+	else
+		wg_peer_stats_tx_dropped(peer, 1);
 	read_unlock_bh(&peer->endpoint_lock);
 
 	return ret;
@@ -9,6 +9,8 @@
 #include "queueing.h"
 #include "socket.h"
 
+#include <linux/delay.h>
+
 /*
  * - Timer for retransmitting the handshake if we don't hear back after
  * `REKEY_TIMEOUT + jitter` ms.
@@ -25,30 +27,269 @@
  *
  * - Timer for, if enabled, sending an empty authenticated packet every user-
  * specified seconds.
+ *
+ * The send keepalive, new handshake, and persistent keepalive timers would
+ * otherwise be modified or deleted for nearly every packet. Instead, the packet
+ * path only records what happened and when with plain writes, and arms a timer
+ * just when none is pending or its deadline moves earlier. When a timer fires
+ * whose deadline has since moved later, or which has since been logically
+ * deleted, it rearms itself or does nothing.
+ *
+ * Rather than each peer embedding its own timer_lists, which with very many
+ * peers makes for millions of kernel timers, each device has a timer wheel
+ * holding every peer once, at the earliest of its deadlines. A single work item
+ * turns the wheel and runs the expired timers of each due peer in turn, in
+ * process context. Persistent keepalives that come due together are queued for
+ * encryption as one batch. To keep peers that were brought up together from
+ * sending their persistent keepalives at the same moment forever after, each
+ * is sent at a random point in the last eighth of its interval.
+ *
+ * The wheel, and so its lock, is shared by the whole device. That is cheap
+ * because of the lazy rearming above: the packet path takes the lock at most
+ * about once per timer per peer per deadline, rather than once per packet, and
+ * each expiry handler only records state or queues work to run elsewhere, so
+ * one work item running them in turn keeps up with many peers. While idle, the
+ * work item only wakes for the earliest deadline, or to cascade it down.
+ */
+
+#define WHEEL_MASK (WG_TIMER_WHEEL_SIZE - 1)
+#define WHEEL_MAX_DELTA ((1UL << (WG_TIMER_WHEEL_BITS * WG_TIMER_WHEEL_LEVELS)) - 1)
+#define WHEEL_EXPIRED_SLOT ARRAY_SIZE(((struct wg_timer_wheel *)0)->slots)
+
+static void wheel_schedule(struct wg_timer_wheel *wheel, unsigned long when)
+{
+	if (wheel->in_run ||
+	    (wheel->armed && !time_before(when, wheel->next_wake)))
+		return;
+	wheel->next_wake = when;
+	wheel->armed = true;
+	mod_delayed_work(system_power_efficient_wq, &wheel->work,
+			 time_after(when, jiffies) ? when - jiffies : 0);
+}
+
+/* Returns the number of the first span of this level's granularity that starts
+ * no earlier than the wheel's clock, since those before it have already been
+ * cascaded down.
  */
+static unsigned long wheel_level_base(const struct wg_timer_wheel *wheel,
+				      unsigned int level)
+{
+	const unsigned int shift = level * WG_TIMER_WHEEL_BITS;
+
+	return (wheel->clk + (1UL << shift) - 1) >> shift;
+}
+
+/* Returns when the slot at this index of this level next comes up, which for
+ * the levels above 0 is when level 0 wraps around onto it and it cascades down.
+ */
+static unsigned long wheel_slot_time(const struct wg_timer_wheel *wheel,
+				     unsigned int level, unsigned int index)
+{
+	const unsigned long base = wheel_level_base(wheel, level);
+
+	return (base + ((index - base) & WHEEL_MASK)) <<
+	       (level * WG_TIMER_WHEEL_BITS);
+}
+
+/* Returns the earliest time at which any occupied slot, of any level, comes up.
+ * The wheel must not be empty.
+ */
+static unsigned long wheel_next_time(const struct wg_timer_wheel *wheel)
+{
+	unsigned int level, first, end, index;
+	unsigned long next = 0, when;
+	bool found = false;
+
+	for (level = 0; level < WG_TIMER_WHEEL_LEVELS; ++level) {
+		first = level * WG_TIMER_WHEEL_SIZE;
+		end = first + WG_TIMER_WHEEL_SIZE;
+		index = find_next_bit(wheel->pending, end,
+				      first + (wheel_level_base(wheel, level) &
+					       WHEEL_MASK));
+		if (index >= end)
+			index = find_next_bit(wheel->pending, end, first);
+		if (index >= end)
+			continue;
+		when = wheel_slot_time(wheel, level, index - first);
+		if (!found || time_before(when, next))
+			next = when;
+		found = true;
+	}
+	return next;
+}
+
+static void wheel_link(struct wg_timer_wheel *wheel, struct wg_peer *peer)
+{
+	unsigned long expires = peer->timer_next, delta;
+	unsigned int level = 0, slot;
+
+	/* An empty wheel may have stopped turning long ago. */
+	if (!wheel->count && !wheel->in_run)
+		wheel->clk = jiffies;
+	delta = expires - wheel->clk;
+	if ((long)delta < 0) {
+		expires = wheel->clk;
+		delta = 0;
+	} else if (delta > WHEEL_MAX_DELTA) {
+		expires = wheel->clk + WHEEL_MAX_DELTA;
+		delta = WHEEL_MAX_DELTA;
+	}
+	while (level < WG_TIMER_WHEEL_LEVELS - 1 &&
+	       delta >= 1UL << ((level + 1) * WG_TIMER_WHEEL_BITS))
+		++level;
+	slot = level * WG_TIMER_WHEEL_SIZE +
+	       ((expires >> (level * WG_TIMER_WHEEL_BITS)) & WHEEL_MASK);
+	hlist_add_head(&peer->timer_node, &wheel->slots[slot]);
+	peer->timer_slot = slot;
+	++wheel->count;
+	__set_bit(slot, wheel->pending);
+	wheel_schedule(wheel, wheel_slot_time(wheel, level, slot & WHEEL_MASK));
+}
+
+static void wheel_unlink(struct wg_timer_wheel *wheel, struct wg_peer *peer)
+{
+	unsigned int slot = peer->timer_slot;
+
+	if (hlist_unhashed(&peer->timer_node))
+		return;
+	hlist_del_init(&peer->timer_node);
+	if (slot == WHEEL_EXPIRED_SLOT)
+		return;
+	--wheel->count;
+	if (hlist_empty(&wheel->slots[slot]))
+		__clear_bit(slot, wheel->pending);
+}
+
+/* Puts the peer where its earliest pending deadline says it should be. */
+static void wheel_relink(struct wg_timer_wheel *wheel, struct wg_peer *peer)
+{
+	unsigned long pending = peer->timer_pending, next = 0;
+	bool linked = !hlist_unhashed(&peer->timer_node);
+	unsigned int i;
+
+	if (!pending) {
+		wheel_unlink(wheel, peer);
+		return;
+	}
+	for_each_set_bit(i, &pending, __WG_TIMER_COUNT) {
+		if (next == 0 || time_before(peer->timer_expires[i], next))
+			next = peer->timer_expires[i];
+	}
+	if (linked && (peer->timer_slot == WHEEL_EXPIRED_SLOT ||
+		       next == peer->timer_next)) {
+		/* The expiry loop will look at all deadlines anyway. */
+		peer->timer_next = next;
+		return;
+	}
+	wheel_unlink(wheel, peer);
+	peer->timer_next = next;
+	wheel_link(wheel, peer);
+}
+
+static void wheel_cascade(struct wg_timer_wheel *wheel, unsigned int level)
+{
+	unsigned int index = (wheel->clk >> (level * WG_TIMER_WHEEL_BITS)) &
+			     WHEEL_MASK;
+	struct hlist_head *head = &wheel->slots[level * WG_TIMER_WHEEL_SIZE +
+						 index];
+	struct hlist_node *tmp;
+	struct wg_peer *peer;
+
+	__clear_bit(level * WG_TIMER_WHEEL_SIZE + index, wheel->pending);
+	hlist_for_each_entry_safe(peer, tmp, head, timer_node) {
+		hlist_del_init(&peer->timer_node);
+		--wheel->count;
+		wheel_link(wheel, peer);
+	}
+}
+
+/* Moves every peer that is due by now onto the expired list. */
+static void wheel_advance(struct wg_timer_wheel *wheel, unsigned long now)
+{
+	struct hlist_node *tmp;
+	struct wg_peer *peer;
+	unsigned int index, level;
+	unsigned long next;
+
+	while (!time_after(wheel->clk, now)) {
+		index = wheel->clk & WHEEL_MASK;
+		for (level = 1; !index && level < WG_TIMER_WHEEL_LEVELS;
+		     ++level) {
+			wheel_cascade(wheel, level);
+			index = (wheel->clk >> (level * WG_TIMER_WHEEL_BITS)) &
+				WHEEL_MASK;
+		}
+		index = wheel->clk & WHEEL_MASK;
+
+		hlist_for_each_entry_safe(peer, tmp, &wheel->slots[index],
+					  timer_node) {
+			hlist_del(&peer->timer_node);
+			--wheel->count;
+			hlist_add_head(&peer->timer_node, &wheel->expired);
+			peer->timer_slot = WHEEL_EXPIRED_SLOT;
+		}
+		__clear_bit(index, wheel->pending);
+
+		/* Skip ahead over empty slots, of every level, straight to the
+		 * next one that is occupied, or to cascade down.
+		 */
+		next = wheel->count ? wheel_next_time(wheel) : now + 1;
+		if (!time_after(next, wheel->clk))
+			next = wheel->clk + 1;
+		wheel->clk = time_after(next, now + 1) ? now + 1 : next;
+	}
+}
 
 static inline void mod_peer_timer(struct wg_peer *peer,
-				  struct timer_list *timer,
+				  enum wg_peer_timer timer,
 				  unsigned long expires)
 {
+	struct wg_timer_wheel *wheel = &peer->device->timer_wheel;
+
 	rcu_read_lock_bh();
 	if (likely(netif_running(peer->device->dev) &&
-		   !READ_ONCE(peer->is_dead)))
-		mod_timer(timer, expires);
+		   !READ_ONCE(peer->is_dead))) {
+		spin_lock(&wheel->lock);
+		peer->timer_expires[timer] = expires;
+		WRITE_ONCE(peer->timer_pending,
+			   peer->timer_pending | BIT(timer));
+		wheel_relink(wheel, peer);
+		spin_unlock(&wheel->lock);
+	}
 	rcu_read_unlock_bh();
 }
 
-static void wg_expired_retransmit_handshake(struct timer_list *timer)
+static inline bool peer_timer_pending(struct wg_peer *peer,
+				      enum wg_peer_timer timer)
+{
+	return READ_ONCE(peer->timer_pending) & BIT(timer);
+}
+
+static inline unsigned long peer_timer_expires(struct wg_peer *peer,
+					       enum wg_peer_timer timer)
+{
+	return READ_ONCE(peer->timer_expires[timer]);
+}
+
+/* Returns true, after rearming the timer, if the deadline is still ahead. */
+static bool peer_timer_postponed(struct wg_peer *peer, enum wg_peer_timer timer,
+				 unsigned long deadline)
 {
-	struct wg_peer *peer = from_timer(peer, timer,
-					  timer_retransmit_handshake);
+	if (time_before(jiffies, deadline)) {
+		mod_peer_timer(peer, timer, deadline);
+		return true;
+	}
+	return false;
+}
 
+static void wg_expired_retransmit_handshake(struct wg_peer *peer)
+{
 	if (peer->timer_handshake_attempts > MAX_TIMER_HANDSHAKES) {
 		pr_debug("%s: Handshake for peer %llu (%pISpfsc) did not complete after %d attempts, giving up\n",
 			 peer->device->dev->name, peer->internal_id,
 			 &peer->endpoint.addr, MAX_TIMER_HANDSHAKES + 2);
 
-		del_timer(&peer->timer_send_keepalive);
+		WRITE_ONCE(peer->timer_received_since_sent, false);
 		/* We drop all packets without a keypair and don't try again,
 		 * if we try unsuccessfully for too long to make a handshake.
 		 */
@@ -57,8 +298,8 @@ static void wg_expired_retransmit_handshake(struct timer_list *timer)
 		/* We set a timer for destroying any residue that might be left
 		 * of a partial exchange.
 		 */
-		if (!timer_pending(&peer->timer_zero_key_material))
-			mod_peer_timer(peer, &peer->timer_zero_key_material,
+		if (!peer_timer_pending(peer, WG_TIMER_ZERO_KEY_MATERIAL))
+			mod_peer_timer(peer, WG_TIMER_ZERO_KEY_MATERIAL,
 				       jiffies + REJECT_AFTER_TIME * 3 * HZ);
 	} else {
 		++peer->timer_handshake_attempts;
@@ -76,21 +317,39 @@ static void wg_expired_retransmit_handshake(struct timer_list *timer)
 	}
 }
 
-static void wg_expired_send_keepalive(struct timer_list *timer)
+static void wg_expired_send_keepalive(struct wg_peer *peer)
 {
-	struct wg_peer *peer = from_timer(peer, timer, timer_send_keepalive);
+	unsigned long deadline;
+
+	if (!smp_load_acquire(&peer->timer_received_since_sent) ||
+	    peer_timer_postponed(peer, WG_TIMER_SEND_KEEPALIVE,
+				 READ_ONCE(peer->timer_keepalive_deadline)))
+		return;
+	/* The flag is claimed atomically: if a packet was sent since the check
+	 * above, it is already clear and there is nothing left to reply to, and
+	 * a wg_timers_data_received() from here on sets it anew and arms its own
+	 * expiry, rather than having that undone by a plain store.
+	 */
+	if (cmpxchg(&peer->timer_received_since_sent, true, false) != true)
+		return;
 
 	wg_packet_send_keepalive(peer);
 	if (peer->timer_need_another_keepalive) {
 		peer->timer_need_another_keepalive = false;
-		mod_peer_timer(peer, &peer->timer_send_keepalive,
-			       jiffies + KEEPALIVE_TIMEOUT * HZ);
+		deadline = jiffies + KEEPALIVE_TIMEOUT * HZ;
+		WRITE_ONCE(peer->timer_keepalive_deadline, deadline);
+		smp_store_release(&peer->timer_received_since_sent, true);
+		mod_peer_timer(peer, WG_TIMER_SEND_KEEPALIVE, deadline);
 	}
 }
 
-static void wg_expired_new_handshake(struct timer_list *timer)
+static void wg_expired_new_handshake(struct wg_peer *peer)
 {
-	struct wg_peer *peer = from_timer(peer, timer, timer_new_handshake);
+	if (!smp_load_acquire(&peer->timer_sent_since_received) ||
+	    peer_timer_postponed(peer, WG_TIMER_NEW_HANDSHAKE,
+				 READ_ONCE(peer->timer_new_handshake_deadline)))
+		return;
+	WRITE_ONCE(peer->timer_sent_since_received, false);
 
 	pr_debug("%s: Retrying handshake with peer %llu (%pISpfsc) because we stopped hearing back after %d seconds\n",
 		 peer->device->dev->name, peer->internal_id,
@@ -102,64 +361,179 @@ static void wg_expired_new_handshake(struct timer_list *timer)
 	wg_packet_send_queued_handshake_initiation(peer, false);
 }
 
-static void wg_expired_zero_key_material(struct timer_list *timer)
+/* Since the wheel runs in process context, this can sleep directly, rather than
+ * bouncing through a work item of its own.
+ */
+static void wg_expired_zero_key_material(struct wg_peer *peer)
 {
-	struct wg_peer *peer = from_timer(peer, timer, timer_zero_key_material);
+	pr_debug("%s: Zeroing out all keys for peer %llu (%pISpfsc), since we haven't received a new one in %d seconds\n",
+		 peer->device->dev->name, peer->internal_id,
+		 &peer->endpoint.addr, REJECT_AFTER_TIME * 3);
+	wg_noise_handshake_clear(&peer->handshake);
+	wg_noise_keypairs_clear(&peer->keypairs);
+}
 
-	rcu_read_lock_bh();
-	if (!READ_ONCE(peer->is_dead)) {
-		wg_peer_get(peer);
-		if (!queue_work(peer->device->handshake_send_wq,
-				&peer->clear_peer_work))
-			/* If the work was already on the queue, we want to drop
-			 * the extra reference.
-			 */
-			wg_peer_put(peer);
+static unsigned long persistent_keepalive_slack(u16 interval)
+{
+	return interval * HZ / 8;
+}
+
+static void wheel_flush_keepalives(struct wg_timer_wheel *wheel,
+				   struct wg_device *wg)
+{
+	unsigned int i;
+
+	wg_packet_send_keepalives(wg, wheel->keepalives, wheel->num_keepalives,
+				  &wheel->keepalive_cpus);
+	for (i = 0; i < wheel->num_keepalives; ++i)
+		wg_peer_put(wheel->keepalives[i]);
+	wheel->num_keepalives = 0;
+}
+
+static void wg_expired_send_persistent_keepalive(struct wg_peer *peer)
+{
+	const u16 interval = READ_ONCE(peer->persistent_keepalive_interval);
+	struct wg_timer_wheel *wheel = &peer->device->timer_wheel;
+	unsigned long deadline, slack;
+
+	if (unlikely(!interval))
+		return;
+	deadline = READ_ONCE(peer->timer_last_traversal) + interval * HZ;
+	slack = persistent_keepalive_slack(interval);
+	if (time_before(jiffies, deadline - slack)) {
+		mod_peer_timer(peer, WG_TIMER_PERSISTENT_KEEPALIVE,
+			       deadline - prandom_u32_max(slack + 1));
+		return;
 	}
-	rcu_read_unlock_bh();
+	wheel->keepalives[wheel->num_keepalives++] = wg_peer_get(peer);
+	if (wheel->num_keepalives == ARRAY_SIZE(wheel->keepalives))
+		wheel_flush_keepalives(wheel, peer->device);
 }
 
-static void wg_queued_expired_zero_key_material(struct work_struct *work)
+static void (*const timer_handlers[__WG_TIMER_COUNT])(struct wg_peer *) = {
+	[WG_TIMER_RETRANSMIT_HANDSHAKE] = wg_expired_retransmit_handshake,
+	[WG_TIMER_SEND_KEEPALIVE] = wg_expired_send_keepalive,
+	[WG_TIMER_NEW_HANDSHAKE] = wg_expired_new_handshake,
+	[WG_TIMER_ZERO_KEY_MATERIAL] = wg_expired_zero_key_material,
+	[WG_TIMER_PERSISTENT_KEEPALIVE] = wg_expired_send_persistent_keepalive
+};
+
+static void wheel_worker(struct work_struct *work)
 {
-	struct wg_peer *peer = container_of(work, struct wg_peer,
-					    clear_peer_work);
+	struct wg_timer_wheel *wheel = container_of(to_delayed_work(work),
+						    struct wg_timer_wheel,
+						    work);
+	unsigned long due, now;
+	struct wg_peer *peer;
+	unsigned int i;
 
-	pr_debug("%s: Zeroing out all keys for peer %llu (%pISpfsc), since we haven't received a new one in %d seconds\n",
-		 peer->device->dev->name, peer->internal_id,
-		 &peer->endpoint.addr, REJECT_AFTER_TIME * 3);
-	wg_noise_handshake_clear(&peer->handshake);
-	wg_noise_keypairs_clear(&peer->keypairs);
-	wg_peer_put(peer);
+	spin_lock_bh(&wheel->lock);
+	wheel->armed = false;
+	wheel->in_run = true;
+	now = jiffies;
+	wheel_advance(wheel, now);
+	while (!hlist_empty(&wheel->expired)) {
+		peer = hlist_entry(wheel->expired.first, struct wg_peer,
+				   timer_node);
+		hlist_del_init(&peer->timer_node);
+		due = 0;
+		for_each_set_bit(i, &peer->timer_pending, __WG_TIMER_COUNT) {
+			if (!time_after(peer->timer_expires[i], now))
+				due |= BIT(i);
+		}
+		WRITE_ONCE(peer->timer_pending, peer->timer_pending & ~due);
+		wheel_relink(wheel, peer);
+		if (!due)
+			continue;
+		wheel->running = peer;
+		spin_unlock_bh(&wheel->lock);
+
+		for_each_set_bit(i, &due, __WG_TIMER_COUNT)
+			timer_handlers[i](peer);
+		cond_resched();
+
+		spin_lock_bh(&wheel->lock);
+		WRITE_ONCE(wheel->running, NULL);
+	}
+	if (wheel->num_keepalives) {
+		spin_unlock_bh(&wheel->lock);
+		wheel_flush_keepalives(wheel, container_of(wheel,
+							   struct wg_device,
+							   timer_wheel));
+		spin_lock_bh(&wheel->lock);
+	}
+	wheel->in_run = false;
+
+	/* Sleep until the next occupied slot comes up, on whichever level, so
+	 * that a wheel holding only far off deadlines stays asleep until then.
+	 */
+	if (wheel->count)
+		wheel_schedule(wheel, wheel_next_time(wheel));
+	spin_unlock_bh(&wheel->lock);
 }
 
-static void wg_expired_send_persistent_keepalive(struct timer_list *timer)
+void wg_timers_wheel_init(struct wg_timer_wheel *wheel)
 {
-	struct wg_peer *peer = from_timer(peer, timer,
-					  timer_persistent_keepalive);
+	unsigned int i;
+
+	spin_lock_init(&wheel->lock);
+	for (i = 0; i < ARRAY_SIZE(wheel->slots); ++i)
+		INIT_HLIST_HEAD(&wheel->slots[i]);
+	bitmap_zero(wheel->pending,
+		    WG_TIMER_WHEEL_LEVELS * WG_TIMER_WHEEL_SIZE);
+	INIT_HLIST_HEAD(&wheel->expired);
+	wheel->running = NULL;
+	wheel->clk = jiffies;
+	wheel->count = 0;
+	wheel->armed = false;
+	wheel->in_run = false;
+	wheel->num_keepalives = 0;
+	INIT_DELAYED_WORK(&wheel->work, wheel_worker);
+}
 
-	if (likely(peer->persistent_keepalive_interval))
-		wg_packet_send_keepalive(peer);
+/* Must only be called once all peers have been stopped. */
+void wg_timers_wheel_destroy(struct wg_timer_wheel *wheel)
+{
+	cancel_delayed_work_sync(&wheel->work);
+	WARN_ON(wheel->count || !hlist_empty(&wheel->expired));
 }
 
 /* Should be called after an authenticated data packet is sent. */
 void wg_timers_data_sent(struct wg_peer *peer)
 {
-	if (!timer_pending(&peer->timer_new_handshake))
-		mod_peer_timer(peer, &peer->timer_new_handshake,
-			jiffies + (KEEPALIVE_TIMEOUT + REKEY_TIMEOUT) * HZ +
-			prandom_u32_max(REKEY_TIMEOUT_JITTER_MAX_JIFFIES));
+	unsigned long deadline;
+
+	if (READ_ONCE(peer->timer_sent_since_received))
+		return;
+	deadline = jiffies + (KEEPALIVE_TIMEOUT + REKEY_TIMEOUT) * HZ +
+		   prandom_u32_max(REKEY_TIMEOUT_JITTER_MAX_JIFFIES);
+	WRITE_ONCE(peer->timer_new_handshake_deadline, deadline);
+	smp_store_release(&peer->timer_sent_since_received, true);
+	if (!peer_timer_pending(peer, WG_TIMER_NEW_HANDSHAKE) ||
+	    time_after(peer_timer_expires(peer, WG_TIMER_NEW_HANDSHAKE),
+		       deadline))
+		mod_peer_timer(peer, WG_TIMER_NEW_HANDSHAKE, deadline);
 }
 
 /* Should be called after an authenticated data packet is received. */
 void wg_timers_data_received(struct wg_peer *peer)
 {
-	if (likely(netif_running(peer->device->dev))) {
-		if (!timer_pending(&peer->timer_send_keepalive))
-			mod_peer_timer(peer, &peer->timer_send_keepalive,
-				       jiffies + KEEPALIVE_TIMEOUT * HZ);
-		else
-			peer->timer_need_another_keepalive = true;
+	unsigned long deadline;
+
+	if (unlikely(!netif_running(peer->device->dev)))
+		return;
+	if (READ_ONCE(peer->timer_received_since_sent)) {
+		if (!READ_ONCE(peer->timer_need_another_keepalive))
+			WRITE_ONCE(peer->timer_need_another_keepalive, true);
+		return;
 	}
+	deadline = jiffies + KEEPALIVE_TIMEOUT * HZ;
+	WRITE_ONCE(peer->timer_keepalive_deadline, deadline);
+	smp_store_release(&peer->timer_received_since_sent, true);
+	if (!peer_timer_pending(peer, WG_TIMER_SEND_KEEPALIVE) ||
+	    time_after(peer_timer_expires(peer, WG_TIMER_SEND_KEEPALIVE),
+		       deadline))
+		mod_peer_timer(peer, WG_TIMER_SEND_KEEPALIVE, deadline);
 }
 
 /* Should be called after any type of authenticated packet is sent, whether
@@ -167,7 +541,8 @@ void wg_timers_data_received(struct wg_peer *peer)
  */
 void wg_timers_any_authenticated_packet_sent(struct wg_peer *peer)
 {
-	del_timer(&peer->timer_send_keepalive);
+	if (READ_ONCE(peer->timer_received_since_sent))
+		WRITE_ONCE(peer->timer_received_since_sent, false);
 }
 
 /* Should be called after any type of authenticated packet is received, whether
@@ -175,13 +550,14 @@ void wg_timers_any_authenticated_packet_sent(struct wg_peer *peer)
  */
 void wg_timers_any_authenticated_packet_received(struct wg_peer *peer)
 {
-	del_timer(&peer->timer_new_handshake);
+	if (READ_ONCE(peer->timer_sent_since_received))
+		WRITE_ONCE(peer->timer_sent_since_received, false);
 }
 
 /* Should be called after a handshake initiation message is sent. */
 void wg_timers_handshake_initiated(struct wg_peer *peer)
 {
-	mod_peer_timer(peer, &peer->timer_retransmit_handshake,
+	mod_peer_timer(peer, WG_TIMER_RETRANSMIT_HANDSHAKE,
 		       jiffies + REKEY_TIMEOUT * HZ +
 		       prandom_u32_max(REKEY_TIMEOUT_JITTER_MAX_JIFFIES));
 }
@@ -191,7 +567,7 @@ void wg_timers_handshake_initiated(struct wg_peer *peer)
  */
 void wg_timers_handshake_complete(struct wg_peer *peer)
 {
-	del_timer(&peer->timer_retransmit_handshake);
+	wg_timers_del(peer, WG_TIMER_RETRANSMIT_HANDSHAKE);
 	peer->timer_handshake_attempts = 0;
 	peer->sent_lastminute_handshake = false;
 	ktime_get_real_ts64(&peer->walltime_last_handshake);
@@ -202,7 +578,7 @@ void wg_timers_handshake_complete(struct wg_peer *peer)
  */
 void wg_timers_session_derived(struct wg_peer *peer)
 {
-	mod_peer_timer(peer, &peer->timer_zero_key_material,
+	mod_peer_timer(peer, WG_TIMER_ZERO_KEY_MATERIAL,
 		       jiffies + REJECT_AFTER_TIME * 3 * HZ);
 }
 
@@ -211,33 +587,60 @@ void wg_timers_session_derived(struct wg_peer *peer)
  */
 void wg_timers_any_authenticated_packet_traversal(struct wg_peer *peer)
 {
-	if (peer->persistent_keepalive_interval)
-		mod_peer_timer(peer, &peer->timer_persistent_keepalive,
-			jiffies + peer->persistent_keepalive_interval * HZ);
+	const u16 interval = READ_ONCE(peer->persistent_keepalive_interval);
+	const unsigned long now = jiffies;
+	unsigned long deadline, slack;
+
+	if (!interval)
+		return;
+	if (READ_ONCE(peer->timer_last_traversal) != now)
+		WRITE_ONCE(peer->timer_last_traversal, now);
+	deadline = now + interval * HZ;
+	if (!peer_timer_pending(peer, WG_TIMER_PERSISTENT_KEEPALIVE) ||
+	    time_after(peer_timer_expires(peer, WG_TIMER_PERSISTENT_KEEPALIVE),
+		       deadline)) {
+		slack = persistent_keepalive_slack(interval);
+		mod_peer_timer(peer, WG_TIMER_PERSISTENT_KEEPALIVE,
+			       deadline - prandom_u32_max(slack + 1));
+	}
+}
+
+void wg_timers_del(struct wg_peer *peer, enum wg_peer_timer timer)
+{
+	struct wg_timer_wheel *wheel = &peer->device->timer_wheel;
+
+	if (!peer_timer_pending(peer, timer))
+		return;
+	spin_lock_bh(&wheel->lock);
+	WRITE_ONCE(peer->timer_pending, peer->timer_pending & ~BIT(timer));
+	if (!peer->timer_pending)
+		wheel_unlink(wheel, peer);
+	spin_unlock_bh(&wheel->lock);
 }
 
 void wg_timers_init(struct wg_peer *peer)
 {
-	timer_setup(&peer->timer_retransmit_handshake,
-		    wg_expired_retransmit_handshake, 0);
-	timer_setup(&peer->timer_send_keepalive, wg_expired_send_keepalive, 0);
-	timer_setup(&peer->timer_new_handshake, wg_expired_new_handshake, 0);
-	timer_setup(&peer->timer_zero_key_material,
-		    wg_expired_zero_key_material, 0);
-	timer_setup(&peer->timer_persistent_keepalive,
-		    wg_expired_send_persistent_keepalive, 0);
-	INIT_WORK(&peer->clear_peer_work, wg_queued_expired_zero_key_material);
+	INIT_HLIST_NODE(&peer->timer_node);
+	peer->timer_pending = 0;
 	peer->timer_handshake_attempts = 0;
 	peer->sent_lastminute_handshake = false;
 	peer->timer_need_another_keepalive = false;
+	peer->timer_received_since_sent = false;
+	peer->timer_sent_since_received = false;
 }
 
 void wg_timers_stop(struct wg_peer *peer)
 {
-	del_timer_sync(&peer->timer_retransmit_handshake);
-	del_timer_sync(&peer->timer_send_keepalive);
-	del_timer_sync(&peer->timer_new_handshake);
-	del_timer_sync(&peer->timer_zero_key_material);
-	del_timer_sync(&peer->timer_persistent_keepalive);
-	flush_work(&peer->clear_peer_work);
+	struct wg_timer_wheel *wheel = &peer->device->timer_wheel;
+
+	spin_lock_bh(&wheel->lock);
+	WRITE_ONCE(peer->timer_pending, 0);
+	wheel_unlink(wheel, peer);
+	spin_unlock_bh(&wheel->lock);
+	/* Like del_timer_sync, wait for any handler already running. */
+	while (READ_ONCE(wheel->running) == peer)
+		msleep(1);
+	WRITE_ONCE(peer->timer_need_another_keepalive, false);
+	WRITE_ONCE(peer->timer_received_since_sent, false);
+	WRITE_ONCE(peer->timer_sent_since_received, false);
 }
@@ -7,11 +7,57 @@
 #define _WG_TIMERS_H
 
 #include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
 
 struct wg_peer;
 
+enum wg_peer_timer {
+	WG_TIMER_RETRANSMIT_HANDSHAKE,
+	WG_TIMER_SEND_KEEPALIVE,
+	WG_TIMER_NEW_HANDSHAKE,
+	WG_TIMER_ZERO_KEY_MATERIAL,
+	WG_TIMER_PERSISTENT_KEEPALIVE,
+	__WG_TIMER_COUNT
+};
+
+enum {
+	WG_TIMER_WHEEL_BITS = 6,
+	WG_TIMER_WHEEL_SIZE = 1 << WG_TIMER_WHEEL_BITS,
+	WG_TIMER_WHEEL_LEVELS = 4,
+	WG_TIMER_KEEPALIVE_BATCH = 64
+};
+
+/* Each peer sits in at most one slot, keyed on the earliest of its deadlines,
+ * and a single delayed work item expires them in batches. Level 0 has one slot
+ * per jiffy, and every level above is WG_TIMER_WHEEL_SIZE times coarser, with
+ * its slots cascading down as the wheel turns.
+ */
+struct wg_timer_wheel {
+	spinlock_t lock;
+	struct hlist_head slots[WG_TIMER_WHEEL_LEVELS * WG_TIMER_WHEEL_SIZE];
+	DECLARE_BITMAP(pending, WG_TIMER_WHEEL_LEVELS * WG_TIMER_WHEEL_SIZE);
+	struct hlist_head expired;
+	struct wg_peer *running;
+	unsigned long clk, next_wake;
+	unsigned int count;
+	bool armed, in_run;
+	struct delayed_work work;
+	/* Only touched by the work item, while running the expired timers. */
+	struct wg_peer *keepalives[WG_TIMER_KEEPALIVE_BATCH];
+	unsigned int num_keepalives;
+	struct cpumask keepalive_cpus;
+};
+
+void wg_timers_wheel_init(struct wg_timer_wheel *wheel);
+void wg_timers_wheel_destroy(struct wg_timer_wheel *wheel);
+
 void wg_timers_init(struct wg_peer *peer);
 void wg_timers_stop(struct wg_peer *peer);
+void wg_timers_del(struct wg_peer *peer, enum wg_peer_timer timer);
 void wg_timers_data_sent(struct wg_peer *peer);
 void wg_timers_data_received(struct wg_peer *peer);
 void wg_timers_any_authenticated_packet_sent(struct wg_peer *peer);
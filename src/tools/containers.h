@@ -79,6 +79,8 @@ struct wgdevice {
 	uint32_t fwmark;
 	uint16_t listen_port;
 
+	uint64_t stats[WGDEVICE_STAT_A_MAX + 1];
+
 	struct wgpeer *first_peer, *last_peer;
 };
 
@@ -821,6 +821,16 @@ static int parse_peers(const struct nlattr *attr, void *data)
 	return MNL_CB_OK;
 }
 
+static int parse_device_stat(const struct nlattr *attr, void *data)
+{
+	struct wgdevice *device = data;
+	uint16_t type = mnl_attr_get_type(attr);
+
+	if (type > WGDEVICE_STAT_A_UNSPEC && type <= WGDEVICE_STAT_A_MAX && !mnl_attr_validate(attr, MNL_TYPE_U64))
+		device->stats[type] = mnl_attr_get_u64(attr);
+	return MNL_CB_OK;
+}
+
 static int parse_device(const struct nlattr *attr, void *data)
 {
 	struct wgdevice *device = data;
@@ -858,6 +868,8 @@ static int parse_device(const struct nlattr *attr, void *data)
 		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
 			device->fwmark = mnl_attr_get_u32(attr);
 		break;
+	case WGDEVICE_A_STATS:
+		return mnl_attr_parse_nested(attr, parse_device_stat, device);
 	case WGDEVICE_A_PEERS:
 		return mnl_attr_parse_nested(attr, parse_peers, device);
 	}
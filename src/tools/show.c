@@ -202,7 +202,7 @@ static char *bytes(uint64_t b)
 static const char *COMMAND_NAME;
 static void show_usage(void)
 {
-	fprintf(stderr, "Usage: %s %s { <interface> | all | interfaces } [public-key | private-key | listen-port | fwmark | peers | preshared-keys | endpoints | allowed-ips | latest-handshakes | transfer | persistent-keepalive | dump]\n", PROG_NAME, COMMAND_NAME);
+	fprintf(stderr, "Usage: %s %s { <interface> | all | interfaces } [public-key | private-key | listen-port | fwmark | peers | preshared-keys | endpoints | allowed-ips | latest-handshakes | transfer | persistent-keepalive | stats | dump]\n", PROG_NAME, COMMAND_NAME);
 }
 
 static void pretty_print(struct wgdevice *device)
@@ -287,6 +287,23 @@ static void dump_print(struct wgdevice *device, bool with_interface)
 	}
 }
 
+static const char *const device_stat_names[WGDEVICE_STAT_A_MAX + 1] = {
+	[WGDEVICE_STAT_A_STEER_HITS] = "steer-hits",
+	[WGDEVICE_STAT_A_STEER_MISSES] = "steer-misses",
+	[WGDEVICE_STAT_A_STEER_REDIRECTS] = "steer-redirects",
+	[WGDEVICE_STAT_A_RX_COPIES_AVOIDED] = "rx-copies-avoided",
+	[WGDEVICE_STAT_A_TX_COPIES_AVOIDED] = "tx-copies-avoided",
+	[WGDEVICE_STAT_A_RX_LINEAR] = "rx-linear",
+	[WGDEVICE_STAT_A_RX_SCATTERGATHER] = "rx-scattergather",
+	[WGDEVICE_STAT_A_TX_LINEAR] = "tx-linear",
+	[WGDEVICE_STAT_A_TX_SCATTERGATHER] = "tx-scattergather",
+	[WGDEVICE_STAT_A_HANDSHAKES_QUEUED] = "handshakes-queued",
+	[WGDEVICE_STAT_A_HANDSHAKES_DROPPED] = "handshakes-dropped",
+	[WGDEVICE_STAT_A_HANDSHAKES_STOLEN] = "handshakes-stolen",
+	[WGDEVICE_STAT_A_HANDSHAKES_BAD_MAC] = "handshakes-bad-mac",
+	[WGDEVICE_STAT_A_HANDSHAKE_LOAD_TRANSITIONS] = "handshake-load-transitions"
+};
+
 static bool ugly_print(struct wgdevice *device, const char *param, bool with_interface)
 {
 	struct wgpeer *peer;
@@ -366,6 +383,12 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 				printf("%s\t", device->name);
 			printf("%s\n", key(peer->public_key));
 		}
+	} else if (!strcmp(param, "stats")) {
+		for (int i = WGDEVICE_STAT_A_UNSPEC + 1; i <= WGDEVICE_STAT_A_MAX; ++i) {
+			if (with_interface)
+				printf("%s\t", device->name);
+			printf("%s\t%" PRIu64 "\n", device_stat_names[i], device->stats[i]);
+		}
 	} else if (!strcmp(param, "dump"))
 		dump_print(device, with_interface);
 	else {
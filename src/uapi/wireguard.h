@@ -29,6 +29,26 @@
  *    WGDEVICE_A_PUBLIC_KEY: NLA_EXACT_LEN, len WG_KEY_LEN
  *    WGDEVICE_A_LISTEN_PORT: NLA_U16
  *    WGDEVICE_A_FWMARK: NLA_U32
+ *    WGDEVICE_A_FEATURES: NLA_U32
+ *    WGDEVICE_A_STATS: NLA_NESTED
+ *        WGDEVICE_STAT_A_STEER_HITS: NLA_U64
+ *        WGDEVICE_STAT_A_STEER_MISSES: NLA_U64
+ *        WGDEVICE_STAT_A_STEER_REDIRECTS: NLA_U64
+ *        WGDEVICE_STAT_A_RX_COPIES_AVOIDED: NLA_U64
+ *        WGDEVICE_STAT_A_TX_COPIES_AVOIDED: NLA_U64
+ *        WGDEVICE_STAT_A_RX_LINEAR: NLA_U64
+ *        WGDEVICE_STAT_A_RX_SCATTERGATHER: NLA_U64
+ *        WGDEVICE_STAT_A_TX_LINEAR: NLA_U64
+ *        WGDEVICE_STAT_A_TX_SCATTERGATHER: NLA_U64
+ *        WGDEVICE_STAT_A_HANDSHAKES_QUEUED: NLA_U64
+ *        WGDEVICE_STAT_A_HANDSHAKES_DROPPED: NLA_U64
+ *        WGDEVICE_STAT_A_HANDSHAKES_STOLEN: NLA_U64
+ *        WGDEVICE_STAT_A_HANDSHAKES_BAD_MAC: NLA_U64
+ *        WGDEVICE_STAT_A_HANDSHAKE_LOAD_TRANSITIONS: NLA_U64
+ *    WGDEVICE_A_HANDSHAKE_RATE: NLA_U32
+ *    WGDEVICE_A_HANDSHAKE_BACKLOG: NLA_U32
+ *    WGDEVICE_A_HANDSHAKE_UNDER_LOAD: NLA_U8
+ *    WGDEVICE_A_HANDSHAKE_SOJOURN: NLA_U32
  *    WGDEVICE_A_PEERS: NLA_NESTED
  *        0: NLA_NESTED
  *            WGPEER_A_PUBLIC_KEY: NLA_EXACT_LEN, len WG_KEY_LEN
@@ -49,10 +69,20 @@
  *                    ...
  *                ...
  *            WGPEER_A_PROTOCOL_VERSION: NLA_U32
+ *            WGPEER_A_RX_PACKETS: NLA_U64
+ *            WGPEER_A_TX_PACKETS: NLA_U64
+ *            WGPEER_A_RX_DROPPED: NLA_U64
+ *            WGPEER_A_TX_DROPPED: NLA_U64
  *        0: NLA_NESTED
  *            ...
  *        ...
  *
+ * WGDEVICE_A_HANDSHAKE_UNDER_LOAD is 1 while the device is under handshake
+ * load, and so requires cookies, or 0 otherwise, and
+ * WGDEVICE_STAT_A_HANDSHAKE_LOAD_TRANSITIONS counts the times it has come under
+ * load. WGDEVICE_A_HANDSHAKE_SOJOURN is the average time, in microseconds,
+ * that incoming handshake messages have recently waited to be processed.
+ *
  * It is possible that all of the allowed IPs of a single peer will not
  * fit within a single netlink message. In that case, the same peer will
  * be written in the following message, except it will only contain
@@ -83,6 +113,37 @@
  *    WGDEVICE_A_PRIVATE_KEY: len WG_KEY_LEN, all zeros to remove
  *    WGDEVICE_A_LISTEN_PORT: NLA_U16, 0 to choose randomly
  *    WGDEVICE_A_FWMARK: NLA_U32, 0 to disable
+ *    WGDEVICE_A_FEATURES: NLA_U32, 0 and/or WGDEVICE_FEATURE_SHARED_NAPI if
+ *                         received packets of all peers should be delivered
+ *                         through one NAPI context per CPU, rather than
+ *                         through one NAPI context per peer, and/or
+ *                         WGDEVICE_FEATURE_THREADED_NAPI if those NAPI
+ *                         contexts should be run by kernel threads, rather
+ *                         than in softirq, and/or WGDEVICE_FEATURE_BUSY_POLL
+ *                         if sockets receiving from the device may busy poll
+ *                         those NAPI contexts, and/or
+ *                         WGDEVICE_FEATURE_FLOW_STEERING if NAPI contexts
+ *                         should be scheduled on the CPU where the
+ *                         application last read the flow that was most
+ *                         recently received from the peer, according to the
+ *                         RFS socket flow table. Steering is per peer, not per
+ *                         flow: all of a peer's packets follow its most recent
+ *                         flow, and with WGDEVICE_FEATURE_SHARED_NAPI, so do
+ *                         those of the peers sharing its context. It has no
+ *                         effect unless RFS is enabled, with
+ *                         net.core.rps_sock_flow_entries set to a nonzero
+ *                         value. WGDEVICE_FEATURE_SHARED_NAPI
+ *                         and WGDEVICE_FEATURE_BUSY_POLL may only be changed
+ *                         while the device has no peers, after
+ *                         WGDEVICE_F_REPLACE_PEERS has been applied, and
+ *                         otherwise fail with EBUSY. Features not supported
+ *                         by the running kernel fail with EOPNOTSUPP.
+ *    WGDEVICE_A_HANDSHAKE_RATE: NLA_U32, the maximum number of handshake
+ *                               initiations sent per second across all peers,
+ *                               0 for no limit. Initiations beyond it wait in
+ *                               a backlog, the length of which is returned by
+ *                               WG_CMD_GET_DEVICE as
+ *                               WGDEVICE_A_HANDSHAKE_BACKLOG.
  *    WGDEVICE_A_PEERS: NLA_NESTED
  *        0: NLA_NESTED
  *            WGPEER_A_PUBLIC_KEY: len WG_KEY_LEN
@@ -147,6 +208,16 @@ enum wgdevice_flag {
 	WGDEVICE_F_REPLACE_PEERS = 1U << 0,
 	__WGDEVICE_F_ALL = WGDEVICE_F_REPLACE_PEERS
 };
+enum wgdevice_feature {
+	WGDEVICE_FEATURE_SHARED_NAPI = 1U << 0,
+	WGDEVICE_FEATURE_THREADED_NAPI = 1U << 1,
+	WGDEVICE_FEATURE_BUSY_POLL = 1U << 2,
+	WGDEVICE_FEATURE_FLOW_STEERING = 1U << 3,
+	__WGDEVICE_FEATURE_ALL = WGDEVICE_FEATURE_SHARED_NAPI |
+				 WGDEVICE_FEATURE_THREADED_NAPI |
+				 WGDEVICE_FEATURE_BUSY_POLL |
+				 WGDEVICE_FEATURE_FLOW_STEERING
+};
 enum wgdevice_attribute {
 	WGDEVICE_A_UNSPEC,
 	WGDEVICE_A_IFINDEX,
@@ -157,10 +228,36 @@ enum wgdevice_attribute {
 	WGDEVICE_A_LISTEN_PORT,
 	WGDEVICE_A_FWMARK,
 	WGDEVICE_A_PEERS,
+	WGDEVICE_A_FEATURES,
+	WGDEVICE_A_STATS,
+	WGDEVICE_A_HANDSHAKE_RATE,
+	WGDEVICE_A_HANDSHAKE_BACKLOG,
+	WGDEVICE_A_HANDSHAKE_UNDER_LOAD,
+	WGDEVICE_A_HANDSHAKE_SOJOURN,
 	__WGDEVICE_A_LAST
 };
 #define WGDEVICE_A_MAX (__WGDEVICE_A_LAST - 1)
 
+enum wgdevice_stat_attribute {
+	WGDEVICE_STAT_A_UNSPEC,
+	WGDEVICE_STAT_A_STEER_HITS,
+	WGDEVICE_STAT_A_STEER_MISSES,
+	WGDEVICE_STAT_A_STEER_REDIRECTS,
+	WGDEVICE_STAT_A_RX_COPIES_AVOIDED,
+	WGDEVICE_STAT_A_TX_COPIES_AVOIDED,
+	WGDEVICE_STAT_A_RX_LINEAR,
+	WGDEVICE_STAT_A_RX_SCATTERGATHER,
+	WGDEVICE_STAT_A_TX_LINEAR,
+	WGDEVICE_STAT_A_TX_SCATTERGATHER,
+	WGDEVICE_STAT_A_HANDSHAKES_QUEUED,
+	WGDEVICE_STAT_A_HANDSHAKES_DROPPED,
+	WGDEVICE_STAT_A_HANDSHAKES_STOLEN,
+	WGDEVICE_STAT_A_HANDSHAKES_BAD_MAC,
+	WGDEVICE_STAT_A_HANDSHAKE_LOAD_TRANSITIONS,
+	__WGDEVICE_STAT_A_LAST
+};
+#define WGDEVICE_STAT_A_MAX (__WGDEVICE_STAT_A_LAST - 1)
+
 enum wgpeer_flag {
 	WGPEER_F_REMOVE_ME = 1U << 0,
 	WGPEER_F_REPLACE_ALLOWEDIPS = 1U << 1,
@@ -180,6 +277,10 @@ enum wgpeer_attribute {
 	WGPEER_A_TX_BYTES,
 	WGPEER_A_ALLOWEDIPS,
 	WGPEER_A_PROTOCOL_VERSION,
+	WGPEER_A_RX_PACKETS,
+	WGPEER_A_TX_PACKETS,
+	WGPEER_A_RX_DROPPED,
+	WGPEER_A_TX_DROPPED,
 	__WGPEER_A_LAST
 };
 #define WGPEER_A_MAX (__WGPEER_A_LAST - 1)